@@ -25,6 +25,7 @@
 #include "googlechat_json.h"
 #include "googlechat_connection.h"
 #include "googlechat_conversation.h"
+#include "googlechat_events.h"
 
 
 typedef struct {
@@ -273,7 +274,7 @@ void
 googlechat_auth_get_dynamite_token_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *response, gpointer user_data)
 {
 	GoogleChatAccount *ha = user_data;
-	guint64 last_event_timestamp;
+	gint64 last_event_timestamp;
 	JsonObject *obj;
 	const gchar *raw_response;
 	gsize response_len;
@@ -296,11 +297,11 @@ googlechat_auth_get_dynamite_token_cb(PurpleHttpConnection *http_conn, PurpleHtt
 	g_free(ha->access_token);
 	ha->access_token = g_strdup(json_object_get_string_member(obj, "token"));
 	
-	//Restore the last_event_timestamp before it gets overridden by new events
-	last_event_timestamp = purple_account_get_int(ha->account, "last_event_timestamp_high", 0);
+	//Restore the last_event_timestamp before it gets overridden by new events, minding any we've seen but not saved yet
+	last_event_timestamp = MAX(googlechat_load_last_event_timestamp(ha), ha->last_event_timestamp_received);
 	if (last_event_timestamp != 0) {
-		last_event_timestamp = (last_event_timestamp << 32) | ((guint64) purple_account_get_int(ha->account, "last_event_timestamp_low", 0) & 0xFFFFFFFF);
 		ha->last_event_timestamp = last_event_timestamp;
+		ha->last_event_timestamp_received = last_event_timestamp;
 	}
 	
 	// SOUND THE TRUMPETS
@@ -315,7 +316,7 @@ googlechat_auth_get_dynamite_token_cb(PurpleHttpConnection *http_conn, PurpleHtt
 	if (ha->poll_buddy_status_timeout) {
 		g_source_remove(ha->poll_buddy_status_timeout);
 	}
-	ha->poll_buddy_status_timeout = g_timeout_add_seconds(120, googlechat_poll_buddy_status, ha);
+	ha->poll_buddy_status_timeout = g_timeout_add_seconds(GOOGLECHAT_PRESENCE_POLL_TICK, googlechat_poll_buddy_status, ha);
 	
 	gint expires_in = atoi(json_object_get_string_member(obj, "expiresIn"));
 	if (expires_in > 30) {
@@ -0,0 +1,566 @@
+/*
+ * GoogleChat Plugin for libpurple/Pidgin
+ * Copyright (c) 2015-2016 Eion Robb, Mike Ruprecht
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "googlechat_cache.h"
+
+#include <string.h>
+#include <time.h>
+#include <glib/gstdio.h>
+
+#include "debug.h"
+#include "util.h"
+#include "glibcompat.h"
+
+/*
+ * The user cache file is a small header followed by one record per user:
+ *   gint64 fetched_at (seconds, little-endian)
+ *   guint32 length (little-endian)
+ *   length bytes of packed User protobuf
+ */
+#define GOOGLECHAT_USER_CACHE_MAGIC "GCUC"
+#define GOOGLECHAT_USER_CACHE_VERSION 1
+
+typedef struct {
+	gint64 fetched_at;
+	guint8 *packed;
+	gsize packed_len;
+	User *user;
+} GoogleChatCachedUser;
+
+static void
+googlechat_cached_user_free(gpointer data)
+{
+	GoogleChatCachedUser *cached = data;
+	
+	if (cached->user != NULL) {
+		protobuf_c_message_free_unpacked((ProtobufCMessage *) cached->user, NULL);
+	}
+	g_free(cached->packed);
+	g_free(cached);
+}
+
+/* Takes ownership of packed */
+static gboolean
+googlechat_user_cache_insert(GoogleChatAccount *ha, gint64 fetched_at, guint8 *packed, gsize packed_len)
+{
+	GoogleChatCachedUser *cached;
+	User *user;
+	
+	user = (User *) protobuf_c_message_unpack(&user__descriptor, NULL, packed_len, packed);
+	if (user == NULL || user->user_id == NULL || user->user_id->id == NULL) {
+		if (user != NULL) {
+			protobuf_c_message_free_unpacked((ProtobufCMessage *) user, NULL);
+		}
+		g_free(packed);
+		return FALSE;
+	}
+	
+	cached = g_new0(GoogleChatCachedUser, 1);
+	cached->fetched_at = fetched_at;
+	cached->packed = packed;
+	cached->packed_len = packed_len;
+	cached->user = user;
+	
+	g_hash_table_replace(ha->user_cache, g_strdup(user->user_id->id), cached);
+	return TRUE;
+}
+
+static gchar *
+googlechat_user_cache_filename(GoogleChatAccount *ha)
+{
+	gchar *basename = g_strdup_printf("%s.users", purple_escape_filename(purple_account_get_username(ha->account)));
+	gchar *filename = g_build_filename(purple_cache_dir(), "googlechat", basename, NULL);
+	
+	g_free(basename);
+	return filename;
+}
+
+void
+googlechat_user_cache_load(GoogleChatAccount *ha)
+{
+	gchar *filename;
+	GMappedFile *file;
+	const guint8 *data, *end;
+	guint count = 0;
+	
+	if (ha->user_cache == NULL) {
+		ha->user_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, googlechat_cached_user_free);
+	}
+	
+	filename = googlechat_user_cache_filename(ha);
+	file = g_mapped_file_new(filename, FALSE, NULL);
+	g_free(filename);
+	if (file == NULL) {
+		return;
+	}
+	
+	data = (const guint8 *) g_mapped_file_get_contents(file);
+	end = data + g_mapped_file_get_length(file);
+	
+	if (end - data < 8 || memcmp(data, GOOGLECHAT_USER_CACHE_MAGIC, 4) != 0 ||
+			GUINT32_FROM_LE(*(const guint32 *) (data + 4)) != GOOGLECHAT_USER_CACHE_VERSION) {
+		purple_debug_warning("googlechat", "Ignoring unrecognised user cache\n");
+		g_mapped_file_unref(file);
+		return;
+	}
+	data += 8;
+	
+	while (end - data >= 12) {
+		gint64 fetched_at;
+		guint32 len;
+		
+		memcpy(&fetched_at, data, 8);
+		memcpy(&len, data + 8, 4);
+		fetched_at = GINT64_FROM_LE(fetched_at);
+		len = GUINT32_FROM_LE(len);
+		data += 12;
+		
+		if ((gsize) (end - data) < len) {
+			purple_debug_warning("googlechat", "User cache is truncated\n");
+			break;
+		}
+		
+		if (googlechat_user_cache_insert(ha, fetched_at, g_memdup(data, len), len)) {
+			count++;
+		}
+		data += len;
+	}
+	
+	g_mapped_file_unref(file);
+	
+	purple_debug_info("googlechat", "Loaded %u cached user profiles\n", count);
+}
+
+void
+googlechat_user_cache_save(GoogleChatAccount *ha)
+{
+	GByteArray *out;
+	GHashTableIter iter;
+	gpointer value;
+	gchar *filename, *dirname;
+	guint32 version = GUINT32_TO_LE(GOOGLECHAT_USER_CACHE_VERSION);
+	GError *error = NULL;
+	
+	if (ha->user_cache_save_timeout) {
+		g_source_remove(ha->user_cache_save_timeout);
+		ha->user_cache_save_timeout = 0;
+	}
+	
+	if (ha->user_cache == NULL || !ha->user_cache_dirty) {
+		return;
+	}
+	
+	out = g_byte_array_sized_new(8 + g_hash_table_size(ha->user_cache) * 128);
+	g_byte_array_append(out, (const guint8 *) GOOGLECHAT_USER_CACHE_MAGIC, 4);
+	g_byte_array_append(out, (const guint8 *) &version, 4);
+	
+	g_hash_table_iter_init(&iter, ha->user_cache);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		GoogleChatCachedUser *cached = value;
+		gint64 fetched_at = GINT64_TO_LE(cached->fetched_at);
+		guint32 len = GUINT32_TO_LE((guint32) cached->packed_len);
+		
+		g_byte_array_append(out, (const guint8 *) &fetched_at, 8);
+		g_byte_array_append(out, (const guint8 *) &len, 4);
+		g_byte_array_append(out, cached->packed, cached->packed_len);
+	}
+	
+	filename = googlechat_user_cache_filename(ha);
+	dirname = g_path_get_dirname(filename);
+	g_mkdir_with_parents(dirname, 0700);
+	
+	if (g_file_set_contents(filename, (const gchar *) out->data, out->len, &error)) {
+		ha->user_cache_dirty = FALSE;
+	} else {
+		purple_debug_error("googlechat", "Could not write user cache: %s\n", error->message);
+		g_error_free(error);
+	}
+	
+	g_free(dirname);
+	g_free(filename);
+	g_byte_array_free(out, TRUE);
+}
+
+static gboolean
+googlechat_user_cache_save_cb(gpointer data)
+{
+	GoogleChatAccount *ha = data;
+	
+	ha->user_cache_save_timeout = 0;
+	googlechat_user_cache_save(ha);
+	
+	return FALSE;
+}
+
+void
+googlechat_user_cache_free(GoogleChatAccount *ha)
+{
+	googlechat_user_cache_save(ha);
+	
+	if (ha->user_cache != NULL) {
+		g_hash_table_destroy(ha->user_cache);
+		ha->user_cache = NULL;
+	}
+}
+
+User *
+googlechat_user_cache_lookup(GoogleChatAccount *ha, const gchar *gaia_id, gboolean *stale)
+{
+	GoogleChatCachedUser *cached;
+	
+	if (ha->user_cache == NULL || gaia_id == NULL) {
+		return NULL;
+	}
+	
+	cached = g_hash_table_lookup(ha->user_cache, gaia_id);
+	if (cached == NULL) {
+		return NULL;
+	}
+	
+	if (stale != NULL) {
+		*stale = (time(NULL) - cached->fetched_at) >= GOOGLECHAT_USER_CACHE_TTL;
+	}
+	return cached->user;
+}
+
+void
+googlechat_user_cache_store(GoogleChatAccount *ha, const User *user)
+{
+	guint8 *packed;
+	gsize packed_len;
+	
+	if (ha->user_cache == NULL || user == NULL || user->user_id == NULL || user->user_id->id == NULL) {
+		return;
+	}
+	
+	packed_len = protobuf_c_message_get_packed_size((const ProtobufCMessage *) user);
+	packed = g_malloc(packed_len ? packed_len : 1);
+	protobuf_c_message_pack((const ProtobufCMessage *) user, packed);
+	
+	if (googlechat_user_cache_insert(ha, time(NULL), packed, packed_len)) {
+		ha->user_cache_dirty = TRUE;
+		
+		if (ha->user_cache_save_timeout == 0) {
+			ha->user_cache_save_timeout = g_timeout_add_seconds(GOOGLECHAT_USER_CACHE_SAVE_DELAY, googlechat_user_cache_save_cb, ha);
+		}
+	}
+}
+
+/*
+ * The world cache file holds the conversation directory from the last
+ * paginated_world response, so that startup doesn't have to wait on it:
+ *   gint64 synced_at (seconds, little-endian)
+ *   guint32 token length (little-endian), then the world_consistency_token
+ * followed by one record per conversation:
+ *   guint32 length (little-endian)
+ *   length bytes of packed WorldItemLite protobuf
+ */
+#define GOOGLECHAT_WORLD_CACHE_MAGIC "GCWC"
+#define GOOGLECHAT_WORLD_CACHE_VERSION 1
+
+typedef struct {
+	guint8 *packed;
+	gsize packed_len;
+	WorldItemLite *item;
+} GoogleChatCachedWorldItem;
+
+static void
+googlechat_cached_world_item_free(gpointer data)
+{
+	GoogleChatCachedWorldItem *cached = data;
+	
+	if (cached->item != NULL) {
+		protobuf_c_message_free_unpacked((ProtobufCMessage *) cached->item, NULL);
+	}
+	g_free(cached->packed);
+	g_free(cached);
+}
+
+static const gchar *
+googlechat_world_item_conv_id(const WorldItemLite *item)
+{
+	GroupId *group_id = item->group_id;
+	
+	if (group_id == NULL) {
+		return NULL;
+	}
+	if (group_id->dm_id != NULL) {
+		return group_id->dm_id->dm_id;
+	}
+	if (group_id->space_id != NULL) {
+		return group_id->space_id->space_id;
+	}
+	return NULL;
+}
+
+/* Takes ownership of packed */
+static gboolean
+googlechat_world_cache_insert(GoogleChatAccount *ha, guint8 *packed, gsize packed_len)
+{
+	GoogleChatCachedWorldItem *cached;
+	WorldItemLite *item;
+	const gchar *conv_id;
+	
+	item = (WorldItemLite *) protobuf_c_message_unpack(&world_item_lite__descriptor, NULL, packed_len, packed);
+	conv_id = item ? googlechat_world_item_conv_id(item) : NULL;
+	
+	// Anything googlechat_got_conversation_list() would trip over isn't worth keeping
+	if (conv_id == NULL || item->read_state == NULL ||
+			(item->group_id->dm_id != NULL && (item->dm_members == NULL || item->dm_members->n_members < 2))) {
+		if (item != NULL) {
+			protobuf_c_message_free_unpacked((ProtobufCMessage *) item, NULL);
+		}
+		g_free(packed);
+		return FALSE;
+	}
+	
+	cached = g_new0(GoogleChatCachedWorldItem, 1);
+	cached->packed = packed;
+	cached->packed_len = packed_len;
+	cached->item = item;
+	
+	g_hash_table_replace(ha->world_cache, g_strdup(conv_id), cached);
+	return TRUE;
+}
+
+static gchar *
+googlechat_world_cache_filename(GoogleChatAccount *ha)
+{
+	gchar *basename = g_strdup_printf("%s.world", purple_escape_filename(purple_account_get_username(ha->account)));
+	gchar *filename = g_build_filename(purple_cache_dir(), "googlechat", basename, NULL);
+	
+	g_free(basename);
+	return filename;
+}
+
+void
+googlechat_world_cache_load(GoogleChatAccount *ha)
+{
+	gchar *filename;
+	GMappedFile *file;
+	const guint8 *data, *end;
+	gint64 synced_at;
+	guint32 token_len;
+	
+	if (ha->world_cache == NULL) {
+		ha->world_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, googlechat_cached_world_item_free);
+	}
+	
+	filename = googlechat_world_cache_filename(ha);
+	file = g_mapped_file_new(filename, FALSE, NULL);
+	g_free(filename);
+	if (file == NULL) {
+		return;
+	}
+	
+	data = (const guint8 *) g_mapped_file_get_contents(file);
+	end = data + g_mapped_file_get_length(file);
+	
+	if (end - data < 20 || memcmp(data, GOOGLECHAT_WORLD_CACHE_MAGIC, 4) != 0 ||
+			GUINT32_FROM_LE(*(const guint32 *) (data + 4)) != GOOGLECHAT_WORLD_CACHE_VERSION) {
+		purple_debug_warning("googlechat", "Ignoring unrecognised conversation cache\n");
+		g_mapped_file_unref(file);
+		return;
+	}
+	
+	memcpy(&synced_at, data + 8, 8);
+	memcpy(&token_len, data + 16, 4);
+	synced_at = GINT64_FROM_LE(synced_at);
+	token_len = GUINT32_FROM_LE(token_len);
+	data += 20;
+	
+	if ((gsize) (end - data) < token_len) {
+		purple_debug_warning("googlechat", "Conversation cache is truncated\n");
+		g_mapped_file_unref(file);
+		return;
+	}
+	
+	g_free(ha->world_consistency_token);
+	ha->world_consistency_token = token_len ? g_strndup((const gchar *) data, token_len) : NULL;
+	ha->world_synced_at = synced_at;
+	data += token_len;
+	
+	while (end - data >= 4) {
+		guint32 len;
+		
+		memcpy(&len, data, 4);
+		len = GUINT32_FROM_LE(len);
+		data += 4;
+		
+		if ((gsize) (end - data) < len) {
+			purple_debug_warning("googlechat", "Conversation cache is truncated\n");
+			break;
+		}
+		
+		googlechat_world_cache_insert(ha, g_memdup(data, len), len);
+		data += len;
+	}
+	
+	g_mapped_file_unref(file);
+	
+	purple_debug_info("googlechat", "Loaded %u cached conversations\n", g_hash_table_size(ha->world_cache));
+}
+
+void
+googlechat_world_cache_save(GoogleChatAccount *ha)
+{
+	GByteArray *out;
+	GHashTableIter iter;
+	gpointer key, value;
+	gchar *filename, *dirname;
+	guint32 version = GUINT32_TO_LE(GOOGLECHAT_WORLD_CACHE_VERSION);
+	gint64 synced_at = GINT64_TO_LE(ha->world_synced_at);
+	guint32 token_len = ha->world_consistency_token ? strlen(ha->world_consistency_token) : 0;
+	guint32 token_len_le = GUINT32_TO_LE(token_len);
+	GError *error = NULL;
+	
+	if (ha->world_cache == NULL) {
+		return;
+	}
+	
+	// Drop conversations we've since left, so they don't come back on the next login.
+	// Skipped until the directory has been applied, or a failed login would empty the cache.
+	if (g_hash_table_size(ha->one_to_ones) + g_hash_table_size(ha->group_chats) > 0) {
+		g_hash_table_iter_init(&iter, ha->world_cache);
+		while (g_hash_table_iter_next(&iter, &key, NULL)) {
+			if (!g_hash_table_contains(ha->one_to_ones, key) && !g_hash_table_contains(ha->group_chats, key)) {
+				g_hash_table_iter_remove(&iter);
+				ha->world_cache_dirty = TRUE;
+			}
+		}
+	}
+	
+	if (!ha->world_cache_dirty) {
+		return;
+	}
+	
+	out = g_byte_array_sized_new(20 + token_len + g_hash_table_size(ha->world_cache) * 256);
+	g_byte_array_append(out, (const guint8 *) GOOGLECHAT_WORLD_CACHE_MAGIC, 4);
+	g_byte_array_append(out, (const guint8 *) &version, 4);
+	g_byte_array_append(out, (const guint8 *) &synced_at, 8);
+	g_byte_array_append(out, (const guint8 *) &token_len_le, 4);
+	if (token_len) {
+		g_byte_array_append(out, (const guint8 *) ha->world_consistency_token, token_len);
+	}
+	
+	g_hash_table_iter_init(&iter, ha->world_cache);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		GoogleChatCachedWorldItem *cached = value;
+		guint32 len = GUINT32_TO_LE((guint32) cached->packed_len);
+		
+		g_byte_array_append(out, (const guint8 *) &len, 4);
+		g_byte_array_append(out, cached->packed, cached->packed_len);
+	}
+	
+	filename = googlechat_world_cache_filename(ha);
+	dirname = g_path_get_dirname(filename);
+	g_mkdir_with_parents(dirname, 0700);
+	
+	if (g_file_set_contents(filename, (const gchar *) out->data, out->len, &error)) {
+		ha->world_cache_dirty = FALSE;
+	} else {
+		purple_debug_error("googlechat", "Could not write conversation cache: %s\n", error->message);
+		g_error_free(error);
+	}
+	
+	g_free(dirname);
+	g_free(filename);
+	g_byte_array_free(out, TRUE);
+}
+
+void
+googlechat_world_cache_free(GoogleChatAccount *ha)
+{
+	googlechat_world_cache_save(ha);
+	
+	if (ha->world_cache != NULL) {
+		g_hash_table_destroy(ha->world_cache);
+		ha->world_cache = NULL;
+	}
+	g_free(ha->world_consistency_token);
+	ha->world_consistency_token = NULL;
+}
+
+const gchar *
+googlechat_world_cache_get_token(GoogleChatAccount *ha)
+{
+	if (ha->world_cache == NULL || g_hash_table_size(ha->world_cache) == 0) {
+		return NULL;
+	}
+	if (time(NULL) - ha->world_synced_at >= GOOGLECHAT_WORLD_CACHE_TTL) {
+		return NULL;
+	}
+	return ha->world_consistency_token;
+}
+
+WorldItemLite **
+googlechat_world_cache_get_items(GoogleChatAccount *ha, gsize *n_items)
+{
+	WorldItemLite **items;
+	GHashTableIter iter;
+	gpointer value;
+	gsize i = 0;
+	
+	*n_items = 0;
+	if (ha->world_cache == NULL || g_hash_table_size(ha->world_cache) == 0) {
+		return NULL;
+	}
+	
+	items = g_new(WorldItemLite *, g_hash_table_size(ha->world_cache));
+	g_hash_table_iter_init(&iter, ha->world_cache);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		items[i++] = ((GoogleChatCachedWorldItem *) value)->item;
+	}
+	
+	*n_items = i;
+	return items;
+}
+
+void
+googlechat_world_cache_update(GoogleChatAccount *ha, const PaginatedWorldResponse *response, gboolean is_delta)
+{
+	gsize i;
+	
+	if (ha->world_cache == NULL) {
+		return;
+	}
+	
+	if (!is_delta) {
+		g_hash_table_remove_all(ha->world_cache);
+	}
+	
+	for (i = 0; i < response->n_world_items; i++) {
+		const ProtobufCMessage *item = (const ProtobufCMessage *) response->world_items[i];
+		gsize packed_len = protobuf_c_message_get_packed_size(item);
+		guint8 *packed = g_malloc(packed_len ? packed_len : 1);
+		
+		protobuf_c_message_pack(item, packed);
+		googlechat_world_cache_insert(ha, packed, packed_len);
+	}
+	
+	if (response->world_consistency_token != NULL) {
+		g_free(ha->world_consistency_token);
+		ha->world_consistency_token = g_strdup(response->world_consistency_token);
+	}
+	if (!is_delta) {
+		ha->world_synced_at = time(NULL);
+	}
+	ha->world_cache_dirty = TRUE;
+	
+	googlechat_world_cache_save(ha);
+}
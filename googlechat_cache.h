@@ -0,0 +1,116 @@
+/*
+ * GoogleChat Plugin for libpurple/Pidgin
+ * Copyright (c) 2015-2016 Eion Robb, Mike Ruprecht
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GOOGLECHAT_CACHE_H_
+#define _GOOGLECHAT_CACHE_H_
+
+#include <glib.h>
+
+#include "libgooglechat.h"
+#include "googlechat.pb-c.h"
+
+// How long a cached user profile is trusted before it's fetched again
+#define GOOGLECHAT_USER_CACHE_TTL (24 * 60 * 60)
+// How long to wait after a change before writing the cache out
+#define GOOGLECHAT_USER_CACHE_SAVE_DELAY 10
+// How long the conversation directory is reconciled with deltas before it's fetched in full again
+#define GOOGLECHAT_WORLD_CACHE_TTL (7 * 24 * 60 * 60)
+
+/**
+ * Loads the account's user profile cache from disk, if there is one.
+ */
+void googlechat_user_cache_load(GoogleChatAccount *ha);
+
+/**
+ * Writes the user profile cache to disk, if it has changed since it was last written.
+ */
+void googlechat_user_cache_save(GoogleChatAccount *ha);
+
+/**
+ * Saves and then frees the user profile cache.
+ */
+void googlechat_user_cache_free(GoogleChatAccount *ha);
+
+/**
+ * Looks up a cached user profile.
+ *
+ * \param ha
+ *      The account.
+ * \param gaia_id
+ *      The user to look up.
+ * \param stale (optional, out)
+ *      Returns TRUE if the profile is older than GOOGLECHAT_USER_CACHE_TTL and should be fetched again.
+ * \return
+ *      The cached User, or NULL if there isn't one.  Owned by the cache.
+ */
+User *googlechat_user_cache_lookup(GoogleChatAccount *ha, const gchar *gaia_id, gboolean *stale);
+
+/**
+ * Stores a copy of a freshly-fetched user profile, and schedules the cache to be saved.
+ */
+void googlechat_user_cache_store(GoogleChatAccount *ha, const User *user);
+
+/**
+ * Loads the account's cached conversation directory and world_consistency_token from disk, if there is one.
+ */
+void googlechat_world_cache_load(GoogleChatAccount *ha);
+
+/**
+ * Writes the conversation directory to disk, leaving out any conversations that are no longer known.
+ */
+void googlechat_world_cache_save(GoogleChatAccount *ha);
+
+/**
+ * Saves and then frees the conversation directory.
+ */
+void googlechat_world_cache_free(GoogleChatAccount *ha);
+
+/**
+ * \return
+ *      The world_consistency_token to ask for a delta with, or NULL if the
+ *      cache is empty or older than GOOGLECHAT_WORLD_CACHE_TTL and a full
+ *      directory should be fetched instead.
+ */
+const gchar *googlechat_world_cache_get_token(GoogleChatAccount *ha);
+
+/**
+ * Gets every cached conversation, to serve the directory before the server has answered.
+ *
+ * \param ha
+ *      The account.
+ * \param n_items (out)
+ *      Returns the number of items.
+ * \return
+ *      A newly-allocated array to be g_free()'d, of WorldItemLite's owned by the cache.
+ */
+WorldItemLite **googlechat_world_cache_get_items(GoogleChatAccount *ha, gsize *n_items);
+
+/**
+ * Merges a paginated_world response into the cache and writes it out.
+ *
+ * \param ha
+ *      The account.
+ * \param response
+ *      The response from the server.
+ * \param is_delta
+ *      TRUE if the request carried a world_consistency_token, so the response only
+ *      holds what changed.  Otherwise the cache is replaced by the response.
+ */
+void googlechat_world_cache_update(GoogleChatAccount *ha, const PaginatedWorldResponse *response, gboolean is_delta);
+
+#endif /*_GOOGLECHAT_CACHE_H_*/
@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <glib/gstdio.h>
 
 #include <purple.h>
 
@@ -34,167 +35,458 @@
 #include "googlechat_events.h"
 
 
+typedef struct {
+	gint64 aid;
+	const gchar *status;  // Borrowed, not NUL-terminated
+	gsize status_len;
+	const gchar *data;    // Borrowed base64 protobuf, not NUL-terminated
+	gsize data_len;
+} GoogleChatChannelEntry;
+
+static void
+googlechat_process_channel_entry(GoogleChatAccount *ha, const GoogleChatChannelEntry *entry)
+{
+	ha->last_aid = MAX(ha->last_aid, entry->aid);
+	
+	if (entry->status != NULL) {
+		purple_debug_misc("googlechat", "Received event status string: '%.*s'\n", (int) entry->status_len, entry->status);
+		
+		//probably a nooooop
+		if (entry->status_len == 4 && strncmp(entry->status, "noop", 4) == 0) {
+			//A nope ninja delivers a wicked dragon kick
+#ifdef DEBUG
+			printf("noop\n");
+#endif
+		}
+	} else if (entry->data != NULL) {
+		purple_debug_misc("googlechat", "Received event data chunk\n");
+		//Contains protobuf data, base64 encoded
+		ProtobufCMessage *unpacked_message;
+		ProtobufCAllocator *allocator;
+		StreamEventsResponse *events_response;
+		guchar *decoded_response;
+		gsize response_len;
+		
+		decoded_response = googlechat_base64_decode_into(ha->base64_scratch, entry->data, entry->data_len, &response_len);
+		allocator = googlechat_arena_acquire(ha->protobuf_arena);
+		unpacked_message = protobuf_c_message_unpack(&stream_events_response__descriptor, allocator, response_len, decoded_response);
+		
+		if (unpacked_message != NULL) {
+			events_response = (StreamEventsResponse *) unpacked_message;
+			
+			ha->channel_events_received++;
+			googlechat_process_received_event(ha, events_response->event);
+		} else {
+			purple_debug_error("googlechat", "Error decoding stream event!\n");
+		}
+		
+		// The unpacked message is thrown away with the rest of the arena
+		googlechat_arena_release(ha->protobuf_arena);
+	} else {
+		purple_debug_misc("googlechat", "Received event with no data chunk\n");
+	}
+}
+
+/*
+ * A small scanner for the usual [[aid,["noop"]],[aid,[{"data":"..."}]],...] envelope,
+ * which hands out slices of the frame instead of building a JsonArray (and copying the
+ * base64 payload into it).  Anything it doesn't recognise is left to json-glib.
+ */
+
+static gboolean
+googlechat_channel_expect(const gchar **pos, const gchar *end, gchar c)
+{
+	const gchar *p = *pos;
+	
+	while (p < end && g_ascii_isspace(*p)) {
+		p++;
+	}
+	if (p == end || *p != c) {
+		return FALSE;
+	}
+	
+	*pos = p + 1;
+	return TRUE;
+}
+
+static gboolean
+googlechat_channel_read_string(const gchar **pos, const gchar *end, const gchar **str, gsize *str_len)
+{
+	const gchar *start, *close;
+	
+	if (!googlechat_channel_expect(pos, end, '"')) {
+		return FALSE;
+	}
+	
+	start = *pos;
+	close = memchr(start, '"', end - start);
+	if (close == NULL || memchr(start, '\\', close - start) != NULL) {
+		// Escaped strings need unescaping, so leave them to json-glib
+		return FALSE;
+	}
+	
+	*str = start;
+	*str_len = close - start;
+	*pos = close + 1;
+	return TRUE;
+}
+
+static gboolean
+googlechat_channel_read_entry(const gchar **pos, const gchar *end, GoogleChatChannelEntry *entry)
+{
+	const gchar *key;
+	gsize key_len;
+	
+	memset(entry, 0, sizeof(*entry));
+	
+	if (!googlechat_channel_expect(pos, end, '[')) {
+		return FALSE;
+	}
+	
+	while (*pos < end && g_ascii_isspace(**pos)) {
+		(*pos)++;
+	}
+	if (*pos == end || !g_ascii_isdigit(**pos)) {
+		return FALSE;
+	}
+	while (*pos < end && g_ascii_isdigit(**pos)) {
+		entry->aid = (entry->aid * 10) + (**pos - '0');
+		(*pos)++;
+	}
+	
+	if (!googlechat_channel_expect(pos, end, ',') || !googlechat_channel_expect(pos, end, '[')) {
+		return FALSE;
+	}
+	
+	if (googlechat_channel_expect(pos, end, '{')) {
+		if (!googlechat_channel_read_string(pos, end, &key, &key_len) ||
+				key_len != 4 || strncmp(key, "data", 4) != 0 ||
+				!googlechat_channel_expect(pos, end, ':') ||
+				!googlechat_channel_read_string(pos, end, &entry->data, &entry->data_len) ||
+				!googlechat_channel_expect(pos, end, '}')) {
+			return FALSE;
+		}
+	} else if (!googlechat_channel_read_string(pos, end, &entry->status, &entry->status_len)) {
+		return FALSE;
+	}
+	
+	return googlechat_channel_expect(pos, end, ']') && googlechat_channel_expect(pos, end, ']');
+}
+
+/* Walks the envelope, either just checking it or processing each entry too */
+static gboolean
+googlechat_channel_scan_entries(GoogleChatAccount *ha, const gchar *data, gsize len, gboolean process)
+{
+	const gchar *pos = data;
+	const gchar *end = data + len;
+	GoogleChatChannelEntry entry;
+	
+	if (!googlechat_channel_expect(&pos, end, '[')) {
+		return FALSE;
+	}
+	
+	if (!googlechat_channel_expect(&pos, end, ']')) {
+		do {
+			if (!googlechat_channel_read_entry(&pos, end, &entry)) {
+				return FALSE;
+			}
+			if (process) {
+				googlechat_process_channel_entry(ha, &entry);
+			}
+		} while (googlechat_channel_expect(&pos, end, ','));
+		
+		if (!googlechat_channel_expect(&pos, end, ']')) {
+			return FALSE;
+		}
+	}
+	
+	while (pos < end && g_ascii_isspace(*pos)) {
+		pos++;
+	}
+	return pos == end;
+}
+
 void
 googlechat_process_data_chunks(GoogleChatAccount *ha, const gchar *data, gsize len)
 {
 	JsonArray *chunks;
 	guint i, num_chunks;
 	
+	// Check the whole frame first, so that nothing gets processed twice if we have to fall back
+	if (googlechat_channel_scan_entries(ha, data, len, FALSE)) {
+		googlechat_channel_scan_entries(ha, data, len, TRUE);
+		return;
+	}
+	
 	chunks = json_decode_array(data, len);
 	
 	for (i = 0, num_chunks = json_array_get_length(chunks); i < num_chunks; i++) {
+		GoogleChatChannelEntry entry;
 		JsonArray *chunk;
 		JsonArray *array;
 		JsonNode *array0;
-		gint64 aid;
 		
+		memset(&entry, 0, sizeof(entry));
 		chunk = json_array_get_array_element(chunks, i);
 		
-		aid = json_array_get_int_element(chunk, 0);
-		ha->last_aid = MAX(ha->last_aid, aid);
+		entry.aid = json_array_get_int_element(chunk, 0);
 		
 		array = json_array_get_array_element(chunk, 1);
 		array0 = json_array_get_element(array, 0);
 		if (JSON_NODE_HOLDS_VALUE(array0)) {
-			const gchar *status_string = json_node_get_string(array0);
-			purple_debug_misc("googlechat", "Received event status string: '%s'\n", status_string ? status_string : "(null)");
-			
-			//probably a nooooop
-			if (g_strcmp0(status_string, "noop") == 0) {
-				//A nope ninja delivers a wicked dragon kick
-#ifdef DEBUG
-				printf("noop\n");
-#endif
+			entry.status = json_node_get_string(array0);
+			if (entry.status == NULL) {
+				entry.status = "(null)";
 			}
+			entry.status_len = strlen(entry.status);
 		} else {
 			JsonObject *obj = json_node_get_object(array0);
-			if (json_object_has_member(obj, "data")) {
-				purple_debug_misc("googlechat", "Received event data chunk\n");
-				//Contains protobuf data, base64 encoded
-				ProtobufCMessage *unpacked_message;
-				StreamEventsResponse *events_response;
-				guchar *decoded_response;
-				gsize response_len;
-				const gchar *data = json_object_get_string_member(obj, "data");
-				
-				decoded_response = g_base64_decode(data, &response_len);
-				unpacked_message = protobuf_c_message_unpack(&stream_events_response__descriptor, NULL, response_len, decoded_response);
-				
-				events_response = (StreamEventsResponse *) unpacked_message;
-				
-				googlechat_process_received_event(ha, events_response->event);
-				
-				protobuf_c_message_free_unpacked(unpacked_message, NULL);
-				g_free(decoded_response);
-				
-				continue;
-			} else {
-				purple_debug_misc("googlechat", "Received event with no data chunk\n");
+			entry.data = json_object_get_string_member(obj, "data");
+			if (entry.data != NULL) {
+				entry.data_len = strlen(entry.data);
 			}
 		}
+		
+		googlechat_process_channel_entry(ha, &entry);
 	}
 	
 	json_array_unref(chunks);
 }
 
-static int
-read_all(int fd, void *buf, size_t len)
+static void
+googlechat_reset_channel_buffer(GoogleChatAccount *ha)
 {
-	unsigned int rs = 0;
-	while(rs < len)
-	{
-		int rval = read(fd, buf + rs, len - rs);
-		if (rval == 0)
-			break;
-		if (rval < 0)
-			return rval;
-
-		rs += rval;
-	}
-	return rs;
+	ha->channel_buffer_pos = 0;
+	ha->channel_chunk_len = 0;
+	ha->channel_chunk_len_done = FALSE;
+	ha->channel_buffer_high_water = ha->channel_buffer->len;
 }
 
-void
-googlechat_process_channel(int fd)
+/**
+ * Walks the buffered webchannel stream, handing each complete "<len>\n<chunk>"
+ * frame to googlechat_process_data_chunks() straight out of the buffer.
+ * Progress is kept in the account so that a frame split across reads is
+ * picked up where we left off.  Consumed bytes stay in the buffer until
+ * googlechat_compact_channel_buffer() is called.
+ *
+ * Returns FALSE if the length prefix of a frame is malformed (a non-digit,
+ * zero or more than GOOGLECHAT_CHANNEL_MAX_CHUNK_LEN), as the stream can't
+ * be framed any further and the channel has to be reset.
+ */
+gboolean
+googlechat_process_channel_buffer(GoogleChatAccount *ha)
 {
-	gsize len, lenpos = 0;
-	gchar len_str[256];
-	gchar *chunk;
-	
-	while(read(fd, len_str + lenpos, 1) > 0) {
-		//read up until \n
-		if (len_str[lenpos] == '\n') {
-			//convert to int, use as length of string to read
-			len_str[lenpos] = '\0';
-#ifdef DEBUG
-			printf("len_str is %s\n", len_str);
-#endif
-			len = atoi(len_str);
-			
-			chunk = g_new(gchar, len * 2);
-			//XX - could be a utf-16 length*2 though, so read up until \n????
+	const gchar *bufdata;
+	gsize bufsize;
+	gsize pos;
+	
+	g_return_val_if_fail(ha, FALSE);
+	g_return_val_if_fail(ha->channel_buffer, FALSE);
+	
+	bufdata = (gchar *) ha->channel_buffer->data;
+	bufsize = ha->channel_buffer->len;
+	pos = ha->channel_buffer_pos;
+	
+	while (pos < bufsize) {
+		if (!ha->channel_chunk_len_done) {
+			// Accumulate the length digits, which may arrive over several reads
+			while (pos < bufsize && bufdata[pos] != '\n') {
+				if (!g_ascii_isdigit(bufdata[pos])) {
+					purple_debug_error("googlechat", "Unexpected byte 0x%02x in chunk length\n", (guchar) bufdata[pos]);
+					return FALSE;
+				}
+				
+				ha->channel_chunk_len = (ha->channel_chunk_len * 10) + (bufdata[pos] - '0');
+				if (ha->channel_chunk_len > GOOGLECHAT_CHANNEL_MAX_CHUNK_LEN) {
+					purple_debug_error("googlechat", "Chunk length is over %d bytes\n", GOOGLECHAT_CHANNEL_MAX_CHUNK_LEN);
+					return FALSE;
+				}
+				pos++;
+			}
 			
-			if (read_all(fd, chunk, len) > 0) {
-				//throw chunk to googlechat_process_data_chunks
-				googlechat_process_data_chunks(NULL, chunk, len);
+			if (pos == bufsize) {
+				// Not enough data to read
+				if (purple_debug_is_verbose()) {
+					purple_debug_info("googlechat", "Couldn't find length of chunk\n");
+				}
+				break;
 			}
+			pos++; // skip the \n
 			
-			g_free(chunk);
+			if (ha->channel_chunk_len == 0) {
+				// Len was 0 ?  Must have been a bad read :(
+				purple_debug_error("googlechat", "Received zero-length chunk\n");
+				return FALSE;
+			}
 			
-			lenpos = 0;
-		} else {
-			lenpos = lenpos + 1;
+			ha->channel_chunk_len_done = TRUE;
 		}
+		
+		if (ha->channel_chunk_len > bufsize - pos) {
+			// Not enough data to read
+			if (purple_debug_is_verbose()) {
+				purple_debug_info("googlechat", "Couldn't read %" G_GSIZE_FORMAT " bytes when we only have %" G_GSIZE_FORMAT "\n", ha->channel_chunk_len, bufsize - pos);
+			}
+			break;
+		}
+		
+		googlechat_process_data_chunks(ha, bufdata + pos, ha->channel_chunk_len);
+		
+		pos += ha->channel_chunk_len;
+		ha->channel_chunk_len = 0;
+		ha->channel_chunk_len_done = FALSE;
 	}
+	
+	ha->channel_buffer_pos = pos;
+	
+	return TRUE;
 }
 
-void
-googlechat_process_channel_buffer(GoogleChatAccount *ha)
+static void
+googlechat_compact_channel_buffer(GoogleChatAccount *ha)
 {
-	const gchar *bufdata;
-	gsize bufsize;
-	gchar *len_end;
-	gchar *len_str;
-	guint len_len; //len len len len len len len len len
-	gsize len;
+	GByteArray *buffer = ha->channel_buffer;
+	gsize pos = ha->channel_buffer_pos;
 	
-	g_return_if_fail(ha);
-	g_return_if_fail(ha->channel_buffer);
+	ha->channel_buffer_high_water = MAX(ha->channel_buffer_high_water, buffer->len);
+	ha->channel_buffer_peak = MAX(ha->channel_buffer_peak, buffer->len);
 	
-	while (ha->channel_buffer->len) {
-		bufdata = (gchar *) ha->channel_buffer->data;
-		bufsize = ha->channel_buffer->len;
-		
-		len_end = g_strstr_len(bufdata, bufsize, "\n");
-		if (len_end == NULL) {
-			// Not enough data to read
-			if (purple_debug_is_verbose()) {
-				purple_debug_info("googlechat", "Couldn't find length of chunk\n");
-			}
-			return;
+	if (pos == 0) {
+		return;
+	}
+	
+	if (pos >= buffer->len) {
+		g_byte_array_set_size(buffer, 0);
+	} else {
+		g_byte_array_remove_range(buffer, 0, pos);
+	}
+	ha->channel_buffer_pos = 0;
+	
+	// A GByteArray never gives memory back, so once a big burst (eg a catch-up) has
+	// drained, swap in a small array rather than holding the peak until the channel closes
+	if (ha->channel_buffer_high_water > ha->channel_buffer_shrink_size && buffer->len <= GOOGLECHAT_BUFFER_DEFAULT_SIZE) {
+		if (purple_debug_is_verbose()) {
+			purple_debug_misc("googlechat", "Releasing channel buffer after it reached %" G_GSIZE_FORMAT " bytes\n", ha->channel_buffer_high_water);
 		}
-		len_len = len_end - bufdata;
-		len_str = g_strndup(bufdata, len_len);
-		len = (gsize) atoi(len_str);
-		g_free(len_str);
 		
-		// Len was 0 ?  Must have been a bad read :(
-		g_return_if_fail(len);
-		
-		bufsize = bufsize - len_len - 1;
+		ha->channel_buffer = g_byte_array_sized_new(GOOGLECHAT_BUFFER_DEFAULT_SIZE);
+		g_byte_array_append(ha->channel_buffer, buffer->data, buffer->len);
+		g_byte_array_free(buffer, TRUE);
+		ha->channel_buffer_high_water = ha->channel_buffer->len;
+	}
+}
+
+static void
+googlechat_record_channel_data(GoogleChatAccount *ha, const gchar *buffer, size_t length)
+{
+	if (ha->channel_recording == NULL) {
+		gchar *basename;
+		gchar *filename;
+		gchar *dirname;
 		
-		if (len > bufsize) {
-			// Not enough data to read
-			if (purple_debug_is_verbose()) {
-				purple_debug_info("googlechat", "Couldn't read %" G_GSIZE_FORMAT " bytes when we only have %" G_GSIZE_FORMAT "\n", len, bufsize);
-			}
+		if (!purple_account_get_bool(ha->account, "record_channel", FALSE)) {
 			return;
 		}
 		
-		googlechat_process_data_chunks(ha, bufdata + len_len + 1, len);
+		// A new file for each long-poll, as a recording has to start at the beginning of a frame
+		basename = g_strdup_printf("%s-%" G_GINT64_FORMAT ".stream", purple_escape_filename(purple_account_get_username(ha->account)), g_get_real_time());
+		filename = g_build_filename(purple_cache_dir(), "googlechat", basename, NULL);
+		dirname = g_path_get_dirname(filename);
+		g_mkdir_with_parents(dirname, 0700);
 		
-		g_byte_array_remove_range(ha->channel_buffer, 0, len + len_len + 1);
+		ha->channel_recording = g_fopen(filename, "wb");
+		if (ha->channel_recording == NULL) {
+			purple_debug_error("googlechat", "Could not open %s to record the stream\n", filename);
+		} else {
+			purple_debug_warning("googlechat", "Recording the stream, including message contents, to %s\n", filename);
+		}
 		
+		g_free(dirname);
+		g_free(filename);
+		g_free(basename);
+		
+		if (ha->channel_recording == NULL) {
+			return;
+		}
+	}
+	
+	if (fwrite(buffer, 1, length, ha->channel_recording) != length) {
+		purple_debug_error("googlechat", "Could not record stream data, stopping\n");
+		fclose(ha->channel_recording);
+		ha->channel_recording = NULL;
+		purple_account_set_bool(ha->account, "record_channel", FALSE);
+	}
+}
+
+// The access token goes to whatever server_url is, so only Google itself or a test server on this machine will do
+static gboolean
+googlechat_server_url_allowed(const gchar *server_url)
+{
+	const gchar *host;
+	gchar *hostname;
+	gboolean https = FALSE;
+	gboolean allowed;
+	gsize len;
+	
+	if (g_ascii_strncasecmp(server_url, "https://", 8) == 0) {
+		host = server_url + 8;
+		https = TRUE;
+	} else if (g_ascii_strncasecmp(server_url, "http://", 7) == 0) {
+		host = server_url + 7;
+	} else {
+		return FALSE;
+	}
+	
+	if (*host == '[') {
+		len = strcspn(host, "]");
+		if (host[len] == ']') {
+			len++;
+		}
+	} else {
+		len = strcspn(host, ":/?#@");
+		if (host[len] == '@') {
+			// No user:password@ to hide the real host behind
+			return FALSE;
+		}
+	}
+	hostname = g_ascii_strdown(host, len);
+	
+	if (purple_strequal(hostname, "localhost") || purple_strequal(hostname, "[::1]") ||
+	    (g_str_has_prefix(hostname, "127.") && strspn(hostname, "0123456789.") == len)) {
+		allowed = TRUE;
+	} else {
+		allowed = https && (purple_strequal(hostname, "google.com") || g_str_has_suffix(hostname, ".google.com"));
+	}
+	
+	g_free(hostname);
+	return allowed;
+}
+
+void
+googlechat_set_server_url(GoogleChatAccount *ha, const gchar *server_url)
+{
+	gsize len;
+	
+	if (server_url == NULL || !*server_url) {
+		server_url = GOOGLECHAT_PBLITE_API_URL;
+	} else if (!googlechat_server_url_allowed(server_url)) {
+		purple_debug_error("googlechat", "Ignoring server %s, only https Google hosts or localhost can be used\n", server_url);
+		server_url = GOOGLECHAT_PBLITE_API_URL;
+	}
+	
+	// Paths are appended with their leading slash
+	len = strlen(server_url);
+	while (len > 1 && server_url[len - 1] == '/') {
+		len--;
+	}
+	
+	g_free(ha->server_url);
+	g_free(ha->channel_url_prefix);
+	ha->server_url = g_strndup(server_url, len);
+	ha->channel_url_prefix = g_strconcat(ha->server_url, "/webchannel/", NULL);
+	
+	if (!purple_strequal(ha->server_url, GOOGLECHAT_PBLITE_API_URL)) {
+		purple_debug_warning("googlechat", "Using server %s\n", ha->server_url);
 	}
 }
 
@@ -204,7 +496,7 @@ googlechat_set_auth_headers(GoogleChatAccount *ha, PurpleHttpRequest *request)
 	purple_http_request_header_set_printf(request, "Authorization", "Bearer %s", ha->access_token);
 	
 	const gchar *request_url = purple_http_request_get_url(request);
-	if (g_str_has_prefix(request_url, "https://chat.google.com/webchannel/") && ha->csessionid_param) {
+	if (g_str_has_prefix(request_url, ha->channel_url_prefix) && ha->csessionid_param) {
 		if (!purple_http_cookie_jar_get(ha->cookie_jar, "COMPASS")) {
 			purple_http_request_header_set_printf(request, "Cookie", "COMPASS=dynamite=%s", ha->csessionid_param);
 		}
@@ -217,7 +509,8 @@ googlechat_send_stream_event(GoogleChatAccount *ha, StreamEventsRequest *events_
 	GString *url;
 	GString *postdata;
 	
-	url = g_string_new("https://chat.google.com/webchannel/events_encoded" "?");
+	url = g_string_new(ha->channel_url_prefix);
+	g_string_append(url, "events_encoded?");
 	if (ha->csessionid_param) {
 		g_string_append_printf(url, "csessionid=%s&", purple_url_encode(ha->csessionid_param)); //TODO optional?
 	}
@@ -347,9 +640,14 @@ googlechat_longpoll_request_content(PurpleHttpConnection *http_conn, PurpleHttpR
 	ha->last_data_received = time(NULL);
 	
 	if (purple_http_response_is_successful(response)) {
+		googlechat_record_channel_data(ha, buffer, length);
 		g_byte_array_append(ha->channel_buffer, (guint8 *) buffer, length);
 	
-		googlechat_process_channel_buffer(ha);
+		if (!googlechat_process_channel_buffer(ha)) {
+			// The framing is lost, so drop the connection; _request_closed() starts a new channel session
+			return FALSE;
+		}
+		googlechat_compact_channel_buffer(ha);
 		
 	} else {
 		purple_debug_error("googlechat", "longpoll_request_content had error: '%s'\n", purple_http_response_get_error(response));
@@ -380,7 +678,12 @@ googlechat_longpoll_request_closed(PurpleHttpConnection *http_conn, PurpleHttpRe
 	
 	// remaining data 'should' have been dealt with in googlechat_longpoll_request_content
 	g_byte_array_free(ha->channel_buffer, TRUE);
+	if (ha->channel_recording != NULL) {
+		fclose(ha->channel_recording);
+		ha->channel_recording = NULL;
+	}
 	ha->channel_buffer = g_byte_array_sized_new(GOOGLECHAT_BUFFER_DEFAULT_SIZE);
+	googlechat_reset_channel_buffer(ha);
 	
 	if (purple_http_response_get_error(response) != NULL && purple_http_response_get_code(response)) {
 		//TODO error checking
@@ -428,7 +731,8 @@ googlechat_longpoll_request(GoogleChatAccount *ha)
 	
 	g_return_if_fail(ha->sid_param); // might be a new connection being started
 	
-	url = g_string_new("https://chat.google.com/webchannel/events_encoded" "?");
+	url = g_string_new(ha->channel_url_prefix);
+	g_string_append(url, "events_encoded?");
 	if (ha->csessionid_param) {
 		g_string_append_printf(url, "csessionid=%s&", purple_url_encode(ha->csessionid_param)); //TODO optional?
 	}
@@ -469,7 +773,8 @@ googlechat_fetch_channel_sid(GoogleChatAccount *ha)
 	ha->sid_param = NULL;
 	
 	
-	url = g_string_new("https://chat.google.com/webchannel/events_encoded" "?");
+	url = g_string_new(ha->channel_url_prefix);
+	g_string_append(url, "events_encoded?");
 	g_string_append(url, "VER=8&");           // channel protocol version
 	g_string_append(url, "RID=0&");           // request identifier
 	g_string_append(url, "CVER=22&");         // client type
@@ -517,7 +822,7 @@ googlechat_register_webchannel(GoogleChatAccount *ha)
 	
 	request = purple_http_request_new(NULL);
 	purple_http_request_set_cookie_jar(request, ha->cookie_jar);
-	purple_http_request_set_url(request, "https://chat.google.com/webchannel/register");
+	purple_http_request_set_url_printf(request, "%sregister", ha->channel_url_prefix);
 	purple_http_request_set_method(request, "POST");
 	purple_http_request_header_set(request, "Content-Type", "application/x-protobuf");
 	purple_http_request_set_keepalive_pool(request, ha->channel_keepalive_pool);
@@ -531,31 +836,284 @@ googlechat_register_webchannel(GoogleChatAccount *ha)
 
 
 typedef struct {
-	GoogleChatAccount *ha;
-	GoogleChatApiResponseFunc callback;
-	ProtobufCMessage *response_message;
-	gpointer user_data;
-} LazyPblistRequestStore;
+	gint ttl;
+	gint64 expires;              // Monotonic time the response goes stale
+	GByteArray *response;        // The packed response, or NULL while the request is still in flight
+	GSList *waiters;             // GoogleChatRequestContext's for identical requests made while it's in flight
+} GoogleChatCachedResponse;
+
+/*
+ * Reads that are safe to answer from a recent identical request.  A negative
+ * TTL marks requests that change what those reads would return, and so empty
+ * the cache.
+ */
+static const struct {
+	const gchar *endpoint;
+	gint ttl;
+} googlechat_api_cache_ttls[] = {
+	{ "/api/get_group?rt=b", 30 },
+	{ "/api/list_members?rt=b", 30 },
+	{ "/api/get_user_status?rt=b", 60 },
+	{ "/api/update_group?rt=b", -1 },
+	{ "/api/create_membership?rt=b", -1 },
+	{ "/api/remove_memberships?rt=b", -1 },
+	{ "/api/hide_group?rt=b", -1 },
+	{ "/api/block_entity?rt=b", -1 },
+	{ "/api/set_custom_status?rt=b", -1 },
+	{ "/api/set_dnd_duration?rt=b", -1 },
+	{ "/api/set_presence_shared?rt=b", -1 },
+};
+
+static void googlechat_api_queues_dispatch(GoogleChatAccount *ha);
+
+GoogleChatRequestContext *
+googlechat_request_context_new(GoogleChatAccount *ha)
+{
+	GoogleChatRequestContext *context = ha->request_context_pool;
+	
+	if (context != NULL) {
+		ha->request_context_pool = context->next;
+		ha->request_context_pool_size--;
+		memset(context, 0, sizeof(GoogleChatRequestContext));
+	} else {
+		context = g_new0(GoogleChatRequestContext, 1);
+	}
+	
+	context->ha = ha;
+	return context;
+}
+
+void
+googlechat_request_context_free(GoogleChatRequestContext *context)
+{
+	GoogleChatAccount *ha = context->ha;
+	
+	g_free(context->endpoint);
+	g_free(context->request_data);
+	g_free(context->cache_key);
+	if (context->cached_response != NULL) {
+		g_byte_array_unref(context->cached_response);
+	}
+	
+	g_free(context->conv_id);
+	g_free(context->sender_id);
+	g_free(context->url);
+	g_free(context->drive_url);
+	g_free(context->search_term);
+	
+	if (ha->request_context_pool_size < GOOGLECHAT_REQUEST_CONTEXT_POOL_MAX) {
+		context->next = ha->request_context_pool;
+		ha->request_context_pool = context;
+		ha->request_context_pool_size++;
+	} else {
+		g_free(context);
+	}
+}
+
+void
+googlechat_request_context_pool_free(GoogleChatAccount *ha)
+{
+	while (ha->request_context_pool != NULL) {
+		GoogleChatRequestContext *context = ha->request_context_pool;
+		
+		ha->request_context_pool = context->next;
+		g_free(context);
+	}
+	ha->request_context_pool_size = 0;
+}
+
+/* Frees a request that will never be answered, eg when the account is closed */
+static void
+googlechat_request_context_abandon(GoogleChatRequestContext *context)
+{
+	if (context->report_failure) {
+		context->callback(context->ha, NULL, context->user_data);
+	}
+	googlechat_request_context_free(context);
+}
+
+static void
+googlechat_cached_response_free(gpointer data)
+{
+	GoogleChatCachedResponse *cached = data;
+	
+	if (cached->response != NULL) {
+		g_byte_array_unref(cached->response);
+	}
+	g_slist_free_full(cached->waiters, (GDestroyNotify) googlechat_request_context_abandon);
+	g_free(cached);
+}
+
+static gint
+googlechat_api_cache_ttl(const gchar *endpoint)
+{
+	guint i;
+	
+	for (i = 0; i < G_N_ELEMENTS(googlechat_api_cache_ttls); i++) {
+		if (g_str_equal(endpoint, googlechat_api_cache_ttls[i].endpoint)) {
+			return googlechat_api_cache_ttls[i].ttl;
+		}
+	}
+	return 0;
+}
+
+static gchar *
+googlechat_api_cache_key(const gchar *endpoint, const guint8 *request_body, gsize request_body_len)
+{
+	gchar *encoded = g_base64_encode(request_body, request_body_len);
+	gchar *key = g_strconcat(endpoint, " ", encoded, NULL);
+	
+	g_free(encoded);
+	return key;
+}
+
+/*
+ * Records the response to a cacheable request and hands it to any identical
+ * requests that were made while it was in flight.  A NULL response means the
+ * request failed, and nothing is cached; the waiters are still called (with
+ * NULL) so that they can free their user_data.
+ */
+static void
+googlechat_api_cache_complete(GoogleChatAccount *ha, const gchar *cache_key, ProtobufCMessage *response, const guchar *data, gsize len)
+{
+	GoogleChatCachedResponse *cached;
+	GSList *waiters, *cur;
+	
+	if (ha->api_response_cache == NULL) {
+		return;
+	}
+	cached = g_hash_table_lookup(ha->api_response_cache, cache_key);
+	if (cached == NULL) {
+		return;
+	}
+	
+	waiters = cached->waiters;
+	cached->waiters = NULL;
+	
+	if (response != NULL && data != NULL) {
+		cached->response = g_byte_array_sized_new(len);
+		g_byte_array_append(cached->response, data, len);
+		cached->expires = g_get_monotonic_time() + (gint64) cached->ttl * G_USEC_PER_SEC;
+	} else {
+		g_hash_table_remove(ha->api_response_cache, cache_key);
+	}
+	
+	for (cur = waiters; cur != NULL; cur = cur->next) {
+		GoogleChatRequestContext *waiter = cur->data;
+		
+		waiter->callback(ha, response, waiter->user_data);
+		googlechat_request_context_free(waiter);
+	}
+	g_slist_free(waiters);
+}
+
+static gboolean
+googlechat_api_cache_remove_completed(gpointer key, gpointer value, gpointer user_data)
+{
+	GoogleChatCachedResponse *cached = value;
+	const gchar *endpoint = user_data;
+	
+	// In-flight requests stay, so that anything waiting on them still gets an answer
+	if (cached->response == NULL) {
+		return FALSE;
+	}
+	return endpoint == NULL || (g_str_has_prefix(key, endpoint) && ((const gchar *) key)[strlen(endpoint)] == ' ');
+}
+
+/*
+ * Drops stale responses before another entry is added, and the one closest to going
+ * stale if that still leaves the cache full.  Returns FALSE if there's no room because
+ * everything in the cache is still in flight.
+ */
+static gboolean
+googlechat_api_cache_make_room(GoogleChatAccount *ha)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	gpointer soonest_key = NULL;
+	gint64 soonest_expires = G_MAXINT64;
+	gint64 now = g_get_monotonic_time();
+	
+	g_hash_table_iter_init(&iter, ha->api_response_cache);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		GoogleChatCachedResponse *cached = value;
+		
+		if (cached->response == NULL) {
+			continue;
+		}
+		if (cached->expires <= now) {
+			g_hash_table_iter_remove(&iter);
+		} else if (cached->expires < soonest_expires) {
+			soonest_key = key;
+			soonest_expires = cached->expires;
+		}
+	}
+	
+	if (g_hash_table_size(ha->api_response_cache) < GOOGLECHAT_API_CACHE_MAX_ENTRIES) {
+		return TRUE;
+	}
+	if (soonest_key == NULL) {
+		return FALSE;
+	}
+	
+	g_hash_table_remove(ha->api_response_cache, soonest_key);
+	return TRUE;
+}
+
+static gboolean
+googlechat_api_cache_deliver(gpointer data)
+{
+	GoogleChatAccount *ha = data;
+	GoogleChatRequestContext *request_info;
+	
+	ha->api_cache_delivery_timeout = 0;
+	
+	while ((request_info = g_queue_pop_head(&ha->api_cache_deliveries)) != NULL) {
+		GByteArray *cached_response = request_info->cached_response;
+		ProtobufCAllocator *allocator = googlechat_arena_acquire(ha->protobuf_arena);
+		ProtobufCMessage *unpacked_message;
+		
+		unpacked_message = protobuf_c_message_unpack(request_info->response_descriptor, allocator, cached_response->len, cached_response->data);
+		// Cacheable reads are told about failures too, see googlechat_api_request()
+		request_info->callback(ha, unpacked_message, request_info->user_data);
+		googlechat_arena_release(ha->protobuf_arena);
+		
+		googlechat_request_context_free(request_info);
+	}
+	
+	return FALSE;
+}
 
 static void
 googlechat_pblite_request_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *response, gpointer user_data)
 {
-	LazyPblistRequestStore *request_info = user_data;
+	GoogleChatRequestContext *request_info = user_data;
 	GoogleChatAccount *ha = request_info->ha;
+	GoogleChatApiQueue *queue = &ha->api_queues[request_info->priority];
 	GoogleChatApiResponseFunc callback = request_info->callback;
 	gpointer real_user_data = request_info->user_data;
-	ProtobufCMessage *response_message = request_info->response_message;
+	const ProtobufCMessageDescriptor *response_descriptor = request_info->response_descriptor;
 	ProtobufCMessage *unpacked_message;
+	ProtobufCAllocator *allocator;
 	const gchar *raw_response;
 	guchar *decoded_response;
 	gsize response_len;
 	const gchar *content_type;
 	
+	// Free up the slot first, so that whatever the callback sends next can't overtake the queue
+	queue->active--;
+	googlechat_api_queues_dispatch(ha);
+	
 	if (purple_http_response_get_error(response) != NULL) {
-		g_free(request_info);
-		g_free(response_message);
 		purple_debug_error("googlechat", "Error from server: (%s) %s\n", purple_http_response_get_error(response), purple_http_response_get_data(response, NULL));
-		return; //TODO should we send NULL to the callee?
+		if (request_info->report_failure) {
+			callback(ha, NULL, real_user_data);
+		}
+		if (request_info->cache_key != NULL) {
+			googlechat_api_cache_complete(ha, request_info->cache_key, NULL, NULL, 0);
+		}
+		googlechat_request_context_free(request_info);
+		return; //TODO should every callee get NULL?
 	}
 	
 	if (callback != NULL) {
@@ -568,57 +1126,69 @@ googlechat_pblite_request_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse
 		if (g_strcmp0(content_type, "application/x-protobuf") == 0 || g_strcmp0(content_type, "application/vnd.google.octet-stream-compressible") == 0) {
 			const gchar *safety_encoding = purple_http_response_get_header(response, "X-Goog-Safety-Encoding");
 			if (safety_encoding && g_strcmp0(safety_encoding, "base64") == 0) {
-				decoded_response = g_base64_decode(raw_response, &response_len);
+				decoded_response = googlechat_base64_decode_into(ha->base64_scratch, raw_response, response_len, &response_len);
 			} else {
 				decoded_response = (guchar *) raw_response;
 			}
-			unpacked_message = protobuf_c_message_unpack(response_message->descriptor, NULL, response_len, decoded_response);
+			allocator = googlechat_arena_acquire(ha->protobuf_arena);
+			unpacked_message = protobuf_c_message_unpack(response_descriptor, allocator, response_len, decoded_response);
 			
 			if (unpacked_message != NULL) {
-				if (purple_debug_is_verbose()) {
-					gchar *pretty_json = pblite_dump_json(unpacked_message);
-					purple_debug_misc("googlechat", "Response: %s", pretty_json);
-					g_free(pretty_json);
-				}
+				googlechat_debug_dump_message(PURPLE_DEBUG_MISC, "Response: ", unpacked_message);
 				
 				callback(ha, unpacked_message, real_user_data);
-				protobuf_c_message_free_unpacked(unpacked_message, NULL);
 			} else {
 				purple_debug_error("googlechat", "Error decoding protobuf!\n");
+				if (request_info->report_failure) {
+					callback(ha, NULL, real_user_data);
+				}
 			}
+			if (request_info->cache_key != NULL) {
+				googlechat_api_cache_complete(ha, request_info->cache_key, unpacked_message, decoded_response, response_len);
+			}
+			googlechat_arena_release(ha->protobuf_arena);
 		} else {
-			size_t raw_response_len = strlen(raw_response);
+			gchar *first_element = NULL;
+			ProtobufCMessage *response_message;
+			
 			if (strchr(raw_response, '[') != raw_response) {
-				raw_response = strchr(raw_response, '[');
-				raw_response++;
-				raw_response_len = strlen(raw_response) - 1;
+				const gchar *array_start = strchr(raw_response, '[');
+				if (array_start != NULL) {
+					// Unwrap the outer array, dropping its closing ] as well
+					response_len -= (array_start + 1) - raw_response;
+					raw_response = array_start + 1;
+					if (response_len > 0) {
+						response_len--;
+					}
+				}
 			}
 			
-			gchar *tidied_json = googlechat_json_tidy_blank_arrays(raw_response);
-			JsonArray *response_array = json_decode_array(tidied_json, raw_response_len);
-			const gchar *first_element = json_array_get_string_element(response_array, 0);
-			gboolean ignore_first_element = (first_element != NULL);
+			// Only the top-level message comes from the arena; pblite_decode_data() allocates the rest itself
+			allocator = googlechat_arena_acquire(ha->protobuf_arena);
+			response_message = allocator->alloc(allocator->allocator_data, response_descriptor->sizeof_message);
+			protobuf_c_message_init(response_descriptor, response_message);
 			
-			pblite_decode(response_message, response_array, ignore_first_element);
-			if (ignore_first_element) {
+			if (!pblite_decode_data(response_message, raw_response, response_len, &first_element)) {
+				purple_debug_error("googlechat", "Error decoding pblite!\n");
+			}
+			if (first_element != NULL) {
 				purple_debug_info("googlechat", "A '%s' says '%s'\n", response_message->descriptor->name, first_element);
+				g_free(first_element);
 			}
 			
-			if (purple_debug_is_verbose()) {
-				gchar *pretty_json = pblite_dump_json(response_message);
-				purple_debug_misc("googlechat", "Response: %s", pretty_json);
-				g_free(pretty_json);
-			}
+			googlechat_debug_dump_message(PURPLE_DEBUG_MISC, "Response: ", response_message);
 			
 			callback(ha, response_message, real_user_data);
 			
-			json_array_unref(response_array);
-			g_free(tidied_json);
+			// Only protobuf responses are kept, but anyone waiting still gets this one
+			if (request_info->cache_key != NULL) {
+				googlechat_api_cache_complete(ha, request_info->cache_key, response_message, NULL, 0);
+			}
+			googlechat_arena_release(ha->protobuf_arena);
 		}
 	}
 	
-	g_free(request_info);
-	g_free(response_message);
+	googlechat_request_context_free(request_info);
 }
 
 PurpleHttpConnection *
@@ -643,7 +1213,7 @@ googlechat_raw_request(GoogleChatAccount *ha, const gchar *path, GoogleChatConte
 	}
 	
 	request = purple_http_request_new(NULL);
-	purple_http_request_set_url_printf(request, GOOGLECHAT_PBLITE_API_URL "%s%calt=%s", path, (strchr(path, '?') ? '&' : '?'), response_type_str);
+	purple_http_request_set_url_printf(request, "%s%s%calt=%s", ha->server_url, path, (strchr(path, '?') ? '&' : '?'), response_type_str);
 	purple_http_request_set_cookie_jar(request, ha->cookie_jar);
 	purple_http_request_set_keepalive_pool(request, ha->api_keepalive_pool);
 	purple_http_request_set_max_len(request, G_MAXINT32 - 1);
@@ -668,12 +1238,256 @@ googlechat_raw_request(GoogleChatAccount *ha, const gchar *path, GoogleChatConte
 	return connection;
 }
 
+static guint
+googlechat_api_wait_bucket(gint64 waited_us)
+{
+	static const gint64 limits[GOOGLECHAT_API_WAIT_BUCKETS - 1] = { 10000, 50000, 250000, 1000000, 5000000 };
+	guint i;
+	
+	for (i = 0; i < G_N_ELEMENTS(limits); i++) {
+		if (waited_us < limits[i]) {
+			return i;
+		}
+	}
+	return GOOGLECHAT_API_WAIT_BUCKETS - 1;
+}
+
+static guint
+googlechat_api_depth_bucket(guint depth)
+{
+	static const guint limits[GOOGLECHAT_API_DEPTH_BUCKETS - 1] = { 1, 2, 4, 16, 64 };
+	guint i;
+	
+	for (i = 0; i < G_N_ELEMENTS(limits); i++) {
+		if (depth < limits[i]) {
+			return i;
+		}
+	}
+	return GOOGLECHAT_API_DEPTH_BUCKETS - 1;
+}
+
+static void
+googlechat_api_send_request(GoogleChatAccount *ha, GoogleChatRequestContext *request_info, const gchar *endpoint, const guint8 *request_data, gsize request_len)
+{
+	GoogleChatApiQueue *queue = &ha->api_queues[request_info->priority];
+	
+	queue->active++;
+	queue->sent++;
+	queue->wait_histogram[googlechat_api_wait_bucket(g_get_monotonic_time() - request_info->queued_at)]++;
+	
+	googlechat_raw_request(ha, endpoint, GOOGLECHAT_CONTENT_TYPE_PROTOBUF, (const gchar *) request_data, request_len, GOOGLECHAT_CONTENT_TYPE_PROTOBUF, googlechat_pblite_request_cb, request_info);
+}
+
+static void
+googlechat_api_send_queued_request(GoogleChatAccount *ha, GoogleChatRequestContext *request_info)
+{
+	gchar *endpoint = request_info->endpoint;
+	gchar *request_data = request_info->request_data;
+	
+	request_info->endpoint = NULL;
+	request_info->request_data = NULL;
+	
+	googlechat_api_send_request(ha, request_info, endpoint, (const guint8 *) request_data, request_info->request_len);
+	
+	g_free(endpoint);
+	g_free(request_data);
+}
+
+/* Whether a new request of this priority would be sent straight away, rather than queued */
+static gboolean
+googlechat_api_queue_has_room(GoogleChatAccount *ha, GoogleChatApiPriority priority)
+{
+	guint higher;
+	
+	for (higher = 0; higher < priority; higher++) {
+		if (!g_queue_is_empty(&ha->api_queues[higher].waiting)) {
+			return FALSE;
+		}
+	}
+	
+	return ha->api_queues[priority].active < ha->api_queues[priority].max_active &&
+	       g_queue_is_empty(&ha->api_queues[priority].waiting);
+}
+
+static void
+googlechat_api_queues_dispatch(GoogleChatAccount *ha)
+{
+	guint priority;
+	
+	for (priority = 0; priority < GOOGLECHAT_API_PRIORITY_COUNT; priority++) {
+		GoogleChatApiQueue *queue = &ha->api_queues[priority];
+		
+		while (queue->active < queue->max_active && !g_queue_is_empty(&queue->waiting)) {
+			googlechat_api_send_queued_request(ha, g_queue_pop_head(&queue->waiting));
+		}
+		
+		// Lower priorities have to wait until everything more urgent has gone out
+		if (!g_queue_is_empty(&queue->waiting)) {
+			break;
+		}
+	}
+}
+
 void
-googlechat_api_request(GoogleChatAccount *ha, const gchar *endpoint, ProtobufCMessage *request_message, GoogleChatApiResponseFunc callback, ProtobufCMessage *response_message, gpointer user_data)
+googlechat_api_queues_init(GoogleChatAccount *ha)
 {
-	gsize request_len;
-	gchar *request_data;
-	LazyPblistRequestStore *request_info = g_new0(LazyPblistRequestStore, 1);
+	guint priority;
+	
+	for (priority = 0; priority < GOOGLECHAT_API_PRIORITY_COUNT; priority++) {
+		g_queue_init(&ha->api_queues[priority].waiting);
+	}
+	ha->api_queues[GOOGLECHAT_API_PRIORITY_INTERACTIVE].max_active = GOOGLECHAT_API_INTERACTIVE_MAX_ACTIVE;
+	ha->api_queues[GOOGLECHAT_API_PRIORITY_SYNC].max_active = GOOGLECHAT_API_SYNC_MAX_ACTIVE;
+	ha->api_queues[GOOGLECHAT_API_PRIORITY_BACKGROUND].max_active = GOOGLECHAT_API_BACKGROUND_MAX_ACTIVE;
+	
+	ha->api_response_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, googlechat_cached_response_free);
+	g_queue_init(&ha->api_cache_deliveries);
+}
+
+void
+googlechat_api_queues_free(GoogleChatAccount *ha)
+{
+	GHashTable *api_response_cache = ha->api_response_cache;
+	guint priority;
+	
+	// Nothing more gets sent or cached once the queues are gone, even by the callbacks of abandoned requests
+	ha->api_response_cache = NULL;
+	for (priority = 0; priority < GOOGLECHAT_API_PRIORITY_COUNT; priority++) {
+		ha->api_queues[priority].max_active = 0;
+	}
+	
+	for (priority = 0; priority < GOOGLECHAT_API_PRIORITY_COUNT; priority++) {
+		GQueue *waiting = &ha->api_queues[priority].waiting;
+		
+		while (!g_queue_is_empty(waiting)) {
+			googlechat_request_context_abandon(g_queue_pop_head(waiting));
+		}
+	}
+	
+	if (ha->api_cache_delivery_timeout) {
+		g_source_remove(ha->api_cache_delivery_timeout);
+		ha->api_cache_delivery_timeout = 0;
+	}
+	while (!g_queue_is_empty(&ha->api_cache_deliveries)) {
+		googlechat_request_context_abandon(g_queue_pop_head(&ha->api_cache_deliveries));
+	}
+	if (api_response_cache != NULL) {
+		g_hash_table_destroy(api_response_cache);
+	}
+}
+
+void
+googlechat_cancel_requests(GoogleChatAccount *ha)
+{
+	googlechat_api_queues_free(ha);
+	// The callbacks hand their contexts back to the pool, so it's emptied last
+	purple_http_conn_cancel_all(ha->pc);
+	googlechat_request_context_pool_free(ha);
+}
+
+void
+googlechat_api_cache_invalidate(GoogleChatAccount *ha, const gchar *endpoint)
+{
+	if (ha->api_response_cache != NULL) {
+		g_hash_table_foreach_remove(ha->api_response_cache, googlechat_api_cache_remove_completed, (gpointer) endpoint);
+	}
+}
+
+typedef struct {
+	ProtobufCBuffer base;
+	GByteArray *array;
+} GoogleChatPackBuffer;
+
+static void
+googlechat_pack_buffer_append(ProtobufCBuffer *buffer, size_t len, const uint8_t *data)
+{
+	g_byte_array_append(((GoogleChatPackBuffer *) buffer)->array, data, len);
+}
+
+static gsize
+googlechat_encode_varint(guint8 *out, guint64 value)
+{
+	gsize len = 0;
+	
+	do {
+		out[len] = value & 0x7F;
+		value >>= 7;
+		if (value) {
+			out[len] |= 0x80;
+		}
+		len++;
+	} while (value);
+	
+	return len;
+}
+
+/*
+ * Encodes request_message onto the end of out.  If it carries the account's
+ * shared RequestHeader, the header isn't encoded field-by-field: the bytes
+ * from googlechat_request_header_init() are appended after everything else
+ * along with this request's trace_id, which protobuf is happy to accept out
+ * of order.
+ *
+ * Returns how many bytes came before the header, ie the part of the request
+ * that identifies it.
+ */
+static gsize
+googlechat_api_pack_request(GoogleChatAccount *ha, ProtobufCMessage *request_message, GByteArray *out)
+{
+	GoogleChatPackBuffer buffer = { { googlechat_pack_buffer_append }, out };
+	const ProtobufCFieldDescriptor *field;
+	RequestHeader **header_ptr = NULL;
+	guint8 tag[10], length[10], trace_id[11];
+	gsize tag_len, length_len, trace_id_len, body_len;
+	
+	field = protobuf_c_message_descriptor_get_field_by_name(request_message->descriptor, "request_header");
+	if (field != NULL && field->type == PROTOBUF_C_TYPE_MESSAGE && field->label != PROTOBUF_C_LABEL_REPEATED) {
+		header_ptr = (RequestHeader **) ((guint8 *) request_message + field->offset);
+	}
+	
+	if (header_ptr == NULL || *header_ptr != &ha->request_header || ha->request_header_packed == NULL) {
+		protobuf_c_message_pack_to_buffer(request_message, &buffer.base);
+		return out->len;
+	}
+	
+	*header_ptr = NULL;
+	protobuf_c_message_pack_to_buffer(request_message, &buffer.base);
+	*header_ptr = &ha->request_header;
+	body_len = out->len;
+	
+	trace_id[0] = (1 << 3) | 0; // RequestHeader.trace_id, varint
+	trace_id_len = 1 + googlechat_encode_varint(trace_id + 1, (guint64) ha->request_header.trace_id);
+	tag_len = googlechat_encode_varint(tag, ((guint64) field->id << 3) | 2); // length-delimited
+	length_len = googlechat_encode_varint(length, ha->request_header_packed_len + trace_id_len);
+	
+	g_byte_array_append(out, tag, tag_len);
+	g_byte_array_append(out, length, length_len);
+	g_byte_array_append(out, ha->request_header_packed, ha->request_header_packed_len);
+	g_byte_array_append(out, trace_id, trace_id_len);
+	
+	return body_len;
+}
+
+void
+googlechat_api_request(GoogleChatAccount *ha, const gchar *endpoint, GoogleChatApiPriority priority, ProtobufCMessage *request_message, GoogleChatApiResponseFunc callback, const ProtobufCMessageDescriptor *response_descriptor, gpointer user_data)
+{
+	GByteArray *packed = ha->api_pack_buffer;
+	gsize body_len;
+	GoogleChatRequestContext *request_info;
+	GoogleChatApiQueue *queue;
+	guint depth;
+	gint cache_ttl;
+	gchar *cache_key = NULL;
+	
+	g_return_if_fail(priority < GOOGLECHAT_API_PRIORITY_COUNT);
+	
+	if (ha->api_queues[priority].max_active == 0) {
+		// The account is closing (eg a cancelled request's callback asking again), and nothing queued now would ever be freed
+		if (callback != NULL && googlechat_api_cache_ttl(endpoint) > 0) {
+			callback(ha, NULL, user_data);
+		}
+		return;
+	}
 	
 	// JsonArray *request_encoded = pblite_encode(request_message);
 	// JsonNode *node = json_node_new(JSON_NODE_ARRAY);
@@ -681,35 +1495,136 @@ googlechat_api_request(GoogleChatAccount *ha, const gchar *endpoint, ProtobufCMe
 	// request_data = json_encode(node, &request_len);
 	// json_node_free(node);
 	
-	request_len = protobuf_c_message_get_packed_size(request_message);
-	request_data = (gchar *) g_new0(uint8_t, request_len);
-	request_len = protobuf_c_message_pack(request_message, (uint8_t *) request_data);
+	g_byte_array_set_size(packed, 0);
+	body_len = googlechat_api_pack_request(ha, request_message, packed);
+	
+	cache_ttl = googlechat_api_cache_ttl(endpoint);
+	if (cache_ttl < 0) {
+		googlechat_api_cache_invalidate(ha, NULL);
+		
+	} else if (cache_ttl > 0 && callback != NULL && ha->api_response_cache != NULL) {
+		GoogleChatCachedResponse *cached;
+		
+		cache_key = googlechat_api_cache_key(endpoint, packed->data, body_len);
+		cached = g_hash_table_lookup(ha->api_response_cache, cache_key);
+		if (cached != NULL && cached->response != NULL && cached->expires <= g_get_monotonic_time()) {
+			g_hash_table_remove(ha->api_response_cache, cache_key);
+			cached = NULL;
+		}
+		
+		if (cached != NULL) {
+			request_info = googlechat_request_context_new(ha);
+			request_info->callback = callback;
+			request_info->response_descriptor = response_descriptor;
+			request_info->user_data = user_data;
+			request_info->priority = priority;
+			request_info->report_failure = TRUE;
+			
+			if (cached->response != NULL) {
+				// Answer it from the main loop, the same as if it had gone to the server
+				request_info->cached_response = g_byte_array_ref(cached->response);
+				g_queue_push_tail(&ha->api_cache_deliveries, request_info);
+				if (ha->api_cache_delivery_timeout == 0) {
+					ha->api_cache_delivery_timeout = g_timeout_add(0, googlechat_api_cache_deliver, ha);
+				}
+				ha->api_cache_hits++;
+			} else {
+				cached->waiters = g_slist_append(cached->waiters, request_info);
+				ha->api_cache_joins++;
+			}
+			
+			g_free(cache_key);
+			return;
+		}
+		
+		if (googlechat_api_cache_make_room(ha)) {
+			cached = g_new0(GoogleChatCachedResponse, 1);
+			cached->ttl = cache_ttl;
+			g_hash_table_insert(ha->api_response_cache, g_strdup(cache_key), cached);
+		} else {
+			// Just send it uncached
+			g_free(cache_key);
+			cache_key = NULL;
+		}
+	}
 	
-	request_info->ha = ha;
+	request_info = googlechat_request_context_new(ha);
 	request_info->callback = callback;
-	request_info->response_message = response_message;
+	request_info->response_descriptor = response_descriptor;
 	request_info->user_data = user_data;
+	request_info->priority = priority;
+	request_info->queued_at = g_get_monotonic_time();
+	request_info->cache_key = cache_key;
+	request_info->report_failure = (cache_ttl > 0 && callback != NULL);
 	
-	if (purple_debug_is_verbose()) {
-		gchar *pretty_json = pblite_dump_json(request_message);
-		purple_debug_misc("googlechat", "Request:  %s", pretty_json);
-		g_free(pretty_json);
+	googlechat_debug_dump_message(PURPLE_DEBUG_MISC, "Request:  ", request_message);
+	
+	queue = &ha->api_queues[priority];
+	depth = g_queue_get_length(&queue->waiting);
+	queue->depth_histogram[googlechat_api_depth_bucket(depth)]++;
+	queue->peak_depth = MAX(queue->peak_depth, depth + 1);
+	
+	if (googlechat_api_queue_has_room(ha, priority)) {
+		// The HTTP request takes its own copy of the body, so it can go straight from the pack buffer
+		googlechat_api_send_request(ha, request_info, endpoint, packed->data, packed->len);
+		return;
 	}
 	
-	googlechat_raw_request(ha, endpoint, GOOGLECHAT_CONTENT_TYPE_PROTOBUF, request_data, request_len, GOOGLECHAT_CONTENT_TYPE_PROTOBUF, googlechat_pblite_request_cb, request_info);
+	request_info->endpoint = g_strdup(endpoint);
+	request_info->request_data = g_memdup(packed->data, packed->len);
+	request_info->request_len = packed->len;
 	
-	g_free(request_data);
+	g_queue_push_tail(&queue->waiting, request_info);
 }
 
 
+gboolean
+googlechat_debug_is_listening(PurpleDebugLevel level)
+{
+#if PURPLE_VERSION_CHECK(3, 0, 0)
+	PurpleDebugUi *ui = purple_debug_get_ui();
+	
+	if (ui != NULL && purple_debug_ui_is_enabled(ui, level, "googlechat")) {
+		return TRUE;
+	}
+#else
+	PurpleDebugUiOps *ops = purple_debug_get_ui_ops();
+	
+	if (ops != NULL && ops->print != NULL && (ops->is_enabled == NULL || ops->is_enabled(level, "googlechat"))) {
+		return TRUE;
+	}
+#endif
+	
+	return purple_debug_is_enabled();
+}
+
 void
-googlechat_default_response_dump(GoogleChatAccount *ha, ProtobufCMessage *response, gpointer user_data)
+googlechat_debug_dump_message(PurpleDebugLevel level, const gchar *prefix, ProtobufCMessage *message)
 {
-	gchar *dump = pblite_dump_json(response);
-	purple_debug_info("googlechat", "%s\n", dump);
+	gchar *dump;
+	
+	if (message == NULL || !googlechat_debug_is_listening(level)) {
+		return;
+	}
+	
+	if (purple_debug_is_verbose()) {
+		dump = pblite_dump_json(message);
+	} else if (level > PURPLE_DEBUG_MISC) {
+		dump = pblite_dump_json_truncated(message, GOOGLECHAT_DEBUG_DUMP_MAX_LEN);
+	} else {
+		return;
+	}
+	
+	purple_debug(level, "googlechat", "%s%s\n", prefix ? prefix : "", dump);
 	g_free(dump);
 }
 
+void
+googlechat_default_response_dump(GoogleChatAccount *ha, ProtobufCMessage *response, gpointer user_data)
+{
+	googlechat_debug_dump_message(PURPLE_DEBUG_INFO, NULL, response);
+}
+
 
 gboolean
 googlechat_set_active_client(PurpleConnection *pc)
@@ -799,13 +1714,14 @@ googlechat_search_results_add_buddy(PurpleConnection *pc, GList *row, void *user
 void
 googlechat_search_users_text_cb(PurpleHttpConnection *connection, PurpleHttpResponse *response, gpointer user_data)
 {
-	GoogleChatAccount *ha = user_data;
+	GoogleChatRequestContext *context = user_data;
+	GoogleChatAccount *ha = context->ha;
 	const gchar *response_data;
 	size_t response_size;
 	JsonArray *resultsarray;
 	JsonObject *node;
 	gint index, length;
-	gchar *search_term;
+	const gchar *search_term = context->search_term;
 	JsonObject *status;
 	
 	PurpleNotifySearchResults *results;
@@ -813,14 +1729,13 @@ googlechat_search_users_text_cb(PurpleHttpConnection *connection, PurpleHttpResp
 	
 	if (purple_http_response_get_error(response) != NULL) {
 		purple_notify_error(ha->pc, _("Search Error"), _("There was an error searching for the user"), purple_http_response_get_error(response), purple_request_cpar_from_connection(ha->pc));
-		g_dataset_destroy(connection);
+		googlechat_request_context_free(context);
 		return;
 	}
 	
 	response_data = purple_http_response_get_data(response, &response_size);
 	node = json_decode_object(response_data, response_size);
 	
-	search_term = g_dataset_get_data(connection, "search_term");
 	resultsarray = json_object_get_array_member(node, "results");
 	length = json_array_get_length(resultsarray);
 	
@@ -837,7 +1752,7 @@ googlechat_search_users_text_cb(PurpleHttpConnection *connection, PurpleHttpResp
 			g_free(primary_text);
 		}
 		
-		g_dataset_destroy(connection);
+		googlechat_request_context_free(context);
 		json_object_unref(node);
 		return;
 	}
@@ -845,7 +1760,7 @@ googlechat_search_users_text_cb(PurpleHttpConnection *connection, PurpleHttpResp
 	results = purple_notify_searchresults_new();
 	if (results == NULL)
 	{
-		g_dataset_destroy(connection);
+		googlechat_request_context_free(context);
 		json_object_unref(node);
 		return;
 	}
@@ -876,7 +1791,7 @@ googlechat_search_users_text_cb(PurpleHttpConnection *connection, PurpleHttpResp
 	
 	purple_notify_searchresults(ha->pc, NULL, search_term, NULL, results, NULL, NULL);
 	
-	g_dataset_destroy(connection);
+	googlechat_request_context_free(context);
 	json_object_unref(node);
 }
 
@@ -895,7 +1810,7 @@ googlechat_search_users_text(GoogleChatAccount *ha, const gchar *text)
 {
 	PurpleHttpRequest *request;
 	GString *url = g_string_new("https://people-pa.clients6.google.com/v2/people/autocomplete?");
-	PurpleHttpConnection *connection;
+	GoogleChatRequestContext *context;
 	
 	g_string_append_printf(url, "query=%s&", purple_url_encode(text));
 	g_string_append(url, "client=GOOGLECHAT_WITH_DATA&");
@@ -908,14 +1823,65 @@ googlechat_search_users_text(GoogleChatAccount *ha, const gchar *text)
 	
 	googlechat_set_auth_headers(ha, request);
 
-	connection = purple_http_request(ha->pc, request, googlechat_search_users_text_cb, ha);
-	purple_http_request_unref(request);
+	context = googlechat_request_context_new(ha);
+	context->search_term = g_strdup(text);
 	
-	g_dataset_set_data_full(connection, "search_term", g_strdup(text), g_free);
+	purple_http_request(ha->pc, request, googlechat_search_users_text_cb, context);
+	purple_http_request_unref(request);
 	
 	g_string_free(url, TRUE);
 }
 
+void
+googlechat_show_connection_stats(PurpleProtocolAction *action)
+{
+	PurpleConnection *pc = purple_protocol_action_get_connection(action);
+	GoogleChatAccount *ha = purple_connection_get_protocol_data(pc);
+	GString *secondary = g_string_new(NULL);
+	static const gchar *priority_names[GOOGLECHAT_API_PRIORITY_COUNT] = { N_("Interactive"), N_("Sync"), N_("Background") };
+	guint priority;
+	
+	// No G_GSIZE_FORMAT in translated strings, as xgettext can't expand it
+	g_string_append_printf(secondary, _("Channel buffer: %lu bytes buffered, %lu bytes held, %lu bytes peak\n"),
+	                       (gulong) (ha->channel_buffer->len - ha->channel_buffer_pos),
+	                       (gulong) MAX(ha->channel_buffer_high_water, GOOGLECHAT_BUFFER_DEFAULT_SIZE),
+	                       (gulong) ha->channel_buffer_peak);
+	g_string_append_printf(secondary, _("Presence: %u users asked about in %u requests (%u requests avoided), %u changes pushed\n"),
+	                       ha->presence_lookups, ha->presence_requests,
+	                       ha->presence_lookups > ha->presence_requests ? ha->presence_lookups - ha->presence_requests : 0,
+	                       ha->presence_pushes);
+	g_string_append_printf(secondary, _("Statuses: %u passed on, %u unchanged (%.0f%% suppressed)\n"),
+	                       ha->presence_changed, ha->presence_unchanged,
+	                       ha->presence_unchanged ? ha->presence_unchanged * 100.0 / (ha->presence_changed + ha->presence_unchanged) : 0.0);
+	g_string_append_printf(secondary, _("Members: %u users asked about in %u requests\n"),
+	                       ha->member_lookups_asked, ha->member_requests);
+	
+	for (priority = 0; priority < GOOGLECHAT_API_PRIORITY_COUNT; priority++) {
+		const GoogleChatApiQueue *queue = &ha->api_queues[priority];
+		guint i;
+		
+		g_string_append_printf(secondary, _("%s requests: %u sent, %u active, %u waiting (peak %u)\n"),
+		                       _(priority_names[priority]), queue->sent, queue->active,
+		                       g_queue_get_length((GQueue *) &queue->waiting), queue->peak_depth);
+		g_string_append(secondary, _("    waited <10ms/<50ms/<250ms/<1s/<5s/longer:"));
+		for (i = 0; i < GOOGLECHAT_API_WAIT_BUCKETS; i++) {
+			g_string_append_printf(secondary, " %u", queue->wait_histogram[i]);
+		}
+		g_string_append(secondary, _("\n    queued behind 0/1/2-3/4-15/16-63/more:"));
+		for (i = 0; i < GOOGLECHAT_API_DEPTH_BUCKETS; i++) {
+			g_string_append_printf(secondary, " %u", queue->depth_histogram[i]);
+		}
+		g_string_append_c(secondary, '\n');
+	}
+	g_string_append_printf(secondary, _("Stream: %u events received\n"), ha->channel_events_received);
+	g_string_append_printf(secondary, _("Response cache: %u answered from cache, %u joined a request in flight\n"),
+	                       ha->api_cache_hits, ha->api_cache_joins);
+	
+	purple_notify_info(pc, _("Connection Statistics"), _("Connection statistics"), secondary->str, purple_request_cpar_from_connection(pc));
+	
+	g_string_free(secondary, TRUE);
+}
+
 void
 googlechat_search_users(PurpleProtocolAction *action)
 {
@@ -23,6 +23,7 @@
 #include <glib.h>
 
 #include "http.h"
+#include "image.h"
 
 #include "libgooglechat.h"
 #include "googlechat_pblite.h"
@@ -31,10 +32,18 @@
 #define GOOGLECHAT_PBLITE_XORIGIN_URL "https://chat.google.com"
 #define GOOGLECHAT_PBLITE_API_URL "https://chat.google.com"
 #define GOOGLECHAT_CHANNEL_URL_PREFIX "https://chat.google.com/webchannel/"
+// Overrides GOOGLECHAT_PBLITE_API_URL and the "server_url" account option, eg to point every account at a test server
+#define GOOGLECHAT_SERVER_URL_ENV "GOOGLECHAT_SERVER_URL"
 
-void googlechat_process_data_chunks(GoogleChatAccount *ha, const gchar *data, gsize len);
+/**
+ * Sets where API, webchannel and upload requests are sent.
+ * Anything other than an https *.google.com host or a loopback address is ignored, since the access token goes with every request.
+ * \param server_url The scheme and host, eg GOOGLECHAT_PBLITE_API_URL, or NULL for the default
+ */
+void googlechat_set_server_url(GoogleChatAccount *ha, const gchar *server_url);
 
-void googlechat_process_channel(int fd);
+void googlechat_process_data_chunks(GoogleChatAccount *ha, const gchar *data, gsize len);
+gboolean googlechat_process_channel_buffer(GoogleChatAccount *ha);
 
 void googlechat_longpoll_request(GoogleChatAccount *ha);
 void googlechat_fetch_channel_sid(GoogleChatAccount *ha);
@@ -44,9 +53,17 @@ void googlechat_add_channel_services(GoogleChatAccount *ha);
 void googlechat_send_ping_event(GoogleChatAccount *ha, PingEvent *ping_event);
 void googlechat_subscribe_to_group(GoogleChatAccount *ha, GroupId *group_id);
 
+// How much of a message to dump when verbose debugging is off
+#define GOOGLECHAT_DEBUG_DUMP_MAX_LEN 2048
+
+gboolean googlechat_debug_is_listening(PurpleDebugLevel level);
+// MISC dumps are only written with verbose debugging, others are truncated unless verbose
+void googlechat_debug_dump_message(PurpleDebugLevel level, const gchar *prefix, ProtobufCMessage *message);
+
 void googlechat_default_response_dump(GoogleChatAccount *ha, ProtobufCMessage *response, gpointer user_data);
 gboolean googlechat_set_active_client(PurpleConnection *pc);
 void googlechat_search_users(PurpleProtocolAction *action);
+void googlechat_show_connection_stats(PurpleProtocolAction *action);
 void googlechat_search_users_text(GoogleChatAccount *ha, const gchar *text);
 
 typedef enum {
@@ -58,45 +75,123 @@ typedef enum {
 PurpleHttpConnection *googlechat_raw_request(GoogleChatAccount *ha, const gchar *path, GoogleChatContentType request_type, const gchar *request_data, gssize request_len, GoogleChatContentType response_type, PurpleHttpCallback callback, gpointer user_data);
 
 typedef void(* GoogleChatApiResponseFunc)(GoogleChatAccount *ha, ProtobufCMessage *response, gpointer user_data);
-void googlechat_api_request(GoogleChatAccount *ha, const gchar *endpoint, ProtobufCMessage *request, GoogleChatApiResponseFunc callback, ProtobufCMessage *response_message, gpointer user_data);
+
+/**
+ * What a request's callback needs to know about it, handed to purple_http_request() as the user_data.
+ * They're recycled through a small per-account pool, so only set the fields that are needed.
+ */
+struct _GoogleChatRequestContext {
+	GoogleChatAccount *ha;
+	GoogleChatRequestContext *next;  // Next context in the account's pool, while it's unused
+	
+	// API requests, see googlechat_api_request()
+	GoogleChatApiResponseFunc callback;
+	const ProtobufCMessageDescriptor *response_descriptor;
+	gpointer user_data;
+	GoogleChatApiPriority priority;
+	gchar *endpoint;                 // Only set while the request is waiting in one of the api_queues
+	gchar *request_data;
+	gsize request_len;
+	gint64 queued_at;
+	gchar *cache_key;                // Set if the response should be cached for identical requests
+	gboolean report_failure;         // Call back with a NULL response if the request fails, see googlechat_api_request()
+	GByteArray *cached_response;     // Set if the request is being answered from the cache
+	
+	// Image fetches and uploads, user searches
+	gchar *conv_id;
+	gchar *sender_id;
+	gchar *url;
+	gchar *drive_url;
+	gchar *search_term;
+	PurpleImage *image;              // Not owned
+	PurpleMessageFlags msg_flags;
+	time_t message_timestamp;
+};
+
+/**
+ * Gets a zeroed request context from the account's pool.
+ */
+GoogleChatRequestContext *googlechat_request_context_new(GoogleChatAccount *ha);
+
+/**
+ * Frees a request context's strings and cached_response, and returns it to the pool.
+ */
+void googlechat_request_context_free(GoogleChatRequestContext *context);
+
+/**
+ * Frees the account's unused request contexts.  Call once the account's connections have been cancelled.
+ */
+void googlechat_request_context_pool_free(GoogleChatAccount *ha);
+
+/**
+ * Sends a protobuf API request once there's room for it among the other requests of the same priority.
+ * Queued interactive requests are always sent ahead of queued sync and background ones.
+ * Reads that can be answered from the cache (get_group, list_members, get_user_status) also have
+ * their callback called with a NULL response if the request fails, so that user_data can be freed.
+ */
+void googlechat_api_request(GoogleChatAccount *ha, const gchar *endpoint, GoogleChatApiPriority priority, ProtobufCMessage *request, GoogleChatApiResponseFunc callback, const ProtobufCMessageDescriptor *response_descriptor, gpointer user_data);
+
+/**
+ * Sets up the per-priority API request queues.
+ */
+void googlechat_api_queues_init(GoogleChatAccount *ha);
+
+/**
+ * Drops any API requests that haven't been sent yet.  Call before cancelling the account's connections.
+ */
+void googlechat_api_queues_free(GoogleChatAccount *ha);
+
+/**
+ * Cancels everything the account has in flight or queued, for when it's closing.  Callbacks that
+ * would be told about a failure get a NULL response, and every request context is freed.
+ */
+void googlechat_cancel_requests(GoogleChatAccount *ha);
+
+/**
+ * Forgets cached API responses, eg after the server says a group or user has changed.
+ * Requests still in flight are left alone.
+ *
+ * \param ha
+ *      The account.
+ * \param endpoint (optional)
+ *      Only forget responses from this endpoint, eg "/api/get_user_status?rt=b".  NULL forgets everything.
+ */
+void googlechat_api_cache_invalidate(GoogleChatAccount *ha, const gchar *endpoint);
 
 
-#define GOOGLECHAT_DEFINE_API_REQUEST_RESPONSE_FUNC(name, request_type, response_name, type, url) \
+#define GOOGLECHAT_DEFINE_API_REQUEST_RESPONSE_FUNC(name, request_type, response_name, type, url, priority) \
 typedef void(* GoogleChatApi##type##ResponseFunc)(GoogleChatAccount *ha, type##Response *response, gpointer user_data);\
 static inline void \
 googlechat_api_##name(GoogleChatAccount *ha, request_type##Request *request, GoogleChatApi##type##ResponseFunc callback, gpointer user_data)\
 {\
-	type##Response *response = g_new0(type##Response, 1);\
-	\
-	response_name##_response__init(response);\
-	googlechat_api_request(ha, "/api/" url "?rt=b", (ProtobufCMessage *)request, (GoogleChatApiResponseFunc)callback, (ProtobufCMessage *)response, user_data);\
+	googlechat_api_request(ha, "/api/" url "?rt=b", GOOGLECHAT_API_PRIORITY_##priority, (ProtobufCMessage *)request, (GoogleChatApiResponseFunc)callback, &response_name##_response__descriptor, user_data);\
 }
 
-#define GOOGLECHAT_DEFINE_API_REQUEST_FUNC(name, type, url) \
-	GOOGLECHAT_DEFINE_API_REQUEST_RESPONSE_FUNC(name, type, name, type, url)
-
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(create_topic, CreateTopic, "create_topic");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(get_user_status, GetUserStatus, "get_user_status");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(get_members, GetMembers, "get_members");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(set_typing_state, SetTypingState, "set_typing_state");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(list_topics, ListTopics, "list_topics");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(get_user_presence, GetUserPresence, "get_user_presence");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(get_self_user_status, GetSelfUserStatus, "get_self_user_status");
-GOOGLECHAT_DEFINE_API_REQUEST_RESPONSE_FUNC(catch_up_group, CatchUpGroup, catch_up, CatchUp, "catch_up_group");
-GOOGLECHAT_DEFINE_API_REQUEST_RESPONSE_FUNC(catch_up_user, CatchUpUser, catch_up, CatchUp, "catch_up_user");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(get_group, GetGroup, "get_group");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(create_group, CreateGroup, "create_group");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(create_dm, CreateDm, "create_dm");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(paginated_world, PaginatedWorld, "paginated_world");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(create_membership, CreateMembership, "create_membership");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(remove_memberships, RemoveMemberships, "remove_memberships");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(hide_group, HideGroup, "hide_group");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(mark_group_readstate, MarkGroupReadstate, "mark_group_readstate");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(set_presence_shared, SetPresenceShared, "set_presence_shared");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(set_dnd_duration, SetDndDuration, "set_dnd_duration");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(set_custom_status, SetCustomStatus, "set_custom_status");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(update_group, UpdateGroup, "update_group");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(block_entity, BlockEntity, "block_entity");
-GOOGLECHAT_DEFINE_API_REQUEST_FUNC(list_members, ListMembers, "list_members");
+#define GOOGLECHAT_DEFINE_API_REQUEST_FUNC(name, type, url, priority) \
+	GOOGLECHAT_DEFINE_API_REQUEST_RESPONSE_FUNC(name, type, name, type, url, priority)
+
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(create_topic, CreateTopic, "create_topic", INTERACTIVE);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(get_user_status, GetUserStatus, "get_user_status", BACKGROUND);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(get_members, GetMembers, "get_members", BACKGROUND);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(set_typing_state, SetTypingState, "set_typing_state", INTERACTIVE);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(list_topics, ListTopics, "list_topics", SYNC);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(get_user_presence, GetUserPresence, "get_user_presence", BACKGROUND);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(get_self_user_status, GetSelfUserStatus, "get_self_user_status", SYNC);
+GOOGLECHAT_DEFINE_API_REQUEST_RESPONSE_FUNC(catch_up_group, CatchUpGroup, catch_up, CatchUp, "catch_up_group", SYNC);
+GOOGLECHAT_DEFINE_API_REQUEST_RESPONSE_FUNC(catch_up_user, CatchUpUser, catch_up, CatchUp, "catch_up_user", SYNC);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(get_group, GetGroup, "get_group", SYNC);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(create_group, CreateGroup, "create_group", INTERACTIVE);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(create_dm, CreateDm, "create_dm", INTERACTIVE);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(paginated_world, PaginatedWorld, "paginated_world", SYNC);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(create_membership, CreateMembership, "create_membership", INTERACTIVE);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(remove_memberships, RemoveMemberships, "remove_memberships", INTERACTIVE);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(hide_group, HideGroup, "hide_group", INTERACTIVE);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(mark_group_readstate, MarkGroupReadstate, "mark_group_readstate", INTERACTIVE);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(set_presence_shared, SetPresenceShared, "set_presence_shared", INTERACTIVE);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(set_dnd_duration, SetDndDuration, "set_dnd_duration", INTERACTIVE);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(set_custom_status, SetCustomStatus, "set_custom_status", INTERACTIVE);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(update_group, UpdateGroup, "update_group", INTERACTIVE);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(block_entity, BlockEntity, "block_entity", INTERACTIVE);
+GOOGLECHAT_DEFINE_API_REQUEST_FUNC(list_members, ListMembers, "list_members", BACKGROUND);
 
 #endif /*_GOOGLECHAT_CONNECTION_H_*/
\ No newline at end of file
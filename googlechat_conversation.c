@@ -21,6 +21,7 @@
 #include "googlechat.pb-c.h"
 #include "googlechat_connection.h"
 #include "googlechat_events.h"
+#include "googlechat_cache.h"
 
 #include <string.h>
 #include <glib.h>
@@ -32,11 +33,11 @@
 // From googlechat_pblite
 gchar *pblite_dump_json(ProtobufCMessage *message);
 
-RequestHeader *
-googlechat_get_request_header(GoogleChatAccount *ha)
+void
+googlechat_request_header_init(GoogleChatAccount *ha)
 {
-	RequestHeader *header = g_new0(RequestHeader, 1);
-	ClientFeatureCapabilities *cfc = g_new0(ClientFeatureCapabilities, 1);
+	RequestHeader *header = &ha->request_header;
+	ClientFeatureCapabilities *cfc = &ha->request_header_capabilities;
 	
 	request_header__init(header);
 	
@@ -46,23 +47,29 @@ googlechat_get_request_header(GoogleChatAccount *ha)
 	header->has_client_version = TRUE;
 	header->client_version = 2440378181258;
 	
-	header->has_trace_id = TRUE;
-	header->trace_id = g_random_int();
-	
 	client_feature_capabilities__init(cfc);
 	header->client_feature_capabilities = cfc;
 	
 	cfc->has_spam_room_invites_level = TRUE;
 	cfc->spam_room_invites_level = CLIENT_FEATURE_CAPABILITIES__CAPABILITY_LEVEL__FULLY_SUPPORTED;
 	
-	return header;
+	// Everything but the trace_id is the same for every request, so only encode it once
+	g_free(ha->request_header_packed);
+	ha->request_header_packed_len = protobuf_c_message_get_packed_size((ProtobufCMessage *) header);
+	ha->request_header_packed = g_malloc(ha->request_header_packed_len ? ha->request_header_packed_len : 1);
+	protobuf_c_message_pack((ProtobufCMessage *) header, ha->request_header_packed);
+	
+	header->has_trace_id = TRUE;
 }
 
-void
-googlechat_request_header_free(RequestHeader *header)
+RequestHeader *
+googlechat_get_request_header(GoogleChatAccount *ha)
 {
-	g_free(header->client_feature_capabilities);
-	g_free(header);
+	RequestHeader *header = &ha->request_header;
+	
+	header->trace_id = g_random_int();
+	
+	return header;
 }
 
 static void 
@@ -96,13 +103,48 @@ googlechat_get_self_user_status(GoogleChatAccount *ha)
 	
 	googlechat_api_get_self_user_status(ha, &request, googlechat_got_self_user_status, NULL);
 	
-	googlechat_request_header_free(request.request_header);
-	
 	if (ha->last_event_timestamp != 0) {
 		googlechat_get_all_events(ha, ha->last_event_timestamp);
 	}
 }
 
+void
+googlechat_got_user_status(GoogleChatAccount *ha, const gchar *user_id, const gchar *status_id, const gchar *message)
+{
+	guint64 *previous;
+	guint64 packed;
+	
+	g_return_if_fail(status_id != NULL);
+	
+	// Only a hash of the message is kept, so at worst a collision hides a change of status message
+	packed = ((guint64) g_str_hash(status_id) << 32) | (message != NULL ? g_str_hash(message) : 0);
+	
+	previous = g_hash_table_lookup(ha->presence_statuses, user_id);
+	if (previous != NULL && *previous == packed) {
+		ha->presence_unchanged++;
+		return;
+	}
+	
+	if (purple_blist_find_buddy(ha->account, user_id) == NULL) {
+		// Nothing to update, and not remembering them means they'll get a status if they're added
+		g_hash_table_remove(ha->presence_statuses, user_id);
+		return;
+	}
+	
+	if (previous == NULL) {
+		previous = g_new(guint64, 1);
+		g_hash_table_insert(ha->presence_statuses, g_strdup(user_id), previous);
+	}
+	*previous = packed;
+	ha->presence_changed++;
+	
+	if (message != NULL) {
+		purple_protocol_got_user_status(ha->account, user_id, status_id, "message", message, NULL);
+	} else {
+		purple_protocol_got_user_status(ha->account, user_id, status_id, NULL);
+	}
+}
+
 static void
 googlechat_got_users_presence(GoogleChatAccount *ha, GetUserPresenceResponse *response, gpointer user_data)
 {
@@ -114,7 +156,9 @@ googlechat_got_users_presence(GoogleChatAccount *ha, GetUserPresenceResponse *re
 		
 		const gchar *user_id = user_presence->user_id->id;
 		const gchar *status_id = NULL;
-		gchar *message = NULL;
+		const gchar *message = NULL;
+		
+		googlechat_presence_refreshed(ha, user_id);
 		
 		gboolean available = FALSE;
 		gboolean reachable = FALSE;
@@ -142,49 +186,24 @@ googlechat_got_users_presence(GoogleChatAccount *ha, GetUserPresenceResponse *re
 			const gchar *status_text = user_status->custom_status->status_text;
 			
 			if (status_text && *status_text) {
-				message = g_strdup(status_text);
+				message = status_text;
 			}
 		}
 		
-		if (message != NULL) {
-			purple_protocol_got_user_status(ha->account, user_id, status_id, "message", message, NULL);
-			g_free(message);
-		} else {
-			purple_protocol_got_user_status(ha->account, user_id, status_id, NULL);
-		}
+		googlechat_got_user_status(ha, user_id, status_id, message);
 	}
 }
 
-void
-googlechat_get_users_presence(GoogleChatAccount *ha, GList *user_ids)
+static void
+googlechat_send_users_presence_request(GoogleChatAccount *ha, UserId **user_ids, guint n_user_ids)
 {
 	GetUserPresenceRequest request;
-	UserId **user_id;
-	guint n_user_id;
-	GList *cur;
-	guint i;
 	
 	get_user_presence_request__init(&request);
 	request.request_header = googlechat_get_request_header(ha);
 	
-	n_user_id = g_list_length(user_ids);
-	user_id = g_new0(UserId *, n_user_id);
-	
-	for (i = 0, cur = user_ids; cur && cur->data && i < n_user_id; (cur = cur->next), i++) {
-		gchar *who = (gchar *) cur->data;
-		
-		if (G_UNLIKELY(!googlechat_is_valid_id(who))) {
-			i--;
-			n_user_id--;
-		} else {
-			user_id[i] = g_new0(UserId, 1);
-			user_id__init(user_id[i]);
-			user_id[i]->id = who;
-		}
-	}
-	
-	request.user_ids = user_id;
-	request.n_user_ids = n_user_id;
+	request.user_ids = user_ids;
+	request.n_user_ids = n_user_ids;
 	
 	request.include_user_status = TRUE;
 	request.has_include_user_status = TRUE;
@@ -192,32 +211,135 @@ googlechat_get_users_presence(GoogleChatAccount *ha, GList *user_ids)
 	request.has_include_active_until = TRUE;
 
 	googlechat_api_get_user_presence(ha, &request, googlechat_got_users_presence, NULL);
+	ha->presence_requests++;
+}
+
+static gboolean
+googlechat_flush_users_presence(gpointer userdata)
+{
+	GoogleChatAccount *ha = userdata;
+	GHashTableIter iter;
+	gpointer key;
+	UserId *user_id;
+	UserId **user_id_ptrs;
+	guint n_user_id = 0;
+	guint batch_size;
+	
+	ha->presence_batch_timeout = 0;
 	
-	googlechat_request_header_free(request.request_header);
-	for (i = 0; i < n_user_id; i++) {
-		g_free(user_id[i]);
+	batch_size = MIN(g_hash_table_size(ha->pending_presence_ids), GOOGLECHAT_PRESENCE_BATCH_MAX_USERS);
+	if (batch_size == 0) {
+		return FALSE;
 	}
+	user_id = g_new0(UserId, batch_size);
+	user_id_ptrs = g_new0(UserId *, batch_size);
+	
+	// The ids are only borrowed until the request is packed, so clear the set afterwards
+	g_hash_table_iter_init(&iter, ha->pending_presence_ids);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		user_id__init(&user_id[n_user_id]);
+		user_id[n_user_id].id = key;
+		user_id_ptrs[n_user_id] = &user_id[n_user_id];
+		
+		if (++n_user_id == batch_size) {
+			googlechat_send_users_presence_request(ha, user_id_ptrs, n_user_id);
+			n_user_id = 0;
+		}
+	}
+	if (n_user_id > 0) {
+		googlechat_send_users_presence_request(ha, user_id_ptrs, n_user_id);
+	}
+	
+	g_hash_table_remove_all(ha->pending_presence_ids);
+	g_free(user_id_ptrs);
 	g_free(user_id);
+	
+	return FALSE;
 }
 
+/* Queues up the users, so that lookups made close together go out as one request */
+void
+googlechat_get_users_presence(GoogleChatAccount *ha, GList *user_ids)
+{
+	GList *cur;
+	
+	for (cur = user_ids; cur && cur->data; cur = cur->next) {
+		gchar *who = (gchar *) cur->data;
+		
+		if (G_UNLIKELY(!googlechat_is_valid_id(who))) {
+			continue;
+		}
+		if (!g_hash_table_contains(ha->pending_presence_ids, who)) {
+			g_hash_table_insert(ha->pending_presence_ids, g_strdup(who), NULL);
+		}
+		ha->presence_lookups++;
+	}
+	
+	if (ha->presence_batch_timeout == 0 && g_hash_table_size(ha->pending_presence_ids) > 0) {
+		ha->presence_batch_timeout = g_timeout_add(GOOGLECHAT_PRESENCE_BATCH_DELAY_MS, googlechat_flush_users_presence, ha);
+	}
+}
+
+typedef struct {
+	gint64 refreshed;    // When we were last told their presence
+	guint spread;        // Random extra wait before polling them again, in 1/1000ths of the poll interval
+} GoogleChatPresenceRefresh;
+
+void
+googlechat_presence_refreshed(GoogleChatAccount *ha, const gchar *user_id)
+{
+	GoogleChatPresenceRefresh *refresh = g_hash_table_lookup(ha->presence_refreshed, user_id);
+	
+	if (refresh == NULL) {
+		refresh = g_new(GoogleChatPresenceRefresh, 1);
+		g_hash_table_insert(ha->presence_refreshed, g_strdup(user_id), refresh);
+	}
+	refresh->refreshed = time(NULL);
+	// Up to a quarter of the interval, picked afresh each time so buddies don't keep coming due together
+	refresh->spread = g_random_int_range(0, 250);
+}
+
+/* Asks about buddies whose presence we haven't heard about for a while, sooner for those we're talking to */
 gboolean
 googlechat_poll_buddy_status(gpointer userdata)
 {
 	GoogleChatAccount *ha = userdata;
 	GSList *buddies, *i;
 	GList *user_list = NULL;
+	gint64 now;
 	
 	if (!PURPLE_CONNECTION_IS_CONNECTED(ha->pc)) {
 		return FALSE;
 	}
 	
+	now = time(NULL);
 	buddies = purple_blist_find_buddies(ha->account, NULL);
 	for(i = buddies; i; i = i->next) {
 		PurpleBuddy *buddy = i->data;
-		user_list = g_list_prepend(user_list, (gpointer) purple_buddy_get_name(buddy));
+		const gchar *name = purple_buddy_get_name(buddy);
+		GoogleChatPresenceRefresh *refresh = g_hash_table_lookup(ha->presence_refreshed, name);
+		
+		if (refresh != NULL) {
+			guint interval;
+			
+			if (purple_conversations_find_im_with_account(name, ha->account) != NULL) {
+				interval = GOOGLECHAT_PRESENCE_ACTIVE_INTERVAL;
+			} else {
+				interval = GOOGLECHAT_PRESENCE_IDLE_INTERVAL;
+			}
+			interval += interval * refresh->spread / 1000;
+			
+			if (now - refresh->refreshed < interval) {
+				continue;
+			}
+		}
+		
+		user_list = g_list_prepend(user_list, (gpointer) name);
 	}
 	
-	googlechat_get_users_presence(ha, user_list);
+	if (user_list != NULL) {
+		googlechat_get_users_presence(ha, user_list);
+	}
 	
 	g_slist_free(buddies);
 	g_list_free(user_list);
@@ -278,87 +400,319 @@ googlechat_got_users_information_member(GoogleChatAccount *ha, Member *member)
 	//TODO - process user->deleted == TRUE;
 }
 
+/*
+ * Member lookups
+ *
+ * Everyone who wants a user's details asks through googlechat_lookup_members().  Each
+ * user id gets one GoogleChatMemberLookup while it's queued or being fetched, and any
+ * asks that come in meanwhile are attached to it, so a user is only ever in one
+ * get_members request at a time.  Queued ids go out together after a short delay.
+ */
+
+typedef struct {
+	GoogleChatMemberFunc callback;
+	gpointer user_data;
+	GDestroyNotify destroy;
+	guint outstanding;   // User ids still waiting on a response
+} GoogleChatMemberAsk;
+
+typedef struct {
+	GSList *asks;        // GoogleChatMemberAsk's waiting on this user
+	gint64 sent_at;      // Monotonic time the id went out, or 0 while still queued
+	guint batch;         // member_batch_serial of the request it went out in
+	guint attempts;      // Number of times it's been sent
+} GoogleChatMemberLookup;
+
 static void
-googlechat_got_users_information(GoogleChatAccount *ha, GetMembersResponse *response, gpointer user_data)
+googlechat_member_ask_done(GoogleChatMemberAsk *ask)
 {
+	if (--ask->outstanding == 0) {
+		if (ask->destroy != NULL) {
+			ask->destroy(ask->user_data);
+		}
+		g_free(ask);
+	}
+}
+
+static void
+googlechat_member_lookup_free(gpointer data)
+{
+	GoogleChatMemberLookup *lookup = data;
+	
+	g_slist_free_full(lookup->asks, (GDestroyNotify) googlechat_member_ask_done);
+	g_free(lookup);
+}
+
+static void
+googlechat_got_members(GoogleChatAccount *ha, GetMembersResponse *response, gpointer user_data)
+{
+	guint batch = GPOINTER_TO_UINT(user_data);
+	GoogleChatMemberLookup *lookup;
+	GHashTableIter iter;
+	gpointer value;
+	GSList *cur;
 	guint i;
 	
-	for (i = 0; i < response->n_member_profiles; i++) {
-		Member *member = response->member_profiles[i]->member;
-		googlechat_got_users_information_member(ha, member);
+	for (i = 0; i < response->n_members + response->n_member_profiles; i++) {
+		Member *member = i < response->n_members ? response->members[i] : response->member_profiles[i - response->n_members]->member;
+		User *user = member ? member->user : NULL;
+		const gchar *user_id = user && user->user_id ? user->user_id->id : NULL;
+		
+		googlechat_user_cache_store(ha, user);
+		
+		lookup = user_id ? g_hash_table_lookup(ha->member_lookups, user_id) : NULL;
+		if (lookup == NULL) {
+			continue;
+		}
+		
+		for (cur = lookup->asks; cur; cur = cur->next) {
+			GoogleChatMemberAsk *ask = cur->data;
+			ask->callback(ha, member, ask->user_data);
+		}
 	}
 	
-	for (i = 0; i < response->n_members; i++) {
-		Member *member = response->members[i];
-		googlechat_got_users_information_member(ha, member);
+	// Everyone in the batch has had their answer now, even if the server didn't know them
+	g_hash_table_iter_init(&iter, ha->member_lookups);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		lookup = value;
+		if (lookup->sent_at != 0 && lookup->batch == batch) {
+			g_hash_table_iter_remove(&iter);
+		}
+	}
+}
+
+static void googlechat_send_member_lookups(GoogleChatAccount *ha);
+
+// A failed request never calls back, so go over anything that's been waiting too long
+static gboolean
+googlechat_retry_member_lookups(gpointer userdata)
+{
+	GoogleChatAccount *ha = userdata;
+	GHashTableIter iter;
+	gpointer value;
+	
+	googlechat_send_member_lookups(ha);
+	
+	g_hash_table_iter_init(&iter, ha->member_lookups);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		GoogleChatMemberLookup *lookup = value;
+		if (lookup->sent_at != 0) {
+			return TRUE;
+		}
 	}
+	
+	ha->member_retry_timeout = 0;
+	return FALSE;
 }
 
+/* The ids in batch are borrowed from member_lookups */
 static void
-googlechat_get_users_information_internal(GoogleChatAccount *ha, GList *user_ids, GoogleChatApiGetMembersResponseFunc callback, gpointer userdata)
+googlechat_send_members_request(GoogleChatAccount *ha, GPtrArray *batch, guint serial)
 {
 	GetMembersRequest request;
-	size_t n_member_ids;
-	MemberId **member_ids;
-	GList *cur;
+	MemberId *member_id;
+	MemberId **member_id_ptrs;
+	UserId *user_id;
 	guint i;
 	
 	get_members_request__init(&request);
 	request.request_header = googlechat_get_request_header(ha);
 	
-	n_member_ids = g_list_length(user_ids);
-	member_ids = g_new0(MemberId *, n_member_ids);
+	member_id = g_new0(MemberId, batch->len);
+	member_id_ptrs = g_new0(MemberId *, batch->len);
+	user_id = g_new0(UserId, batch->len);
 	
-	for (i = 0, cur = user_ids; cur && cur->data && i < n_member_ids; (cur = cur->next), i++) {
-		gchar *who = (gchar *) cur->data;
+	for (i = 0; i < batch->len; i++) {
+		user_id__init(&user_id[i]);
+		user_id[i].id = g_ptr_array_index(batch, i);
+		
+		member_id__init(&member_id[i]);
+		member_id[i].user_id = &user_id[i];
+		member_id_ptrs[i] = &member_id[i];
+	}
+	
+	request.member_ids = member_id_ptrs;
+	request.n_member_ids = batch->len;
+	
+	googlechat_api_get_members(ha, &request, googlechat_got_members, GUINT_TO_POINTER(serial));
+	ha->member_requests++;
+	
+	if (ha->member_retry_timeout == 0) {
+		ha->member_retry_timeout = g_timeout_add_seconds(GOOGLECHAT_MEMBERS_LOOKUP_TIMEOUT, googlechat_retry_member_lookups, ha);
+	}
+	
+	g_free(user_id);
+	g_free(member_id_ptrs);
+	g_free(member_id);
+}
+
+static void
+googlechat_send_member_lookups(GoogleChatAccount *ha)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	GPtrArray *batch = NULL;
+	gint64 now = g_get_monotonic_time();
+	
+	g_hash_table_iter_init(&iter, ha->member_lookups);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		GoogleChatMemberLookup *lookup = value;
+		
+		// Queued ids, or ones whose request seems to have been lost
+		if (lookup->sent_at != 0 && now - lookup->sent_at < GOOGLECHAT_MEMBERS_LOOKUP_TIMEOUT * G_USEC_PER_SEC) {
+			continue;
+		}
+		
+		if (lookup->attempts >= GOOGLECHAT_MEMBERS_LOOKUP_ATTEMPTS) {
+			// Give up, which lets everyone waiting on them finish
+			purple_debug_warning("googlechat", "Couldn't look up user %s\n", (const gchar *) key);
+			g_hash_table_iter_remove(&iter);
+			continue;
+		}
+		
+		if (batch == NULL) {
+			batch = g_ptr_array_new();
+			ha->member_batch_serial++;
+		}
+		g_ptr_array_add(batch, key);
+		lookup->sent_at = now;
+		lookup->batch = ha->member_batch_serial;
+		lookup->attempts++;
+		
+		if (batch->len == GOOGLECHAT_MEMBERS_BATCH_MAX_USERS) {
+			googlechat_send_members_request(ha, batch, ha->member_batch_serial);
+			g_ptr_array_free(batch, TRUE);
+			batch = NULL;
+		}
+	}
+	
+	if (batch != NULL) {
+		googlechat_send_members_request(ha, batch, ha->member_batch_serial);
+		g_ptr_array_free(batch, TRUE);
+	}
+}
+
+static gboolean
+googlechat_flush_member_lookups(gpointer userdata)
+{
+	GoogleChatAccount *ha = userdata;
+	
+	ha->member_batch_timeout = 0;
+	googlechat_send_member_lookups(ha);
+	
+	return FALSE;
+}
+
+void
+googlechat_lookup_members(GoogleChatAccount *ha, GList *user_ids, GoogleChatMemberFunc callback, gpointer user_data, GDestroyNotify destroy)
+{
+	GoogleChatMemberAsk *ask;
+	GList *cur;
+	gint64 now = g_get_monotonic_time();
+	gboolean needs_flush = FALSE;
+	
+	ask = g_new0(GoogleChatMemberAsk, 1);
+	ask->callback = callback;
+	ask->user_data = user_data;
+	ask->destroy = destroy;
+	ask->outstanding = 1; // Held until every id has been queued
+	
+	for (cur = user_ids; cur && cur->data; cur = cur->next) {
+		const gchar *who = cur->data;
+		GoogleChatMemberLookup *lookup;
 		
 		if (G_UNLIKELY(!googlechat_is_valid_id(who))) {
-			i--;
-			n_member_ids--;
+			continue;
 		}
 		
-		member_ids[i] = g_new0(MemberId, 1);
-		member_id__init(member_ids[i]);
+		lookup = g_hash_table_lookup(ha->member_lookups, who);
+		if (lookup == NULL) {
+			lookup = g_new0(GoogleChatMemberLookup, 1);
+			g_hash_table_insert(ha->member_lookups, g_strdup(who), lookup);
+		} else if (g_slist_find(lookup->asks, ask)) {
+			continue;
+		}
 		
-		member_ids[i]->user_id = g_new0(UserId, 1);
-		user_id__init(member_ids[i]->user_id);
-		member_ids[i]->user_id->id = (gchar *) cur->data;
+		if (lookup->sent_at == 0 || now - lookup->sent_at >= GOOGLECHAT_MEMBERS_LOOKUP_TIMEOUT * G_USEC_PER_SEC) {
+			needs_flush = TRUE;
+		}
 		
+		lookup->asks = g_slist_prepend(lookup->asks, ask);
+		ask->outstanding++;
+		ha->member_lookups_asked++;
 	}
 	
-	request.member_ids = member_ids;
-	request.n_member_ids = n_member_ids;
-	
-	googlechat_api_get_members(ha, &request, callback, userdata);
+	if (needs_flush && ha->member_batch_timeout == 0) {
+		ha->member_batch_timeout = g_timeout_add(GOOGLECHAT_MEMBERS_BATCH_DELAY_MS, googlechat_flush_member_lookups, ha);
+	}
 	
-	googlechat_request_header_free(request.request_header);
-	for (i = 0; i < n_member_ids; i++) {
-		g_free(member_ids[i]->user_id);
-		g_free(member_ids[i]);
+	googlechat_member_ask_done(ask);
+}
+
+void
+googlechat_member_lookups_init(GoogleChatAccount *ha)
+{
+	ha->member_lookups = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, googlechat_member_lookup_free);
+}
+
+void
+googlechat_member_lookups_free(GoogleChatAccount *ha)
+{
+	if (ha->member_batch_timeout) {
+		g_source_remove(ha->member_batch_timeout);
+		ha->member_batch_timeout = 0;
 	}
-	g_free(member_ids);
+	if (ha->member_retry_timeout) {
+		g_source_remove(ha->member_retry_timeout);
+		ha->member_retry_timeout = 0;
+	}
+	g_hash_table_destroy(ha->member_lookups);
+	ha->member_lookups = NULL;
+}
+
+static void
+googlechat_got_users_information_cb(GoogleChatAccount *ha, Member *member, gpointer user_data)
+{
+	googlechat_got_users_information_member(ha, member);
 }
 
+/* Fills in buddies from the profile cache straight away, and only asks the server about
+ * users we don't know or whose cached profile has gone stale */
 void
 googlechat_get_users_information(GoogleChatAccount *ha, GList *user_ids)
 {
-	googlechat_get_users_information_internal(ha, user_ids, googlechat_got_users_information, NULL);
+	GList *cur, *to_fetch = NULL;
+	
+	for (cur = user_ids; cur && cur->data; cur = cur->next) {
+		gboolean stale = TRUE;
+		User *user = googlechat_user_cache_lookup(ha, cur->data, &stale);
+		
+		if (user != NULL) {
+			Member member;
+			
+			member__init(&member);
+			member.user = user;
+			googlechat_got_users_information_member(ha, &member);
+		}
+		
+		if (stale) {
+			to_fetch = g_list_prepend(to_fetch, cur->data);
+		}
+	}
+	
+	if (to_fetch != NULL) {
+		googlechat_lookup_members(ha, to_fetch, googlechat_got_users_information_cb, NULL, NULL);
+		g_list_free(to_fetch);
+	}
 }
 
 static void
-googlechat_got_user_info(GoogleChatAccount *ha, GetMembersResponse *response, gpointer user_data)
+googlechat_got_user_info(GoogleChatAccount *ha, Member *member, gpointer user_data)
 {
-	Member *member = NULL;
 	PurpleNotifyUserInfo *user_info;
 	gchar *who = user_data;
 	
-	if (response->n_members > 0) {
-		member = response->members[0];
-	} else if (response->n_member_profiles > 0) {
-		member = response->member_profiles[0]->member;
-	}
 	if (member == NULL || member->user == NULL) {
-		g_free(who);
 		return;
 	}
 	User *user = member->user;
@@ -389,8 +743,6 @@ googlechat_got_user_info(GoogleChatAccount *ha, GetMembersResponse *response, gp
 	}
 	
 	purple_notify_userinfo(ha->pc, who, user_info, NULL, NULL);
-       
-	g_free(who);
 }
 
 
@@ -398,28 +750,9 @@ void
 googlechat_get_info(PurpleConnection *pc, const gchar *who)
 {
 	GoogleChatAccount *ha = purple_connection_get_protocol_data(pc);
-	GetMembersRequest request;
-	MemberId member_id;
-	MemberId *member_ids;
-	UserId user_id;
-	gchar *who_dup = g_strdup(who);
+	GList user_list = { (gpointer) who, NULL, NULL };
 	
-	get_members_request__init(&request);
-	request.request_header = googlechat_get_request_header(ha);
-	
-	user_id__init(&user_id);
-	user_id.id = who_dup;
-	
-	member_id__init(&member_id);
-	member_id.user_id = &user_id;
-	
-	member_ids = &member_id;
-	request.member_ids = &member_ids;
-	request.n_member_ids = 1;
-	
-	googlechat_api_get_members(ha, &request, googlechat_got_user_info, who_dup);
-	
-	googlechat_request_header_free(request.request_header);
+	googlechat_lookup_members(ha, &user_list, googlechat_got_user_info, g_strdup(who), g_free);
 }
 
 static void
@@ -476,8 +809,6 @@ googlechat_get_conversation_events(GoogleChatAccount *ha, const gchar *conv_id,
 	
 	googlechat_api_catch_up_group(ha, &request, googlechat_got_events, NULL);
 	
-	googlechat_request_header_free(request.request_header);
-	
 }
 
 void
@@ -503,8 +834,6 @@ googlechat_get_all_events(GoogleChatAccount *ha, guint64 since_timestamp)
 	request.range = &range;
 	
 	googlechat_api_catch_up_user(ha, &request, googlechat_got_events, NULL);
-	
-	googlechat_request_header_free(request.request_header);
 }
 
 GList *
@@ -586,39 +915,34 @@ googlechat_alias_group_user_hack(PurpleChatConversation *chat, const char *who,
 }
 
 static void
-googlechat_got_group_users(GoogleChatAccount *ha, GetMembersResponse *response, gpointer user_data)
+googlechat_got_group_users(GoogleChatAccount *ha, Member *member, gpointer user_data)
 {
 	gchar *conv_id = user_data;
+	PurpleChatConversation *chatconv = purple_conversations_find_chat_with_account(conv_id, ha->account);
+	User *user = member ? member->user : NULL;
+	const gchar *user_id = user && user->user_id ? user->user_id->id : NULL;
 	
-	if (response != NULL) {
-		guint i;
-		PurpleChatConversation *chatconv = purple_conversations_find_chat_with_account(conv_id, ha->account);
-		
-		for (i = 0; i < response->n_members; i++) {
-			Member *member = response->members[i];
-			User *user = member ? member->user : NULL;
-			const gchar *user_id = user && user->user_id ? user->user_id->id : NULL;
-			
-			if (user_id && user && user->name && !purple_strequal(ha->self_gaia_id, user_id)) {
-				googlechat_alias_group_user_hack(chatconv, user_id, user->name);
-			}
-		}
-		
+	if (chatconv && user_id && user->name && !purple_strequal(ha->self_gaia_id, user_id)) {
+		googlechat_alias_group_user_hack(chatconv, user_id, user->name);
 	}
-	
-	g_free(conv_id);
 }
 
 static void
 googlechat_got_group_info(GoogleChatAccount *ha, GetGroupResponse *response, gpointer user_data)
 {
-	Group *group = response->group;
-	Membership **memberships = response->memberships;
+	Group *group;
+	Membership **memberships;
 	guint i;
 	PurpleChatConversation *chatconv;
 	gchar *conv_id;
 	GList *unknown_user_ids = NULL;
 	
+	if (response == NULL) {
+		// The request failed
+		return;
+	}
+	group = response->group;
+	memberships = response->memberships;
 	g_return_if_fail(group != NULL);
 	
 	GroupId *group_id = group->group_id;
@@ -657,7 +981,8 @@ googlechat_got_group_info(GoogleChatAccount *ha, GetGroupResponse *response, gpo
 	}
 	
 	if (unknown_user_ids != NULL) {
-		googlechat_get_users_information_internal(ha, unknown_user_ids, googlechat_got_group_users, g_strdup(conv_id));
+		googlechat_lookup_members(ha, unknown_user_ids, googlechat_got_group_users, g_strdup(conv_id), g_free);
+		g_list_free(unknown_user_ids);
 	}
 }
 
@@ -693,8 +1018,6 @@ googlechat_lookup_group_info(GoogleChatAccount *ha, const gchar *conv_id)
 	request.fetch_options = &fetch_options;
 	
 	googlechat_api_get_group(ha, &request, googlechat_got_group_info, NULL);
-	
-	googlechat_request_header_free(request.request_header);
 }
 
 void
@@ -762,8 +1085,6 @@ googlechat_join_chat(PurpleConnection *pc, GHashTable *data)
 	request.n_member_ids = 1;
 	
 	googlechat_api_create_membership(ha, &request, NULL, NULL);
-	
-	googlechat_request_header_free(request.request_header);
 }
 
 /*
@@ -791,8 +1112,6 @@ googlechat_join_chat_from_url(GoogleChatAccount *ha, const gchar *url)
 	request.url = (gchar *) url;
 	
 	googlechat_pblite_open_group_conversation_from_url(ha, &request, googlechat_got_join_chat_from_url, NULL);
-	
-	googlechat_request_header_free(request.request_header);
 }
 */
 
@@ -935,16 +1254,16 @@ googlechat_add_conversation_to_blist(GoogleChatAccount *ha, Group *group, GHashT
 }
 
 static void
-googlechat_got_conversation_list(GoogleChatAccount *ha, PaginatedWorldResponse *response, gpointer user_data)
+googlechat_process_world_items(GoogleChatAccount *ha, WorldItemLite **world_items, gsize n_world_items)
 {
-	guint i;
+	gsize i;
 	GHashTable *unique_user_ids = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
 	GList *unique_user_ids_list;
 	PurpleBlistNode *node;
 	PurpleGroup *googlechat_group = NULL;
 	
-	for (i = 0; i < response->n_world_items; i++) {
-		WorldItemLite *world_item_lite = response->world_items[i];
+	for (i = 0; i < n_world_items; i++) {
+		WorldItemLite *world_item_lite = world_items[i];
 		GroupId *group_id = world_item_lite->group_id;
 		gboolean is_dm = !!group_id->dm_id;
 		gchar *conv_id = is_dm ? group_id->dm_id->dm_id : group_id->space_id->space_id;
@@ -1039,21 +1358,48 @@ googlechat_got_conversation_list(GoogleChatAccount *ha, PaginatedWorldResponse *
 	g_hash_table_unref(unique_user_ids);
 }
 
+static void
+googlechat_got_conversation_list(GoogleChatAccount *ha, PaginatedWorldResponse *response, gpointer user_data)
+{
+	gboolean is_delta = GPOINTER_TO_INT(user_data);
+	
+	purple_debug_info("googlechat", "Got %" G_GSIZE_FORMAT " conversations in %s directory\n",
+	                  (gsize) response->n_world_items, is_delta ? "delta" : "full");
+	
+	googlechat_process_world_items(ha, response->world_items, response->n_world_items);
+	
+	// After processing, so the new conversations aren't pruned as unknown when it's saved
+	googlechat_world_cache_update(ha, response, is_delta);
+}
+
 void
 googlechat_get_conversation_list(GoogleChatAccount *ha)
 {
 	PaginatedWorldRequest request;
+	const gchar *world_consistency_token = googlechat_world_cache_get_token(ha);
+	
+	if (world_consistency_token != NULL && ha->self_gaia_id != NULL) {
+		// Serve the directory from the last login straight away, then ask only for what's changed since
+		gsize n_items;
+		WorldItemLite **items = googlechat_world_cache_get_items(ha, &n_items);
+		
+		purple_debug_info("googlechat", "Using %" G_GSIZE_FORMAT " cached conversations\n", n_items);
+		googlechat_process_world_items(ha, items, n_items);
+		g_free(items);
+	} else {
+		world_consistency_token = NULL;
+	}
+	
 	paginated_world_request__init(&request);
 	
 	request.request_header = googlechat_get_request_header(ha);
+	request.world_consistency_token = (gchar *) world_consistency_token;
 	request.has_fetch_from_user_spaces = TRUE;
 	request.fetch_from_user_spaces = TRUE;
 	request.has_fetch_snippets_for_unnamed_rooms = TRUE;
 	request.fetch_snippets_for_unnamed_rooms = TRUE;
 	
-	googlechat_api_paginated_world(ha, &request, googlechat_got_conversation_list, NULL);
-	
-	googlechat_request_header_free(request.request_header);
+	googlechat_api_paginated_world(ha, &request, googlechat_got_conversation_list, GINT_TO_POINTER(world_consistency_token != NULL));
 }
 
 
@@ -1229,8 +1575,6 @@ googlechat_block_user(PurpleConnection *pc, const char *who)
 	request.blocked = TRUE;
 	
 	googlechat_api_block_entity(ha, &request, NULL, NULL);
-	
-	googlechat_request_header_free(request.request_header);
 }
 
 void
@@ -1252,8 +1596,6 @@ googlechat_unblock_user(PurpleConnection *pc, const char *who)
 	request.blocked = FALSE;
 	
 	googlechat_api_block_entity(ha, &request, NULL, NULL);
-	
-	googlechat_request_header_free(request.request_header);
 }
 
 // Annotation ***annotations  - a pointer to an array of annotation objects
@@ -1496,6 +1838,7 @@ googlechat_free_annotations(Annotation **annotations)
 static void
 googlechat_conversation_send_image_part2_cb(PurpleHttpConnection *connection, PurpleHttpResponse *response, gpointer user_data)
 {
+	GoogleChatRequestContext *context = user_data;
 	GoogleChatAccount *ha;
 	gchar *conv_id;
 	const gchar *response_raw;
@@ -1513,11 +1856,12 @@ googlechat_conversation_send_image_part2_cb(PurpleHttpConnection *connection, Pu
 	
 	if (purple_http_response_get_error(response) != NULL) {
 		purple_notify_error(pc, _("Image Send Error"), _("There was an error sending the image"), purple_http_response_get_error(response), purple_request_cpar_from_connection(pc));
-		g_dataset_destroy(connection);
+		googlechat_request_context_free(context);
 		return;
 	}
 	
-	ha = user_data;
+	ha = context->ha;
+	conv_id = context->conv_id;
 	response_raw = purple_http_response_get_data(response, &response_len);
 	
 	decoded_response = g_base64_decode(response_raw, &response_len);
@@ -1526,8 +1870,6 @@ googlechat_conversation_send_image_part2_cb(PurpleHttpConnection *connection, Pu
 	if (unpacked_message != NULL) {
 		upload_metadata = (UploadMetadata *) unpacked_message;
 		
-		conv_id = g_dataset_get_data(connection, "conv_id");
-		
 		create_topic_request__init(&request);
 		annotation__init(&photo_annotation);
 		group_id__init(&group_id);
@@ -1565,34 +1907,33 @@ googlechat_conversation_send_image_part2_cb(PurpleHttpConnection *connection, Pu
 		
 		g_hash_table_insert(ha->sent_message_ids, message_id, NULL);
 		
-		g_dataset_destroy(connection);
-		googlechat_request_header_free(request.request_header);
 		protobuf_c_message_free_unpacked(unpacked_message, NULL);
 	
 	}
+	
+	g_free(decoded_response);
+	googlechat_request_context_free(context);
 }
 
 //Received the url to upload the image data to
 static void
 googlechat_conversation_send_image_part1_cb(PurpleHttpConnection *connection, PurpleHttpResponse *response, gpointer user_data)
 {
+	GoogleChatRequestContext *context = user_data;
 	GoogleChatAccount *ha;
-	gchar *conv_id;
 	PurpleImage *image;
 	const gchar *upload_url;
 	PurpleHttpRequest *request;
-	PurpleHttpConnection *new_connection;
 	PurpleConnection *pc = purple_http_conn_get_purple_connection(connection);
 	
 	if (purple_http_response_get_error(response) != NULL) {
 		purple_notify_error(pc, _("Image Send Error"), _("There was an error sending the image"), purple_http_response_get_error(response), purple_request_cpar_from_connection(pc));
-		g_dataset_destroy(connection);
+		googlechat_request_context_free(context);
 		return;
 	}
 	
-	ha = user_data;
-	conv_id = g_dataset_get_data(connection, "conv_id");
-	image = g_dataset_get_data(connection, "image");
+	ha = context->ha;
+	image = context->image;
 	
 	//x-guploader-uploadid: ADP...
 	//x-goog-upload-status: active
@@ -1609,19 +1950,18 @@ googlechat_conversation_send_image_part1_cb(PurpleHttpConnection *connection, Pu
 	purple_http_request_set_contents(request, purple_image_get_data(image), purple_image_get_data_size(image));
 
 	purple_http_request_header_set_printf(request, "Authorization", "Bearer %s", ha->access_token);
-	new_connection = purple_http_request(ha->pc, request, googlechat_conversation_send_image_part2_cb, ha);
-	purple_http_request_unref(request);
 	
-	g_dataset_set_data_full(new_connection, "conv_id", g_strdup(conv_id), g_free);
-	
-	g_dataset_destroy(connection);
+	// The upload only needs the conv_id from here on, so the context carries on to the next step
+	context->image = NULL;
+	purple_http_request(ha->pc, request, googlechat_conversation_send_image_part2_cb, context);
+	purple_http_request_unref(request);
 }
 
 static void
 googlechat_conversation_send_image(GoogleChatAccount *ha, const gchar *conv_id, PurpleImage *image)
 {
 	PurpleHttpRequest *request;
-	PurpleHttpConnection *connection;
+	GoogleChatRequestContext *context;
 	gchar *filename;
 	gchar *url;
 	
@@ -1632,7 +1972,7 @@ googlechat_conversation_send_image(GoogleChatAccount *ha, const gchar *conv_id,
 		filename = g_strdup_printf("purple%u.%s", g_random_int(), purple_image_get_extension(image));
 	}
 	
-	url = g_strdup_printf("https://chat.google.com/uploads?group_id=%s", purple_url_encode(conv_id));
+	url = g_strdup_printf("%s/uploads?group_id=%s", ha->server_url, purple_url_encode(conv_id));
 	request = purple_http_request_new(url);
 	purple_http_request_set_method(request, "POST");
 	purple_http_request_header_set(request, "x-goog-upload-protocol", "resumable");
@@ -1643,11 +1983,13 @@ googlechat_conversation_send_image(GoogleChatAccount *ha, const gchar *conv_id,
 	purple_http_request_set_keepalive_pool(request, ha->api_keepalive_pool);
 	
 	purple_http_request_header_set_printf(request, "Authorization", "Bearer %s", ha->access_token);
-	connection = purple_http_request(ha->pc, request, googlechat_conversation_send_image_part1_cb, ha);
-	purple_http_request_unref(request);
 	
-	g_dataset_set_data_full(connection, "conv_id", g_strdup(conv_id), g_free);
-	g_dataset_set_data_full(connection, "image", image, NULL);
+	context = googlechat_request_context_new(ha);
+	context->conv_id = g_strdup(conv_id);
+	context->image = image;
+	
+	purple_http_request(ha->pc, request, googlechat_conversation_send_image_part1_cb, context);
+	purple_http_request_unref(request);
 	
 	g_free(filename);
 }
@@ -1740,14 +2082,13 @@ googlechat_conversation_send_message(GoogleChatAccount *ha, const gchar *conv_id
 	message_info.has_accept_format_annotations = TRUE;
 	message_info.accept_format_annotations = TRUE; //false = treat message as markdown
 	
-	purple_debug_info("googlechat", "%s\n", pblite_dump_json((ProtobufCMessage *)&request)); //leaky
+	googlechat_debug_dump_message(PURPLE_DEBUG_INFO, NULL, (ProtobufCMessage *) &request);
 	
 	//TODO listen to response
 	googlechat_api_create_topic(ha, &request, NULL, NULL);
 	
 	g_hash_table_insert(ha->sent_message_ids, message_id, NULL);
 	
-	googlechat_request_header_free(request.request_header);
 	googlechat_free_annotations(annotations);
 
 	g_free(message_dup);
@@ -1904,8 +2245,6 @@ googlechat_conv_send_typing(PurpleConversation *conv, PurpleIMTypingState state,
 	//TODO dont send STOPPED if we just sent a message
 	googlechat_api_set_typing_state(ha, &request, NULL, NULL);
 	
-	googlechat_request_header_free(request.request_header);
-	
 	return 20;
 }
 
@@ -1958,8 +2297,6 @@ googlechat_chat_leave_by_conv_id(PurpleConnection *pc, const gchar *conv_id, con
 	//XX do we need to see if this was successful, or does it just come through as a new event?
 	googlechat_api_remove_memberships(ha, &request, NULL, NULL);
 	
-	googlechat_request_header_free(request.request_header);
-	
 	if (who == NULL) {
 		g_hash_table_remove(ha->group_chats, conv_id);
 	}
@@ -2004,9 +2341,7 @@ googlechat_created_dm(GoogleChatAccount *ha, CreateDmResponse *response, gpointe
 	gchar *message = user_data;
 	const gchar *conv_id;
 	
-	gchar *dump = pblite_dump_json((ProtobufCMessage *) response);
-	purple_debug_info("googlechat", "%s\n", dump);
-	g_free(dump);
+	googlechat_debug_dump_message(PURPLE_DEBUG_INFO, NULL, (ProtobufCMessage *) response);
 	
 	if (dm == NULL) {
 		purple_debug_error("googlechat", "Could not create DM\n");
@@ -2043,9 +2378,7 @@ googlechat_created_group(GoogleChatAccount *ha, CreateGroupResponse *response, g
 	gchar *message = user_data;
 	const gchar *conv_id;
 	
-	gchar *dump = pblite_dump_json((ProtobufCMessage *) response);
-	purple_debug_info("googlechat", "%s\n", dump);
-	g_free(dump);
+	googlechat_debug_dump_message(PURPLE_DEBUG_INFO, NULL, (ProtobufCMessage *) response);
 	
 	if (group == NULL) {
 		purple_debug_error("googlechat", "Could not create Group\n");
@@ -2106,11 +2439,8 @@ googlechat_create_conversation(GoogleChatAccount *ha, gboolean is_one_to_one, co
 		
 		googlechat_api_create_dm(ha, &request, googlechat_created_dm, message_dup);
 		
-		googlechat_request_header_free(request.request_header);
-		
 		
-		GList tmp_usr_list;
-		tmp_usr_list.data = (gpointer) who;
+		GList tmp_usr_list = { (gpointer) who, NULL, NULL };
 		googlechat_get_users_information(ha, &tmp_usr_list);
 		
 		
@@ -2139,8 +2469,6 @@ googlechat_create_conversation(GoogleChatAccount *ha, gboolean is_one_to_one, co
 		
 		googlechat_api_create_group(ha, &request, googlechat_created_group, message_dup);
 		
-		googlechat_request_header_free(request.request_header);
-		
 	}
 }
 
@@ -2177,8 +2505,6 @@ googlechat_archive_conversation(GoogleChatAccount *ha, const gchar *conv_id)
 	
 	googlechat_api_hide_group(ha, &request, NULL, NULL);
 	
-	googlechat_request_header_free(request.request_header);
-	
 	if (g_hash_table_contains(ha->one_to_ones, conv_id)) {
 		gchar *buddy_id = g_hash_table_lookup(ha->one_to_ones, conv_id);
 		
@@ -2263,8 +2589,6 @@ googlechat_chat_invite(PurpleConnection *pc, int id, const char *message, const
 	request.n_invitee_member_infos = 1;
 	
 	googlechat_api_create_membership(ha, &request, NULL, NULL);
-	
-	googlechat_request_header_free(request.request_header);
 }
 
 #define PURPLE_CONVERSATION_IS_VALID(conv) (g_list_find(purple_conversations_get_all(), conv) != NULL)
@@ -2334,8 +2658,6 @@ googlechat_mark_conversation_seen(PurpleConversation *conv, PurpleConversationUp
 	
 	googlechat_api_mark_group_readstate(ha, &request, NULL, NULL);
 	
-	googlechat_request_header_free(request.request_header);
-	
 	googlechat_subscribe_to_group(ha, &group_id);
 }
 
@@ -2381,9 +2703,6 @@ googlechat_set_status(PurpleAccount *account, PurpleStatus *status)
 	googlechat_api_set_presence_shared(ha, &presence_request, NULL, NULL);
 	googlechat_api_set_dnd_duration(ha, &dnd_request, NULL, NULL);
 	
-	googlechat_request_header_free(presence_request.request_header);
-	googlechat_request_header_free(dnd_request.request_header);
-	
 	const gchar *message = purple_status_get_attr_string(status, "message");
 	if (message && *message) {
 		SetCustomStatusRequest custom_status_request;
@@ -2405,8 +2724,6 @@ googlechat_set_status(PurpleAccount *account, PurpleStatus *status)
 		custom_status.emoji = &emoji;
 		
 		googlechat_api_set_custom_status(ha, &custom_status_request, NULL, NULL);
-		
-		googlechat_request_header_free(custom_status_request.request_header);
 	}
 }
 
@@ -2488,8 +2805,6 @@ googlechat_roomlist_get_list(PurpleConnection *pc)
 		request.fetch_snippets_for_unnamed_rooms = TRUE;
 		
 		googlechat_api_paginated_world(ha, &request, googlechat_roomlist_got_list, roomlist);
-		
-		googlechat_request_header_free(request.request_header);
 	}
 	
 	
@@ -2516,7 +2831,5 @@ googlechat_rename_conversation(GoogleChatAccount *ha, const gchar *conv_id, cons
 	request.update_masks = &update_mask;
 	
 	googlechat_api_update_group(ha, &request, NULL, NULL);
-	
-	googlechat_request_header_free(request.request_header);
 }
 
@@ -25,8 +25,16 @@
 
 #include "googlechat.pb-c.h"
 
+/**
+ * Sets up the account's RequestHeader template, and encodes the parts of it that never change.
+ */
+void googlechat_request_header_init(GoogleChatAccount *ha);
+
+/**
+ * Gets the account's RequestHeader with a fresh trace_id.  It's shared by every request,
+ * so it's never freed; googlechat_api_request() splices in its pre-encoded form.
+ */
 RequestHeader *googlechat_get_request_header(GoogleChatAccount *ha);
-void googlechat_request_header_free(RequestHeader *header);
 
 GList *googlechat_chat_info(PurpleConnection *pc);
 GHashTable *googlechat_chat_info_defaults(PurpleConnection *pc, const char *chatname);
@@ -63,7 +71,17 @@ guint googlechat_conv_send_typing(PurpleConversation *conv, PurpleIMTypingState
 
 
 void googlechat_get_users_presence(GoogleChatAccount *ha, GList *user_ids);
+// Passes a user's status on to libpurple, unless it's what was passed on last time.  message may be NULL.
+void googlechat_got_user_status(GoogleChatAccount *ha, const gchar *user_id, const gchar *status_id, const gchar *message);
+// Notes that a user's presence is up to date, so that googlechat_poll_buddy_status() leaves them be for a while
+void googlechat_presence_refreshed(GoogleChatAccount *ha, const gchar *user_id);
 void googlechat_get_users_information(GoogleChatAccount *ha, GList *user_ids);
+
+// Called once for each member the server returns, and then destroy(user_data) once all the users have been answered
+typedef void (*GoogleChatMemberFunc)(GoogleChatAccount *ha, Member *member, gpointer user_data);
+void googlechat_lookup_members(GoogleChatAccount *ha, GList *user_ids, GoogleChatMemberFunc callback, gpointer user_data, GDestroyNotify destroy);
+void googlechat_member_lookups_init(GoogleChatAccount *ha);
+void googlechat_member_lookups_free(GoogleChatAccount *ha);
 void googlechat_get_info(PurpleConnection *pc, const gchar *who);
 gboolean googlechat_poll_buddy_status(gpointer ha_pointer);
 
@@ -20,6 +20,9 @@
 
 #include <string.h>
 #include <glib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "core.h"
 #include "debug.h"
@@ -29,6 +32,7 @@
 #include "mediamanager.h"
 
 #include "googlechat_conversation.h"
+#include "googlechat_connection.h"
 #include "googlechat.pb-c.h"
 
 // From googlechat_pblite
@@ -42,27 +46,79 @@ void googlechat_received_message_event(PurpleConnection *pc, Event *event);
 void googlechat_received_read_receipt(PurpleConnection *pc, Event *event);
 void googlechat_received_group_viewed(PurpleConnection *pc, Event *event);
 
-//purple_signal_emit(purple_connection_get_protocol(ha->pc), "googlechat-received-event", ha->pc, events_response.event);
+typedef void (*GoogleChatEventHandler)(PurpleConnection *pc, Event *event);
 
-void
-googlechat_register_events(gpointer plugin)
+// Which handler gets each type of event.  Anything not listed goes to googlechat_received_other_notification()
+static const GoogleChatEventHandler googlechat_event_handlers[] = {
+	[EVENT__EVENT_TYPE__GROUP_VIEWED] = googlechat_received_group_viewed,
+	[EVENT__EVENT_TYPE__MESSAGE_POSTED] = googlechat_received_message_event,
+	[EVENT__EVENT_TYPE__USER_STATUS_UPDATED_EVENT] = googlechat_received_presence_notification,
+	[EVENT__EVENT_TYPE__TYPING_STATE_CHANGED] = googlechat_received_typing_notification,
+	[EVENT__EVENT_TYPE__READ_RECEIPT_CHANGED] = googlechat_received_read_receipt,
+};
+
+static void
+googlechat_dispatch_event(GoogleChatAccount *ha, Event *event)
+{
+	GoogleChatEventHandler handler = NULL;
+	
+	if ((guint) event->type < G_N_ELEMENTS(googlechat_event_handlers)) {
+		handler = googlechat_event_handlers[event->type];
+	}
+	if (handler == NULL) {
+		handler = googlechat_received_other_notification;
+	}
+	
+	handler(ha->pc, event);
+}
+
+// Cached get_group/list_members/get_user_status answers are stale once the server says something changed
+static void
+googlechat_invalidate_api_cache_for_event(GoogleChatAccount *ha, Event__EventType type)
 {
-	purple_signal_connect(plugin, "googlechat-received-event", plugin, PURPLE_CALLBACK(googlechat_received_typing_notification), NULL);
-	purple_signal_connect(plugin, "googlechat-received-event", plugin, PURPLE_CALLBACK(googlechat_received_presence_notification), NULL);
-	purple_signal_connect(plugin, "googlechat-received-event", plugin, PURPLE_CALLBACK(googlechat_received_message_event), NULL);
-	purple_signal_connect(plugin, "googlechat-received-event", plugin, PURPLE_CALLBACK(googlechat_received_other_notification), NULL);
-	purple_signal_connect(plugin, "googlechat-received-event", plugin, PURPLE_CALLBACK(googlechat_received_read_receipt), NULL);
-	purple_signal_connect(plugin, "googlechat-received-event", plugin, PURPLE_CALLBACK(googlechat_received_group_viewed), NULL);
+	switch (type) {
+		case EVENT__EVENT_TYPE__USER_ADDED_TO_GROUP:
+		case EVENT__EVENT_TYPE__USER_REMOVED_FROM_GROUP:
+		case EVENT__EVENT_TYPE__GROUP_UPDATED:
+		case EVENT__EVENT_TYPE__MEMBERSHIP_CHANGED:
+		case EVENT__EVENT_TYPE__GROUP_DELETED:
+		case EVENT__EVENT_TYPE__INVALIDATE_GROUP_CACHE:
+			googlechat_api_cache_invalidate(ha, "/api/get_group?rt=b");
+			googlechat_api_cache_invalidate(ha, "/api/list_members?rt=b");
+			break;
+		case EVENT__EVENT_TYPE__INVALIDATE_USER_CACHE:
+		case EVENT__EVENT_TYPE__USER_STATUS_UPDATED_EVENT:
+			googlechat_api_cache_invalidate(ha, "/api/get_user_status?rt=b");
+			break;
+		default:
+			break;
+	}
+}
+
+static gboolean
+googlechat_save_last_event_timestamp_cb(gpointer data)
+{
+	GoogleChatAccount *ha = data;
+	time_t now = time(NULL);
+	
+	// Hold off while events are still coming in, unless that would leave it unsaved for too long
+	if (now - ha->last_event_timestamp_changed < GOOGLECHAT_EVENT_TIMESTAMP_SAVE_DELAY &&
+	    now - ha->last_event_timestamp_unsaved + GOOGLECHAT_EVENT_TIMESTAMP_SAVE_DELAY <= GOOGLECHAT_EVENT_TIMESTAMP_SAVE_MAX_AGE) {
+		return TRUE;
+	}
+	
+	ha->last_event_timestamp_save_timeout = 0;
+	googlechat_save_last_event_timestamp(ha);
+	
+	return FALSE;
 }
 
 void
 googlechat_process_received_event(GoogleChatAccount *ha, Event *event)
 {
-	// Can't just use this ;(
-	//purple_signal_emit(purple_connection_get_protocol(ha->pc), "googlechat-received-event", ha->pc, event);
-	
 	size_t n_bodies = 0;
 	Event__EventBody **bodies = NULL;
+	guint i;
 	
 	//An event can have multiple events within it.  Mangle the structs to split multiples out into singles
 	if (event->n_bodies) {
@@ -73,14 +129,22 @@ googlechat_process_received_event(GoogleChatAccount *ha, Event *event)
 		event->bodies = NULL;
 	}
 	
+	if (event->has_type) {
+		googlechat_invalidate_api_cache_for_event(ha, event->type);
+	}
+	for (i = 0; i < n_bodies; i++) {
+		if (bodies[i]->has_event_type) {
+			googlechat_invalidate_api_cache_for_event(ha, bodies[i]->event_type);
+		}
+	}
+	
 	// Send an initial 'bare' event, if there is one
 	if (event->body) {
-		purple_signal_emit(purple_connection_get_protocol(ha->pc), "googlechat-received-event", ha->pc, event);
+		googlechat_dispatch_event(ha, event);
 	}
 	
 	if (n_bodies > 0) {
 		Event__EventBody *orig_body = event->body;
-		guint i;
 		
 		// loop through all the sub-bodies and make them a primary
 		for (i = 0; i < n_bodies; i++) {
@@ -91,7 +155,7 @@ googlechat_process_received_event(GoogleChatAccount *ha, Event *event)
 			event->has_type = TRUE;
 			event->type = body->event_type;
 			
-			purple_signal_emit(purple_connection_get_protocol(ha->pc), "googlechat-received-event", ha->pc, event);
+			googlechat_dispatch_event(ha, event);
 		}
 		
 		// put everything back the way it was to let memory be free'd
@@ -108,11 +172,63 @@ googlechat_process_received_event(GoogleChatAccount *ha, Event *event)
 		event_time = event->group_revision->timestamp;
 	}
 	
-	if (event_time && event_time > ha->last_event_timestamp) {
-		// libpurple can't store a 64bit int on a 32bit machine, so convert to something more usable instead (puke)
-		//  also needs to work cross platform, in case the accounts.xml is being shared (double puke)
-		purple_account_set_int(ha->account, "last_event_timestamp_high", event_time >> 32);
-		purple_account_set_int(ha->account, "last_event_timestamp_low", event_time & 0xFFFFFFFF);
+	if (event_time && event_time > ha->last_event_timestamp_received) {
+		ha->last_event_timestamp_received = event_time;
+		ha->last_event_timestamp_changed = time(NULL);
+		if (ha->last_event_timestamp_unsaved == 0) {
+			ha->last_event_timestamp_unsaved = ha->last_event_timestamp_changed;
+		}
+		
+		if (ha->last_event_timestamp_save_timeout == 0) {
+			ha->last_event_timestamp_save_timeout = g_timeout_add_seconds(GOOGLECHAT_EVENT_TIMESTAMP_SAVE_DELAY, googlechat_save_last_event_timestamp_cb, ha);
+		}
+	}
+}
+
+gint64
+googlechat_load_last_event_timestamp(GoogleChatAccount *ha)
+{
+	const gchar *saved = purple_account_get_string(ha->account, "last_event_timestamp", NULL);
+	guint64 last_event_timestamp;
+	
+	if (saved != NULL && *saved) {
+		return g_ascii_strtoll(saved, NULL, 10);
+	}
+	
+	// Older versions split it over two ints, as libpurple can't store a 64bit int on a 32bit machine
+	last_event_timestamp = purple_account_get_int(ha->account, "last_event_timestamp_high", 0);
+	if (last_event_timestamp != 0) {
+		last_event_timestamp = (last_event_timestamp << 32) | ((guint64) purple_account_get_int(ha->account, "last_event_timestamp_low", 0) & 0xFFFFFFFF);
+	}
+	
+	return last_event_timestamp;
+}
+
+void
+googlechat_save_last_event_timestamp(GoogleChatAccount *ha)
+{
+	gchar *saved;
+	
+	if (ha->last_event_timestamp_save_timeout) {
+		g_source_remove(ha->last_event_timestamp_save_timeout);
+		ha->last_event_timestamp_save_timeout = 0;
+	}
+	
+	if (ha->last_event_timestamp_unsaved == 0) {
+		return;
+	}
+	ha->last_event_timestamp_unsaved = 0;
+	
+	// Stored as a string, so that it survives a 32bit machine and an accounts.xml shared between platforms
+	saved = g_strdup_printf("%" G_GINT64_FORMAT, ha->last_event_timestamp_received);
+	purple_account_set_string(ha->account, "last_event_timestamp", saved);
+	g_free(saved);
+	
+	// The string supersedes the two ints older versions saved, so don't leave them lying around
+	if (purple_account_get_int(ha->account, "last_event_timestamp_high", 0) != 0 ||
+	    purple_account_get_int(ha->account, "last_event_timestamp_low", 0) != 0) {
+		purple_account_remove_setting(ha->account, "last_event_timestamp_high");
+		purple_account_remove_setting(ha->account, "last_event_timestamp_low");
 	}
 }
 
@@ -145,8 +261,6 @@ googlechat_remove_conversation(GoogleChatAccount *ha, const gchar *conv_id)
 void
 googlechat_received_other_notification(PurpleConnection *pc, Event *event)
 {
-	gchar *json_dump;
-
 	if (event->type == EVENT__EVENT_TYPE__MESSAGE_POSTED ||
 		event->type == EVENT__EVENT_TYPE__TYPING_STATE_CHANGED ||
 		event->type == EVENT__EVENT_TYPE__GROUP_VIEWED ||
@@ -157,10 +271,7 @@ googlechat_received_other_notification(PurpleConnection *pc, Event *event)
 	}
 	
 	purple_debug_info("googlechat", "Received new other event %p\n", event);
-	json_dump = pblite_dump_json((ProtobufCMessage *)event);
-	purple_debug_info("googlechat", "%s\n", json_dump);
-
-	g_free(json_dump);
+	googlechat_debug_dump_message(PURPLE_DEBUG_INFO, NULL, (ProtobufCMessage *) event);
 }
 
 void 
@@ -185,11 +296,14 @@ googlechat_received_presence_notification(PurpleConnection *pc, Event *event)
 	const gchar *status_id = NULL;
 	gboolean reachable = FALSE;
 	gboolean available = FALSE;
-	gchar *message = NULL;
+	const gchar *message = NULL;
 	UserStatus *user_status = user_status_updated_event->user_status;
 	const gchar *user_id = user_status->user_id->id;
 	PurpleBuddy *buddy = purple_blist_find_buddy(ha->account, user_id);
 	
+	ha->presence_pushes++;
+	googlechat_presence_refreshed(ha, user_id);
+	
 	if (buddy != NULL) {
 		status_id = purple_status_get_id(purple_presence_get_active_status(purple_buddy_get_presence(buddy)));
 	}
@@ -223,29 +337,24 @@ googlechat_received_presence_notification(PurpleConnection *pc, Event *event)
 		const gchar *status_text = user_status->custom_status->status_text;
 		
 		if (status_text && *status_text) {
-			message = g_strdup(status_text);
+			message = status_text;
 		}
 	}
 	
-	if (message != NULL) {
-		purple_protocol_got_user_status(ha->account, user_id, status_id, "message", message, NULL);
-	} else {
-		purple_protocol_got_user_status(ha->account, user_id, status_id, NULL);
-	}
-	
-	g_free(message);
+	googlechat_got_user_status(ha, user_id, status_id, message);
 }
 
 static void
 googlechat_got_http_image_for_conv(PurpleHttpConnection *connection, PurpleHttpResponse *response, gpointer user_data)
 {
-	GoogleChatAccount *ha = user_data;
-	const gchar *url;
-	const gchar *drive_url;
-	const gchar *sender_id;
-	const gchar *conv_id;
-	PurpleMessageFlags msg_flags;
-	time_t message_timestamp;
+	GoogleChatRequestContext *context = user_data;
+	GoogleChatAccount *ha = context->ha;
+	const gchar *url = context->url;
+	const gchar *drive_url = context->drive_url;
+	const gchar *sender_id = context->sender_id;
+	const gchar *conv_id = context->conv_id;
+	PurpleMessageFlags msg_flags = context->msg_flags;
+	time_t message_timestamp = context->message_timestamp;
 	PurpleImage *image;
 	const gchar *response_data;
 	size_t response_size;
@@ -254,17 +363,10 @@ googlechat_got_http_image_for_conv(PurpleHttpConnection *connection, PurpleHttpR
 	gchar *escaped_image_url;
 	
 	if (purple_http_response_get_error(response) != NULL) {
-		g_dataset_destroy(connection);
+		googlechat_request_context_free(context);
 		return;
 	}
 	
-	url = g_dataset_get_data(connection, "url");
-	drive_url = g_dataset_get_data(connection, "drive_url");
-	sender_id = g_dataset_get_data(connection, "sender_id");
-	conv_id = g_dataset_get_data(connection, "conv_id");
-	msg_flags = GPOINTER_TO_INT(g_dataset_get_data(connection, "msg_flags"));
-	message_timestamp = GPOINTER_TO_INT(g_dataset_get_data(connection, "message_timestamp"));
-	
 	response_data = purple_http_response_get_data(response, &response_size);
 	image = purple_image_new_from_data(g_memdup(response_data, response_size), response_size);
 	image_id = purple_image_store_add(image);
@@ -297,7 +399,7 @@ googlechat_got_http_image_for_conv(PurpleHttpConnection *connection, PurpleHttpR
 	
 	g_free(escaped_image_url);
 	g_free(msg);
-	g_dataset_destroy(connection);
+	googlechat_request_context_free(context);
 }
 
 static const gchar *
@@ -326,6 +428,241 @@ googlechat_format_type_to_string(FormatMetadata__FormatType format_type, gboolea
 	return output;
 }
 
+/**
+ * Returns a pointer to the first byte that might need escaping, or end.
+ * That's anything markup-ish, ASCII control characters, and 0xC2, which leads the C1 control characters.
+ */
+static inline const gchar *
+googlechat_markup_find_special(const gchar *pos, const gchar *end)
+{
+#ifdef __SSE2__
+	const __m128i amp = _mm_set1_epi8('&');
+	const __m128i lt = _mm_set1_epi8('<');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i quot = _mm_set1_epi8('"');
+	const __m128i del = _mm_set1_epi8(0x7f);
+	const __m128i c1_lead = _mm_set1_epi8((gchar) 0xc2);
+	const __m128i max_control = _mm_set1_epi8(0x1f);
+	
+	while (end - pos >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *) pos);
+		__m128i hits = _mm_or_si128(
+			_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, amp), _mm_cmpeq_epi8(chunk, lt)),
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, gt), _mm_cmpeq_epi8(chunk, quot))),
+			_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, del), _mm_cmpeq_epi8(chunk, c1_lead)),
+				_mm_cmpeq_epi8(_mm_max_epu8(chunk, max_control), max_control)));
+		int mask = _mm_movemask_epi8(hits);
+		
+		if (mask) {
+			return pos + __builtin_ctz(mask);
+		}
+		pos += 16;
+	}
+#endif
+	
+	while (pos < end) {
+		guchar c = *pos;
+		
+		if (c == '&' || c == '<' || c == '>' || c == '"' || c <= 0x1f || c == 0x7f || c == 0xc2) {
+			break;
+		}
+		pos++;
+	}
+	
+	return pos;
+}
+
+/* Same escaping as purple_markup_escape_text(), but copying the plain stretches in one go */
+static void
+googlechat_markup_escape_append(GString *out, const gchar *text, const gchar *end)
+{
+	while (text < end) {
+		const gchar *special = googlechat_markup_find_special(text, end);
+		guchar c;
+		
+		g_string_append_len(out, text, special - text);
+		if (special == end) {
+			break;
+		}
+		
+		text = special + 1;
+		c = *special;
+		switch (c) {
+			case '&':
+				g_string_append(out, "&amp;");
+				break;
+			case '<':
+				g_string_append(out, "&lt;");
+				break;
+			case '>':
+				g_string_append(out, "&gt;");
+				break;
+			case '"':
+				g_string_append(out, "&quot;");
+				break;
+			case '\t':
+			case '\n':
+			case '\r':
+				g_string_append_c(out, c);
+				break;
+			case 0xc2:
+				// U+0080 to U+009F, other than NEL
+				if (text < end && (guchar) *text >= 0x80 && (guchar) *text <= 0x9f && (guchar) *text != 0x85) {
+					g_string_append_printf(out, "&#x%x;", (guchar) *text);
+					text++;
+				} else {
+					g_string_append_c(out, c);
+				}
+				break;
+			default:
+				g_string_append_printf(out, "&#x%x;", c);
+				break;
+		}
+	}
+}
+
+typedef struct {
+	gint32 pos;
+	gint32 start;
+	gint32 end;
+	gboolean close;
+	guint index;                 // Position in the message's annotations, to keep the order stable
+	Annotation *annotation;
+} GoogleChatFormatEdge;
+
+static gint
+googlechat_format_edge_compare(gconstpointer a, gconstpointer b)
+{
+	const GoogleChatFormatEdge *edge_a = a;
+	const GoogleChatFormatEdge *edge_b = b;
+	
+	if (edge_a->pos != edge_b->pos) {
+		return edge_a->pos < edge_b->pos ? -1 : 1;
+	}
+	if (edge_a->close != edge_b->close) {
+		return edge_a->close ? -1 : 1;
+	}
+	
+	if (edge_a->close) {
+		// Innermost first
+		if (edge_a->start != edge_b->start) {
+			return edge_a->start > edge_b->start ? -1 : 1;
+		}
+		return (edge_a->index < edge_b->index) - (edge_a->index > edge_b->index);
+	}
+	
+	// Outermost first
+	if (edge_a->end != edge_b->end) {
+		return edge_a->end > edge_b->end ? -1 : 1;
+	}
+	return (edge_a->index > edge_b->index) - (edge_a->index < edge_b->index);
+}
+
+static void
+googlechat_format_edge_append(GString *out, const GoogleChatFormatEdge *edge, gint *hidden_output)
+{
+	Annotation *annotation = edge->annotation;
+	FormatMetadata__FormatType format_type = annotation->format_metadata ? annotation->format_metadata->format_type : 0;
+	
+	if (format_type == FORMAT_METADATA__FORMAT_TYPE__HIDDEN) {
+		*hidden_output += edge->close ? -1 : 1;
+		
+	} else if (annotation->type == ANNOTATION_TYPE__URL) {
+		UrlMetadata *url_metadata = annotation->url_metadata;
+		if (url_metadata && url_metadata->url && url_metadata->url->url) {
+			if (edge->close) {
+				g_string_append(out, "</A>");
+			} else {
+				gchar *escaped = g_markup_escape_text(url_metadata->url->url, -1);
+				g_string_append_printf(out, "<A HREF=\"%s\">", escaped);
+				g_free(escaped);
+			}
+		}
+		
+	} else {
+		g_string_append(out, googlechat_format_type_to_string(format_type, edge->close));
+	}
+}
+
+/**
+ * Escapes a message's text, adding markup for its formatting and link annotations.
+ * Annotation indexes are in characters.  Every start and end is sorted once, and the
+ * text between them is copied across a stretch at a time.
+ */
+static gchar *
+googlechat_render_message_text(const gchar *text, Annotation **annotations, guint n_annotations)
+{
+	GArray *edges;
+	GString *out;
+	const gchar *current_char;
+	gint32 text_len, pos;
+	gint hidden_output = 0;
+	guint i;
+	
+	if (text == NULL) {
+		return NULL;
+	}
+	
+	out = g_string_sized_new(strlen(text) + 16);
+	edges = g_array_new(FALSE, FALSE, sizeof(GoogleChatFormatEdge));
+	text_len = g_utf8_strlen(text, -1);
+	
+	for (i = 0; i < n_annotations; i++) {
+		Annotation *annotation = annotations[i];
+		GoogleChatFormatEdge edge;
+		
+		if (annotation->type != ANNOTATION_TYPE__FORMAT_DATA && annotation->type != ANNOTATION_TYPE__URL) {
+			continue;
+		}
+		
+		edge.start = CLAMP(annotation->start_index, 0, text_len);
+		edge.end = CLAMP((gint64) annotation->start_index + MAX(annotation->length, 0), edge.start, text_len);
+		if (edge.start == edge.end) {
+			// Nothing to format, and its closing tag would sort before its opening one
+			continue;
+		}
+		edge.index = i;
+		edge.annotation = annotation;
+		
+		edge.pos = edge.start;
+		edge.close = FALSE;
+		g_array_append_val(edges, edge);
+		
+		edge.pos = edge.end;
+		edge.close = TRUE;
+		g_array_append_val(edges, edge);
+	}
+	
+	g_array_sort(edges, googlechat_format_edge_compare);
+	
+	current_char = text;
+	pos = 0;
+	for (i = 0; i <= edges->len; i++) {
+		const GoogleChatFormatEdge *edge = i < edges->len ? &g_array_index(edges, GoogleChatFormatEdge, i) : NULL;
+		gint32 next_pos = edge ? edge->pos : text_len;
+		
+		if (next_pos > pos) {
+			const gchar *next_char = g_utf8_offset_to_pointer(current_char, next_pos - pos);
+			
+			if (hidden_output == 0) {
+				googlechat_markup_escape_append(out, current_char, next_char);
+			}
+			current_char = next_char;
+			pos = next_pos;
+		}
+		
+		if (edge != NULL) {
+			googlechat_format_edge_append(out, edge, &hidden_output);
+		}
+	}
+	
+	g_array_free(edges, TRUE);
+	
+	return g_string_free(out, FALSE);
+}
+
 void
 googlechat_received_message_event(PurpleConnection *pc, Event *event)
 {
@@ -367,109 +704,7 @@ googlechat_received_message_event(PurpleConnection *pc, Event *event)
 	}
 	PurpleConversation *pconv = NULL;
 	
-	//TODO process Annotations to add formatting
-	gchar *msg = NULL;
-	GList *format_annotations = NULL;
-	for (i = 0; i < message->n_annotations; i++) {
-		Annotation *annotation = message->annotations[i];
-		if (annotation->type == ANNOTATION_TYPE__FORMAT_DATA || annotation->type == ANNOTATION_TYPE__URL) {
-			format_annotations = g_list_prepend(format_annotations, annotation);
-		}
-	}
-	
-	if (format_annotations == NULL) {
-		//shortcut
-		msg = purple_markup_escape_text(message->text_body, -1);
-		
-	} else {
-		GString *msg_out = g_string_new(NULL);
-		const gchar *current_char = message->text_body;
-		gunichar c;
-		gint32 pos = 0;
-		GList *format;
-		gint hidden_output = 0;
-		
-		do {
-			if (format_annotations != NULL) {
-				format = format_annotations;
-				while(format != NULL) {
-					GList *next_format = format->next;
-					Annotation *annotation = format->data;
-					FormatMetadata__FormatType format_type = annotation->format_metadata ? annotation->format_metadata->format_type : 0;
-					
-					// Opening
-					if (annotation->start_index == pos) {
-						if (format_type == FORMAT_METADATA__FORMAT_TYPE__HIDDEN) {
-							hidden_output++;
-							
-						} else if (annotation->type == ANNOTATION_TYPE__URL) {
-							UrlMetadata *url_metadata = annotation->url_metadata;
-							if (url_metadata && url_metadata->url && url_metadata->url->url) {
-								gchar *escaped = g_markup_escape_text(url_metadata->url->url, -1);
-								g_string_append_printf(msg_out, "<A HREF=\"%s\">", escaped);
-								g_free(escaped);
-							}
-							
-						} else {
-							g_string_append(msg_out, googlechat_format_type_to_string(format_type, FALSE));
-						}
-					
-					// Closing
-					} else if (annotation->length + annotation->start_index == pos) {
-						if (format_type == FORMAT_METADATA__FORMAT_TYPE__HIDDEN) {
-							hidden_output--;
-						} else if (annotation->type == ANNOTATION_TYPE__URL) {
-							g_string_append(msg_out, "</A>");
-						} else {
-							g_string_append(msg_out, googlechat_format_type_to_string(format_type, TRUE));
-						}
-						
-						format_annotations = g_list_delete_link(format_annotations, format);
-					}
-					
-					format = next_format;
-				}
-			}
-			
-			if (hidden_output == 0) {
-				// from libpurple/util.c
-				switch (*current_char)
-				{
-					case '&':
-						g_string_append(msg_out, "&amp;");
-						break;
-
-					case '<':
-						g_string_append(msg_out, "&lt;");
-						break;
-
-					case '>':
-						g_string_append(msg_out, "&gt;");
-						break;
-
-					case '"':
-						g_string_append(msg_out, "&quot;");
-						break;
-
-					default:
-						c = g_utf8_get_char(current_char);
-						if ((0x1 <= c && c <= 0x8) ||
-								(0xb <= c && c <= 0xc) ||
-								(0xe <= c && c <= 0x1f) ||
-								(0x7f <= c && c <= 0x84) ||
-								(0x86 <= c && c <= 0x9f))
-							g_string_append_printf(msg_out, "&#x%x;", c);
-						else
-							g_string_append_unichar(msg_out, c);
-						break;
-				}
-			}
-			pos++;
-			
-		} while ((current_char = g_utf8_next_char(current_char)) && *current_char);
-		
-		msg = g_string_free(msg_out, FALSE);
-	}
+	gchar *msg = googlechat_render_message_text(message->text_body, message->annotations, message->n_annotations);
 	
 	if (!is_dm) {
 		PurpleChatConversation *chatconv = purple_conversations_find_chat_with_account(conv_id, ha->account);
@@ -567,7 +802,7 @@ googlechat_received_message_event(PurpleConnection *pc, Event *event)
 			
 			GString *image_url_str = g_string_new(NULL);
 			
-			g_string_append(image_url_str, "https://chat.google.com/api/get_attachment_url" "?");
+			g_string_append_printf(image_url_str, "%s/api/get_attachment_url?", ha->server_url);
 			//could also be THUMBNAIL_URL
 			// or DOWNLOAD_URL for a file
 			g_string_append(image_url_str, "url_type=FIFE_URL&");
@@ -621,8 +856,6 @@ googlechat_received_message_event(PurpleConnection *pc, Event *event)
 		}
 		
 		if (image_url != NULL) {
-			PurpleHttpConnection *connection;
-			
 			if (g_strcmp0(purple_core_get_ui(), "BitlBee") == 0) {
 				// Bitlbee doesn't support images, so just plop a url to the image instead
 				if (g_hash_table_contains(ha->group_chats, conv_id)) {
@@ -638,18 +871,19 @@ googlechat_received_message_event(PurpleConnection *pc, Event *event)
 				}
 			} else {
 				PurpleHttpRequest *request = purple_http_request_new(image_url);
+				GoogleChatRequestContext *context = googlechat_request_context_new(ha);
 				
 				purple_http_request_header_set_printf(request, "Authorization", "Bearer %s", ha->access_token);
 				purple_http_request_set_max_len(request, -1);
 				
-				connection = purple_http_request(ha->pc, request, googlechat_got_http_image_for_conv, ha);
+				context->url = g_strdup(url);
+				context->drive_url = g_strdup(drive_url);
+				context->sender_id = g_strdup(sender_id);
+				context->conv_id = g_strdup(conv_id);
+				context->msg_flags = msg_flags;
+				context->message_timestamp = message_timestamp;
 				
-				g_dataset_set_data_full(connection, "url", g_strdup(url), g_free);
-				g_dataset_set_data_full(connection, "drive_url", g_strdup(drive_url), g_free);
-				g_dataset_set_data_full(connection, "sender_id", g_strdup(sender_id), g_free);
-				g_dataset_set_data_full(connection, "conv_id", g_strdup(conv_id), g_free);
-				g_dataset_set_data(connection, "msg_flags", GINT_TO_POINTER(msg_flags));
-				g_dataset_set_data(connection, "message_timestamp", GINT_TO_POINTER(message_timestamp));
+				purple_http_request(ha->pc, request, googlechat_got_http_image_for_conv, context);
 				
 				purple_http_request_unref(request);
 			}
@@ -23,8 +23,19 @@
 #include "libgooglechat.h"
 #include "googlechat.pb-c.h"
 
-void googlechat_register_events(gpointer plugin);
 void googlechat_process_presence_result(GoogleChatAccount *ha, UserPresence *presence);
 void googlechat_process_received_event(GoogleChatAccount *ha, Event *event);
 
+/**
+ * Restores the timestamp of the newest event we've seen, as saved by googlechat_save_last_event_timestamp()
+ * \return The timestamp in microseconds, or 0 if there isn't one
+ */
+gint64 googlechat_load_last_event_timestamp(GoogleChatAccount *ha);
+
+/**
+ * Writes out the timestamp of the newest event we've seen, if it's changed since it was last saved.
+ * This normally happens on a timer, so that a burst of events only touches the account settings once.
+ */
+void googlechat_save_last_event_timestamp(GoogleChatAccount *ha);
+
 #endif /*_GOOGLECHAT_EVENTS_H_*/
\ No newline at end of file
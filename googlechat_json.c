@@ -18,6 +18,8 @@
 
 #include "googlechat_json.h"
 
+#include <string.h>
+
 #include <debug.h>
 
 gchar *
@@ -210,15 +212,46 @@ googlechat_json_path_query_int(JsonNode *root, const gchar *expr, GError **error
 	return ret;
 }
 
-gchar *
-googlechat_json_tidy_blank_arrays(const gchar *json)
+void
+googlechat_json_append_string(GString *out, const gchar *str, gssize len)
 {
-	static GRegex *tidy_regex = NULL;
+	const gchar *pos, *end, *run;
 	
-	if (tidy_regex == NULL) {
-		tidy_regex = g_regex_new("\"(\\\\\"|.)*?\"(*SKIP)(*FAIL)|\\[\\](*SKIP)(*FAIL)|(?<=,|\\[)\\s*(?=,|\\])", G_REGEX_OPTIMIZE, 0, NULL);
+	g_return_if_fail(out);
+	
+	g_string_append_c(out, '"');
+	if (str == NULL) {
+		g_string_append_c(out, '"');
+		return;
+	}
+	if (len < 0) {
+		len = strlen(str);
 	}
 	
-	return g_regex_replace_literal(tidy_regex, json, -1, 0, "null", 0, NULL);
+	// Copy runs of characters that don't need escaping in one go
+	for (pos = run = str, end = str + len; pos < end; pos++) {
+		guchar c = *pos;
+		
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			continue;
+		}
+		
+		g_string_append_len(out, run, pos - run);
+		run = pos + 1;
+		
+		switch (c) {
+			case '"':  g_string_append(out, "\\\""); break;
+			case '\\': g_string_append(out, "\\\\"); break;
+			case '\b': g_string_append(out, "\\b"); break;
+			case '\f': g_string_append(out, "\\f"); break;
+			case '\n': g_string_append(out, "\\n"); break;
+			case '\r': g_string_append(out, "\\r"); break;
+			case '\t': g_string_append(out, "\\t"); break;
+			default:
+				g_string_append_printf(out, "\\u%04x", c);
+				break;
+		}
+	}
+	g_string_append_len(out, run, pos - run);
+	g_string_append_c(out, '"');
 }
-
@@ -93,15 +93,15 @@ gint64 googlechat_json_path_query_int(JsonNode *root, const gchar *expr, GError
 
 
 /**
- * Tidies invalid JSON from Google into slightly-more-valid JSON, 
- * so that it can be parsed by json-glib
- * e.g. turns [,,,,,] into [null,null,null,null,null]
+ * Appends a string to out as a quoted, escaped JSON string.
  *
- * \param json
- *      The JSON-encoded string to clean up.
- * \return
- *      The JSON-encoded string that has been tidied or NULL if there was an error.  You are required to g_free() this when you are done.
+ * \param out
+ *      The string to append to.
+ * \param str
+ *      The UTF-8 string to encode.  NULL is written as an empty string.
+ * \param len
+ *      The length of str, or -1 if it is NUL-terminated.
  */
-gchar *googlechat_json_tidy_blank_arrays(const gchar *json);
+void googlechat_json_append_string(GString *out, const gchar *str, gssize len);
 
 #endif /* _GOOGLECHAT_JSON_H_ */
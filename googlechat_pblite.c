@@ -20,6 +20,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 static void *glib_protobufc_allocator_alloc(void *allocator_data, size_t size) { return g_try_malloc0(size); };
 static void glib_protobufc_allocator_free(void *allocator_data, void *pointer) { g_free(pointer); };
@@ -30,6 +31,367 @@ static ProtobufCAllocator glib_protobufc_allocator = {
 	.allocator_data = NULL,
 };
 
+
+/*
+ * Bump-pointer arena for unpacking messages that only live as long as a callback.
+ * Individual frees are no-ops; everything is thrown away at once when the
+ * last user releases the arena.
+ */
+
+#define GOOGLECHAT_ARENA_ALIGN 16
+#define GOOGLECHAT_ARENA_MAX_RETAINED (256 * 1024)
+
+typedef struct _GoogleChatArenaBlock {
+	struct _GoogleChatArenaBlock *next;
+	gsize size;
+	gsize used;
+	// data follows, suitably aligned
+} GoogleChatArenaBlock;
+
+#define GOOGLECHAT_ARENA_BLOCK_HEADER_SIZE \
+	((sizeof(GoogleChatArenaBlock) + GOOGLECHAT_ARENA_ALIGN - 1) & ~((gsize) GOOGLECHAT_ARENA_ALIGN - 1))
+
+struct _GoogleChatArena {
+	ProtobufCAllocator allocator;
+	GoogleChatArenaBlock *blocks; // Most recent first
+	gsize block_size;
+	gsize high_water;             // Most ever used between resets, to size the next first block
+	guint users;
+};
+
+static GoogleChatArenaBlock *
+googlechat_arena_block_new(gsize size, GoogleChatArenaBlock *next)
+{
+	GoogleChatArenaBlock *block = g_malloc(GOOGLECHAT_ARENA_BLOCK_HEADER_SIZE + size);
+	
+	block->next = next;
+	block->size = size;
+	block->used = 0;
+	
+	return block;
+}
+
+static void *
+googlechat_arena_alloc(void *allocator_data, size_t size)
+{
+	GoogleChatArena *arena = allocator_data;
+	GoogleChatArenaBlock *block = arena->blocks;
+	gsize aligned_size = (size + GOOGLECHAT_ARENA_ALIGN - 1) & ~((gsize) GOOGLECHAT_ARENA_ALIGN - 1);
+	void *ptr;
+	
+	if (block == NULL || block->size - block->used < aligned_size) {
+		block = googlechat_arena_block_new(MAX(arena->block_size, aligned_size), block);
+		arena->blocks = block;
+	}
+	
+	ptr = ((guint8 *) block) + GOOGLECHAT_ARENA_BLOCK_HEADER_SIZE + block->used;
+	block->used += aligned_size;
+	
+	return ptr;
+}
+
+static void
+googlechat_arena_free_pointer(void *allocator_data, void *pointer)
+{
+	// Freed all at once in googlechat_arena_reset()
+}
+
+GoogleChatArena *
+googlechat_arena_new(gsize block_size)
+{
+	GoogleChatArena *arena = g_new0(GoogleChatArena, 1);
+	
+	arena->allocator.alloc = googlechat_arena_alloc;
+	arena->allocator.free = googlechat_arena_free_pointer;
+	arena->allocator.allocator_data = arena;
+	arena->block_size = block_size;
+	
+	return arena;
+}
+
+void
+googlechat_arena_reset(GoogleChatArena *arena)
+{
+	GoogleChatArenaBlock *block, *next;
+	gsize used = 0;
+	
+	g_return_if_fail(arena);
+	
+	for (block = arena->blocks; block != NULL; block = block->next) {
+		used += block->used;
+	}
+	arena->high_water = MAX(arena->high_water, used);
+	
+	if (arena->blocks == NULL) {
+		return;
+	}
+	
+	if (arena->blocks->next == NULL && arena->blocks->size >= MIN(arena->high_water, GOOGLECHAT_ARENA_MAX_RETAINED)) {
+		// Just the one block, and it's big enough, so keep it around
+		arena->blocks->used = 0;
+		return;
+	}
+	
+	for (block = arena->blocks; block != NULL; block = next) {
+		next = block->next;
+		g_free(block);
+	}
+	
+	// Replace with one block big enough for next time, within reason
+	arena->blocks = googlechat_arena_block_new(MAX(arena->block_size, MIN(arena->high_water, GOOGLECHAT_ARENA_MAX_RETAINED)), NULL);
+}
+
+void
+googlechat_arena_free(GoogleChatArena *arena)
+{
+	GoogleChatArenaBlock *block, *next;
+	
+	if (arena == NULL) {
+		return;
+	}
+	
+	for (block = arena->blocks; block != NULL; block = next) {
+		next = block->next;
+		g_free(block);
+	}
+	g_free(arena);
+}
+
+ProtobufCAllocator *
+googlechat_arena_acquire(GoogleChatArena *arena)
+{
+	g_return_val_if_fail(arena, NULL);
+	
+	arena->users++;
+	return &arena->allocator;
+}
+
+void
+googlechat_arena_release(GoogleChatArena *arena)
+{
+	g_return_if_fail(arena);
+	g_return_if_fail(arena->users > 0);
+	
+	if (--arena->users == 0) {
+		googlechat_arena_reset(arena);
+	}
+}
+
+
+/*
+ * Base64 decoding into a reusable buffer
+ */
+
+// GCC only makes the AVX2 intrinsics usable from target("avx2") functions from 4.9 on
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#	define GOOGLECHAT_BASE64_SIMD 1
+#	include <immintrin.h>
+#endif
+
+// How far a vectorised decode may write past the end of its output
+#define GOOGLECHAT_BASE64_SLACK 32
+
+static const guint8 googlechat_base64_rank[256] = {
+	['A'] = 1, ['B'] = 2, ['C'] = 3, ['D'] = 4, ['E'] = 5, ['F'] = 6, ['G'] = 7, ['H'] = 8,
+	['I'] = 9, ['J'] = 10, ['K'] = 11, ['L'] = 12, ['M'] = 13, ['N'] = 14, ['O'] = 15, ['P'] = 16,
+	['Q'] = 17, ['R'] = 18, ['S'] = 19, ['T'] = 20, ['U'] = 21, ['V'] = 22, ['W'] = 23, ['X'] = 24,
+	['Y'] = 25, ['Z'] = 26, ['a'] = 27, ['b'] = 28, ['c'] = 29, ['d'] = 30, ['e'] = 31, ['f'] = 32,
+	['g'] = 33, ['h'] = 34, ['i'] = 35, ['j'] = 36, ['k'] = 37, ['l'] = 38, ['m'] = 39, ['n'] = 40,
+	['o'] = 41, ['p'] = 42, ['q'] = 43, ['r'] = 44, ['s'] = 45, ['t'] = 46, ['u'] = 47, ['v'] = 48,
+	['w'] = 49, ['x'] = 50, ['y'] = 51, ['z'] = 52, ['0'] = 53, ['1'] = 54, ['2'] = 55, ['3'] = 56,
+	['4'] = 57, ['5'] = 58, ['6'] = 59, ['7'] = 60, ['8'] = 61, ['9'] = 62, ['+'] = 63, ['/'] = 64,
+	// Stored as value + 1, so that 0 means "not base64"
+};
+
+/* Decodes whatever is left, skipping anything that isn't base64 and stopping at padding */
+static gsize
+googlechat_base64_decode_scalar(const gchar *text, gsize text_len, guint8 *out)
+{
+	guint8 *start = out;
+	guint32 bits = 0;
+	guint nbits = 0;
+	gsize i;
+	
+	for (i = 0; i < text_len; i++) {
+		guint8 rank = googlechat_base64_rank[(guint8) text[i]];
+		
+		if (rank == 0) {
+			if (text[i] == '=') {
+				break;
+			}
+			continue;
+		}
+		
+		bits = (bits << 6) | (rank - 1);
+		nbits += 6;
+		if (nbits >= 8) {
+			nbits -= 8;
+			*out++ = (guint8) (bits >> nbits);
+		}
+	}
+	
+	return out - start;
+}
+
+#ifdef GOOGLECHAT_BASE64_SIMD
+
+/*
+ * Map 16 (or 32) characters to their 6-bit values with range compares, then pack
+ * them four at a time into three bytes.  Any block containing something other than
+ * the base64 alphabet is left for the scalar decoder.
+ */
+
+__attribute__((target("ssse3")))
+static gsize
+googlechat_base64_decode_ssse3(const gchar *text, gsize text_len, guint8 *out, gsize *consumed)
+{
+	const __m128i upper_lo = _mm_set1_epi8('A' - 1), upper_hi = _mm_set1_epi8('Z' + 1);
+	const __m128i lower_lo = _mm_set1_epi8('a' - 1), lower_hi = _mm_set1_epi8('z' + 1);
+	const __m128i digit_lo = _mm_set1_epi8('0' - 1), digit_hi = _mm_set1_epi8('9' + 1);
+	const __m128i plus = _mm_set1_epi8('+'), slash = _mm_set1_epi8('/');
+	const __m128i pack_pairs = _mm_set1_epi32(0x01400140);
+	const __m128i pack_quads = _mm_set1_epi32(0x00011000);
+	const __m128i reorder = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	gsize in = 0, written = 0;
+	
+	while (text_len - in >= 16) {
+		__m128i chars = _mm_loadu_si128((const __m128i *) (text + in));
+		__m128i is_upper = _mm_and_si128(_mm_cmpgt_epi8(chars, upper_lo), _mm_cmplt_epi8(chars, upper_hi));
+		__m128i is_lower = _mm_and_si128(_mm_cmpgt_epi8(chars, lower_lo), _mm_cmplt_epi8(chars, lower_hi));
+		__m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(chars, digit_lo), _mm_cmplt_epi8(chars, digit_hi));
+		__m128i is_plus = _mm_cmpeq_epi8(chars, plus);
+		__m128i is_slash = _mm_cmpeq_epi8(chars, slash);
+		__m128i valid = _mm_or_si128(_mm_or_si128(is_upper, is_lower), _mm_or_si128(is_digit, _mm_or_si128(is_plus, is_slash)));
+		__m128i shift, values;
+		
+		if (_mm_movemask_epi8(valid) != 0xFFFF) {
+			break;
+		}
+		
+		shift = _mm_and_si128(is_upper, _mm_set1_epi8(-'A'));
+		shift = _mm_or_si128(shift, _mm_and_si128(is_lower, _mm_set1_epi8(26 - 'a')));
+		shift = _mm_or_si128(shift, _mm_and_si128(is_digit, _mm_set1_epi8(52 - '0')));
+		shift = _mm_or_si128(shift, _mm_and_si128(is_plus, _mm_set1_epi8(62 - '+')));
+		shift = _mm_or_si128(shift, _mm_and_si128(is_slash, _mm_set1_epi8(63 - '/')));
+		values = _mm_add_epi8(chars, shift);
+		
+		values = _mm_maddubs_epi16(values, pack_pairs);
+		values = _mm_madd_epi16(values, pack_quads);
+		values = _mm_shuffle_epi8(values, reorder);
+		_mm_storeu_si128((__m128i *) (out + written), values);
+		
+		in += 16;
+		written += 12;
+	}
+	
+	*consumed = in;
+	return written;
+}
+
+__attribute__((target("avx2")))
+static gsize
+googlechat_base64_decode_avx2(const gchar *text, gsize text_len, guint8 *out, gsize *consumed)
+{
+	const __m256i upper_lo = _mm256_set1_epi8('A' - 1), upper_hi = _mm256_set1_epi8('Z');
+	const __m256i lower_lo = _mm256_set1_epi8('a' - 1), lower_hi = _mm256_set1_epi8('z');
+	const __m256i digit_lo = _mm256_set1_epi8('0' - 1), digit_hi = _mm256_set1_epi8('9');
+	const __m256i plus = _mm256_set1_epi8('+'), slash = _mm256_set1_epi8('/');
+	const __m256i pack_pairs = _mm256_set1_epi32(0x01400140);
+	const __m256i pack_quads = _mm256_set1_epi32(0x00011000);
+	const __m256i reorder = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+	                                         2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+	gsize in = 0, written = 0;
+	
+	while (text_len - in >= 32) {
+		__m256i chars = _mm256_loadu_si256((const __m256i *) (text + in));
+		__m256i is_upper = _mm256_andnot_si256(_mm256_cmpgt_epi8(chars, upper_hi), _mm256_cmpgt_epi8(chars, upper_lo));
+		__m256i is_lower = _mm256_andnot_si256(_mm256_cmpgt_epi8(chars, lower_hi), _mm256_cmpgt_epi8(chars, lower_lo));
+		__m256i is_digit = _mm256_andnot_si256(_mm256_cmpgt_epi8(chars, digit_hi), _mm256_cmpgt_epi8(chars, digit_lo));
+		__m256i is_plus = _mm256_cmpeq_epi8(chars, plus);
+		__m256i is_slash = _mm256_cmpeq_epi8(chars, slash);
+		__m256i valid = _mm256_or_si256(_mm256_or_si256(is_upper, is_lower), _mm256_or_si256(is_digit, _mm256_or_si256(is_plus, is_slash)));
+		__m256i shift, values;
+		
+		if ((guint32) _mm256_movemask_epi8(valid) != 0xFFFFFFFF) {
+			break;
+		}
+		
+		shift = _mm256_and_si256(is_upper, _mm256_set1_epi8(-'A'));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(is_lower, _mm256_set1_epi8(26 - 'a')));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(is_digit, _mm256_set1_epi8(52 - '0')));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(is_plus, _mm256_set1_epi8(62 - '+')));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(is_slash, _mm256_set1_epi8(63 - '/')));
+		values = _mm256_add_epi8(chars, shift);
+		
+		values = _mm256_maddubs_epi16(values, pack_pairs);
+		values = _mm256_madd_epi16(values, pack_quads);
+		values = _mm256_shuffle_epi8(values, reorder);
+		values = _mm256_permutevar8x32_epi32(values, compact);
+		_mm256_storeu_si256((__m256i *) (out + written), values);
+		
+		in += 32;
+		written += 24;
+	}
+	
+	*consumed = in;
+	return written;
+}
+
+typedef gsize (*GoogleChatBase64DecodeFunc)(const gchar *text, gsize text_len, guint8 *out, gsize *consumed);
+
+static GoogleChatBase64DecodeFunc
+googlechat_base64_choose_decoder(void)
+{
+	static GoogleChatBase64DecodeFunc decoder = NULL;
+	static gboolean chosen = FALSE;
+	
+	if (!chosen) {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			decoder = googlechat_base64_decode_avx2;
+		} else if (__builtin_cpu_supports("ssse3")) {
+			decoder = googlechat_base64_decode_ssse3;
+		}
+		chosen = TRUE;
+	}
+	
+	return decoder;
+}
+
+#endif /* GOOGLECHAT_BASE64_SIMD */
+
+guchar *
+googlechat_base64_decode_into(GByteArray *buffer, const gchar *text, gsize text_len, gsize *out_len)
+{
+	gsize consumed = 0;
+	gsize written = 0;
+	
+	g_return_val_if_fail(buffer, NULL);
+	g_return_val_if_fail(text, NULL);
+	
+	g_byte_array_set_size(buffer, (text_len / 4 + 1) * 3 + GOOGLECHAT_BASE64_SLACK);
+	
+#ifdef GOOGLECHAT_BASE64_SIMD
+	{
+		GoogleChatBase64DecodeFunc decoder = googlechat_base64_choose_decoder();
+		if (decoder != NULL) {
+			written = decoder(text, text_len, buffer->data, &consumed);
+		}
+	}
+#endif
+	
+	written += googlechat_base64_decode_scalar(text + consumed, text_len - consumed, buffer->data + written);
+	
+	g_byte_array_set_size(buffer, written);
+	if (out_len != NULL) {
+		*out_len = written;
+	}
+	
+	return buffer->data;
+}
+
 /**
  * Given a field type, return the in-memory size.
  *
@@ -80,313 +442,1272 @@ sizeof_elt_in_repeated_array(ProtobufCType type)
 #define STRUCT_MEMBER(member_type, struct_p, struct_offset) \
     (*(member_type *) STRUCT_MEMBER_P((struct_p), (struct_offset)))
 
+typedef struct {
+	const gchar *pos;
+	const gchar *end;
+} PbliteReader;
+
+typedef struct _PbliteFieldOp PbliteFieldOp;
+typedef struct _PbliteMessagePlan PbliteMessagePlan;
+
+typedef gboolean (*PbliteDecodeFunc)(PbliteFieldOp *op, JsonNode *value, gpointer member);
+typedef JsonNode *(*PbliteEncodeFunc)(PbliteFieldOp *op, gpointer value);
+typedef gboolean (*PbliteReadFunc)(PbliteReader *reader, PbliteFieldOp *op, gpointer member);
+typedef void (*PbliteWriteFunc)(GString *out, PbliteFieldOp *op, gpointer value);
+
+/* Everything needed to handle one field, worked out once per message type */
+struct _PbliteFieldOp {
+	const ProtobufCFieldDescriptor *field;
+	size_t elt_size;
+	PbliteDecodeFunc decode;
+	PbliteEncodeFunc encode;
+	PbliteReadFunc read;
+	PbliteWriteFunc write;
+	const PbliteMessagePlan *message_plan; // For message fields, filled in on first use
+};
+
+struct _PbliteMessagePlan {
+	const ProtobufCMessageDescriptor *descriptor;
+	guint n_ops;          // One more than the highest field id
+	PbliteFieldOp *ops;   // Indexed by field id, gaps have a NULL field
+};
+
+static const PbliteMessagePlan *pblite_get_plan(const ProtobufCMessageDescriptor *descriptor);
+
+static inline PbliteFieldOp *
+pblite_plan_get_op(const PbliteMessagePlan *plan, guint64 id)
+{
+	if (id >= plan->n_ops || plan->ops[id].field == NULL) {
+		return NULL;
+	}
+	return &plan->ops[id];
+}
+
+static inline const PbliteMessagePlan *
+pblite_op_get_message_plan(PbliteFieldOp *op)
+{
+	if (op->message_plan == NULL) {
+		op->message_plan = pblite_get_plan(op->field->descriptor);
+	}
+	return op->message_plan;
+}
+
+static inline ProtobufCMessage *
+pblite_op_new_message(PbliteFieldOp *op)
+{
+	const ProtobufCMessageDescriptor *desc = op->field->descriptor;
+	ProtobufCMessage *message = g_malloc0(desc->sizeof_message);
+	
+	protobuf_c_message_init(desc, message);
+	return message;
+}
+
+
+static gboolean pblite_decode_with_plan(const PbliteMessagePlan *plan, ProtobufCMessage *message, JsonArray *pblite_array, gboolean ignore_first_item);
+
+static gboolean
+pblite_decode_uint32(PbliteFieldOp *op, JsonNode *value, gpointer member)
+{
+	*(uint32_t *) member = json_node_get_int(value);
+	return TRUE;
+}
+
+static gboolean
+pblite_decode_int32(PbliteFieldOp *op, JsonNode *value, gpointer member)
+{
+	*(int32_t *) member = json_node_get_int(value);
+	return TRUE;
+}
+
+static gboolean
+pblite_decode_uint64(PbliteFieldOp *op, JsonNode *value, gpointer member)
+{
+	*(uint64_t *) member = json_node_get_int(value);
+	return TRUE;
+}
+
+static gboolean
+pblite_decode_int64(PbliteFieldOp *op, JsonNode *value, gpointer member)
+{
+	*(int64_t *) member = json_node_get_int(value);
+	return TRUE;
+}
+
+static gboolean
+pblite_decode_float(PbliteFieldOp *op, JsonNode *value, gpointer member)
+{
+	*(float *) member = json_node_get_double(value);
+	return TRUE;
+}
+
 static gboolean
-pblite_decode_field(const ProtobufCFieldDescriptor *field, JsonNode *value, gpointer member)
+pblite_decode_double(PbliteFieldOp *op, JsonNode *value, gpointer member)
 {
+	*(double *) member = json_node_get_double(value);
+	return TRUE;
+}
+
+static gboolean
+pblite_decode_bool(PbliteFieldOp *op, JsonNode *value, gpointer member)
+{
+	*(protobuf_c_boolean *) member = json_node_get_int(value);
+	return TRUE;
+}
+
+static gboolean
+pblite_decode_string(PbliteFieldOp *op, JsonNode *value, gpointer member)
+{
+	char **pstr = member;
 	
-	switch (field->type) {
-		case PROTOBUF_C_TYPE_INT32:
-		case PROTOBUF_C_TYPE_UINT32:
-		case PROTOBUF_C_TYPE_SFIXED32:
-		case PROTOBUF_C_TYPE_FIXED32:
-		case PROTOBUF_C_TYPE_FLOAT:
-		case PROTOBUF_C_TYPE_ENUM:
-			*(uint32_t *) member = json_node_get_int(value);
-			return TRUE;
-			
-		case PROTOBUF_C_TYPE_SINT32:
-			*(int32_t *) member = json_node_get_int(value);
-			return TRUE;
+	//TODO - free old data
+	*pstr = g_strdup(json_node_get_string(value));
+	return TRUE;
+}
+
+static gboolean
+pblite_decode_bytes(PbliteFieldOp *op, JsonNode *value, gpointer member)
+{
+	ProtobufCBinaryData *bd = member;
 	
-		case PROTOBUF_C_TYPE_INT64:
-		case PROTOBUF_C_TYPE_UINT64:
-		case PROTOBUF_C_TYPE_SFIXED64:
-		case PROTOBUF_C_TYPE_FIXED64:
-		case PROTOBUF_C_TYPE_DOUBLE:
-			*(uint64_t *) member = json_node_get_int(value);
-			return TRUE;
-		
-		case PROTOBUF_C_TYPE_SINT64:
-			*(int64_t *) member = json_node_get_int(value);
-			return TRUE;
-		
-		case PROTOBUF_C_TYPE_BOOL:
-			*(protobuf_c_boolean *) member = json_node_get_int(value);
-			return TRUE;
-			
-		case PROTOBUF_C_TYPE_STRING: {
-			char **pstr = member;
-
-			//TODO - free old data
-			// if (maybe_clear && *pstr != NULL) {
-				// const char *def = scanned_member->field->default_value;
-				// if (*pstr != NULL && *pstr != def)
-					// do_free(allocator, *pstr);
-			// }
-			*pstr = g_strdup(json_node_get_string(value));
-			return TRUE;
-		}
-		case PROTOBUF_C_TYPE_BYTES: {
-			ProtobufCBinaryData *bd = member;
-			
-			//TODO - free old data
-			// def_bd = scanned_member->field->default_value;
-			// if (maybe_clear &&
-				// bd->data != NULL &&
-				// (def_bd == NULL || bd->data != def_bd->data))
-			// {
-				// do_free(allocator, bd->data);
-			// }
-			bd->data = g_base64_decode(json_node_get_string(value), &bd->len);
-			return TRUE;
-		}
-		
-		case PROTOBUF_C_TYPE_MESSAGE: {
-			ProtobufCMessage **pmessage = member;
-			const ProtobufCMessageDescriptor *desc = field->descriptor;
-			
-			*pmessage = g_malloc0(desc->sizeof_message);
-			(void) (glib_protobufc_allocator);
-			protobuf_c_message_init(desc, *pmessage);
+	//TODO - free old data
+	bd->data = g_base64_decode(json_node_get_string(value), &bd->len);
+	return TRUE;
+}
+
+static gboolean
+pblite_decode_message(PbliteFieldOp *op, JsonNode *value, gpointer member)
+{
+	ProtobufCMessage **pmessage = member;
+	
+	*pmessage = pblite_op_new_message(op);
+	(void) (glib_protobufc_allocator);
 
 #ifdef DEBUG
-			switch(json_node_get_node_type(value)) {
-				case JSON_NODE_OBJECT:
-					printf("object\n");
-					break;
-				case JSON_NODE_ARRAY:
-					printf("array\n");
-					break;
-				case JSON_NODE_NULL:
-					printf("null\n");
-					break;
-				case JSON_NODE_VALUE:
-					printf("value %s %" G_GINT64_FORMAT "\n", json_node_get_string(value), json_node_get_int(value));
-					break;
-			}
-#endif
-			
-			return pblite_decode(*pmessage, json_node_get_array(value), FALSE);
-		}
-		
-		default: {
-			//todo glib fail thing
-			return FALSE;
-		}
+	switch(json_node_get_node_type(value)) {
+		case JSON_NODE_OBJECT:
+			printf("object\n");
+			break;
+		case JSON_NODE_ARRAY:
+			printf("array\n");
+			break;
+		case JSON_NODE_NULL:
+			printf("null\n");
+			break;
+		case JSON_NODE_VALUE:
+			printf("value %s %" G_GINT64_FORMAT "\n", json_node_get_string(value), json_node_get_int(value));
+			break;
 	}
+#endif
+	
+	return pblite_decode_with_plan(pblite_op_get_message_plan(op), *pmessage, json_node_get_array(value), FALSE);
 }
 
 
 static JsonNode *
-pblite_encode_field(const ProtobufCFieldDescriptor *field, gpointer value)
+pblite_encode_uint32(PbliteFieldOp *op, gpointer value)
 {
-	JsonNode *node = NULL;
-	
-	switch (field->type) {
-		case PROTOBUF_C_TYPE_INT32:
-		case PROTOBUF_C_TYPE_UINT32:
-		case PROTOBUF_C_TYPE_SFIXED32:
-		case PROTOBUF_C_TYPE_FIXED32:
-		case PROTOBUF_C_TYPE_FLOAT:
-		case PROTOBUF_C_TYPE_ENUM: {
-			uint32_t * member = value;
-			node = json_node_new(JSON_NODE_VALUE);
-			json_node_set_int(node, *member);
-			break;
+	JsonNode *node = json_node_new(JSON_NODE_VALUE);
+	json_node_set_int(node, *(uint32_t *) value);
+	return node;
+}
+
+static JsonNode *
+pblite_encode_int32(PbliteFieldOp *op, gpointer value)
+{
+	JsonNode *node = json_node_new(JSON_NODE_VALUE);
+	json_node_set_int(node, *(int32_t *) value);
+	return node;
+}
+
+static JsonNode *
+pblite_encode_uint64(PbliteFieldOp *op, gpointer value)
+{
+	JsonNode *node = json_node_new(JSON_NODE_VALUE);
+	json_node_set_int(node, *(uint64_t *) value);
+	return node;
+}
+
+static JsonNode *
+pblite_encode_int64(PbliteFieldOp *op, gpointer value)
+{
+	JsonNode *node = json_node_new(JSON_NODE_VALUE);
+	json_node_set_int(node, *(int64_t *) value);
+	return node;
+}
+
+static JsonNode *
+pblite_encode_float(PbliteFieldOp *op, gpointer value)
+{
+	JsonNode *node = json_node_new(JSON_NODE_VALUE);
+	json_node_set_double(node, *(float *) value);
+	return node;
+}
+
+static JsonNode *
+pblite_encode_double(PbliteFieldOp *op, gpointer value)
+{
+	JsonNode *node = json_node_new(JSON_NODE_VALUE);
+	json_node_set_double(node, *(double *) value);
+	return node;
+}
+
+static JsonNode *
+pblite_encode_bool(PbliteFieldOp *op, gpointer value)
+{
+	JsonNode *node = json_node_new(JSON_NODE_VALUE);
+	json_node_set_boolean(node, *(protobuf_c_boolean *) value);
+	return node;
+}
+
+static JsonNode *
+pblite_encode_string(PbliteFieldOp *op, gpointer value)
+{
+	JsonNode *node = json_node_new(JSON_NODE_VALUE);
+	json_node_set_string(node, *(char **) value);
+	return node;
+}
+
+static JsonNode *
+pblite_encode_bytes(PbliteFieldOp *op, gpointer value)
+{
+	ProtobufCBinaryData *bd = value;
+	JsonNode *node = json_node_new(JSON_NODE_VALUE);
+	gchar *b64_data;
+	
+	b64_data = g_base64_encode(bd->data, bd->len);
+	json_node_set_string(node, b64_data);
+	g_free(b64_data);
+	return node;
+}
+
+static JsonNode *
+pblite_encode_message(PbliteFieldOp *op, gpointer value)
+{
+	ProtobufCMessage **pmessage = value;
+	JsonNode *node = json_node_new(JSON_NODE_ARRAY);
+	
+	if (pmessage != NULL) {
+		json_node_take_array(node, pblite_encode(*pmessage));
+	}
+	return node;
+}
+
+static void
+pblite_append_uint64(GString *out, guint64 value)
+{
+	gchar digits[20];
+	guint n = 0;
+	
+	do {
+		digits[n++] = '0' + (value % 10);
+		value /= 10;
+	} while (value != 0);
+	
+	while (n > 0) {
+		g_string_append_c(out, digits[--n]);
+	}
+}
+
+static void
+pblite_append_int64(GString *out, gint64 value)
+{
+	if (value < 0) {
+		g_string_append_c(out, '-');
+		pblite_append_uint64(out, -(guint64) value);
+	} else {
+		pblite_append_uint64(out, value);
+	}
+}
+
+static void
+pblite_append_double(GString *out, gdouble value)
+{
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+	
+	g_string_append(out, g_ascii_dtostr(buf, sizeof(buf), value));
+}
+
+static void
+pblite_write_uint32(GString *out, PbliteFieldOp *op, gpointer value)
+{
+	if (op->field->type == PROTOBUF_C_TYPE_INT32 || op->field->type == PROTOBUF_C_TYPE_SFIXED32) {
+		pblite_append_int64(out, *(int32_t *) value);
+	} else {
+		pblite_append_uint64(out, *(uint32_t *) value);
+	}
+}
+
+static void
+pblite_write_int32(GString *out, PbliteFieldOp *op, gpointer value)
+{
+	pblite_append_int64(out, *(int32_t *) value);
+}
+
+static void
+pblite_write_uint64(GString *out, PbliteFieldOp *op, gpointer value)
+{
+	if (op->field->type == PROTOBUF_C_TYPE_INT64 || op->field->type == PROTOBUF_C_TYPE_SFIXED64) {
+		pblite_append_int64(out, *(int64_t *) value);
+	} else {
+		pblite_append_uint64(out, *(uint64_t *) value);
+	}
+}
+
+static void
+pblite_write_int64(GString *out, PbliteFieldOp *op, gpointer value)
+{
+	pblite_append_int64(out, *(int64_t *) value);
+}
+
+static void
+pblite_write_float(GString *out, PbliteFieldOp *op, gpointer value)
+{
+	pblite_append_double(out, *(float *) value);
+}
+
+static void
+pblite_write_double(GString *out, PbliteFieldOp *op, gpointer value)
+{
+	pblite_append_double(out, *(double *) value);
+}
+
+static void
+pblite_write_bool(GString *out, PbliteFieldOp *op, gpointer value)
+{
+	g_string_append(out, *(protobuf_c_boolean *) value ? "true" : "false");
+}
+
+static void
+pblite_write_string(GString *out, PbliteFieldOp *op, gpointer value)
+{
+	googlechat_json_append_string(out, *(char **) value, -1);
+}
+
+static void
+pblite_write_bytes(GString *out, PbliteFieldOp *op, gpointer value)
+{
+	ProtobufCBinaryData *bd = value;
+	gsize start = out->len;
+	gint state = 0, save = 0;
+	
+	// Base64 never needs escaping, so encode straight into the output
+	g_string_append_c(out, '"');
+	g_string_set_size(out, start + 1 + (bd->len / 3 + 1) * 4 + 4);
+	start += 1;
+	start += g_base64_encode_step(bd->data, bd->len, FALSE, out->str + start, &state, &save);
+	start += g_base64_encode_close(FALSE, out->str + start, &state, &save);
+	g_string_truncate(out, start);
+	g_string_append_c(out, '"');
+}
+
+static void pblite_write_message_with_plan(GString *out, const PbliteMessagePlan *plan, ProtobufCMessage *message);
+
+static void
+pblite_write_message(GString *out, PbliteFieldOp *op, gpointer value)
+{
+	ProtobufCMessage **pmessage = value;
+	
+	if (*pmessage == NULL) {
+		g_string_append(out, "[]");
+	} else {
+		pblite_write_message_with_plan(out, pblite_op_get_message_plan(op), *pmessage);
+	}
+}
+
+static gboolean
+pblite_decode_element(const PbliteMessagePlan *plan, ProtobufCMessage *message, guint index, JsonNode *value)
+{
+	PbliteFieldOp *op;
+	const ProtobufCFieldDescriptor *field;
+	gboolean success = TRUE;
+	
+#ifdef DEBUG
+	printf("pblite_decode_element field %d ", index);
+#endif
+	op = pblite_plan_get_op(plan, index);
+	if (!op) {
+#ifdef DEBUG
+		gchar *json = json_pretty_encode(value, NULL);
+		printf("skipped unknown %s\n", json);
+		g_free(json);
+#endif
+		return TRUE;
+	}
+	field = op->field;
+#ifdef DEBUG
+	printf("is %s\n", field->name);
+#endif
+	
+	if (JSON_NODE_HOLDS_NULL(value)) {
+#ifdef DEBUG
+		printf("pblite_decode_element field %d skipped null\n", index);
+#endif
+		if (field->default_value != NULL) {
+			*(const void **) STRUCT_MEMBER(void *, message, field->offset) = field->default_value;
+		}
+		return TRUE;
+	}
+		
+	if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+		JsonArray *value_array = json_node_get_array(value);
+		guint j;
+		size_t siz;
+		size_t array_len;
+		void *tmp;
+		
+		array_len = json_array_get_length(value_array);
+#ifdef DEBUG
+		printf(" which is an array of length %d\n", array_len);
+#endif
+		
+		//see protobuf-c.c:3068
+		siz = op->elt_size;
+		STRUCT_MEMBER(size_t, message, field->quantifier_offset) = array_len;
+		STRUCT_MEMBER(void *, message, field->offset) = tmp = g_malloc0(siz * array_len);
+		
+		for (j = 0; j < array_len; j++) {
+#ifdef DEBUG
+			if (JSON_NODE_HOLDS_NULL(json_array_get_element(value_array, j))) {
+				printf("array %d contains null\n", j);
+			}
+#endif
+			success = op->decode(op, json_array_get_element(value_array, j), tmp + (siz * j));
+			if (!success) {
+				g_free(tmp);
+				g_return_val_if_fail(success, FALSE);
+			}
 		}
+	} else {
+		success = op->decode(op, value, STRUCT_MEMBER_P(message, field->offset));
+		g_return_val_if_fail(success, FALSE);
+		
+		if (field->label == PROTOBUF_C_LABEL_OPTIONAL && field->quantifier_offset) {
+			STRUCT_MEMBER(protobuf_c_boolean, message, field->quantifier_offset) = TRUE;
+		}
+	}
+	
+#ifdef DEBUG
+	printf("end\n");
+#endif
+	return TRUE;
+}
+
+static gboolean
+pblite_decode_with_plan(const PbliteMessagePlan *plan, ProtobufCMessage *message, JsonArray *pblite_array, gboolean ignore_first_item)
+{
+	guint i, len;
+	guint offset = (ignore_first_item ? 1 : 0);
+	gboolean last_element_is_object = FALSE;
+	
+	len = json_array_get_length(pblite_array);
+#ifdef DEBUG
+	printf("pblite_decode of %s with length %d\n", plan->descriptor->name, len);
+#endif
+	if (len == 0) {
+		return TRUE;
+	}
+	
+	if (JSON_NODE_HOLDS_OBJECT(json_array_get_element(pblite_array, len - 1))) {
+#ifdef DEBUG
+		printf("ZOMG the last element is an object\n");
+#endif
+		last_element_is_object = TRUE;
+		len = len - 1;
+	}
+	
+	for (i = offset; i < len; i++) {
+		//stuff
+		JsonNode *value = json_array_get_element(pblite_array, i);
+		gboolean success = pblite_decode_element(plan, message, i - offset + 1, value);
+		
+		g_return_val_if_fail(success, FALSE);
+	}
+	
+	//Continue on the array with the objects
+	if (last_element_is_object) {
+		JsonObject *last_object = json_array_get_object_element(pblite_array, len);
+		GList *members = json_object_get_members(last_object);
+		GList *l;
+		for (l = members; l != NULL; l = l->next) {
+			const gchar *member_name = l->data;
+			guint64 member = g_ascii_strtoull(member_name, NULL, 0);
+			JsonNode *value = json_object_get_member(last_object, member_name);
 			
-		case PROTOBUF_C_TYPE_SINT32: {
-			int32_t * member = value;
-			node = json_node_new(JSON_NODE_VALUE);
-			json_node_set_int(node, *member);
-			break;
+			gboolean success = pblite_decode_element(plan, message, member - offset, value);
+		
+			g_return_val_if_fail(success, FALSE);
 		}
+		g_list_free(members);
+	}
 	
-		case PROTOBUF_C_TYPE_INT64:
-		case PROTOBUF_C_TYPE_UINT64:
-		case PROTOBUF_C_TYPE_SFIXED64:
-		case PROTOBUF_C_TYPE_FIXED64:
-		case PROTOBUF_C_TYPE_DOUBLE: {
-			uint64_t * member = value;
-			node = json_node_new(JSON_NODE_VALUE);
-			json_node_set_int(node, *member);
-			break;
+	return TRUE;
+}
+
+gboolean
+pblite_decode(ProtobufCMessage *message, JsonArray *pblite_array, gboolean ignore_first_item)
+{
+	const ProtobufCMessageDescriptor *descriptor = message->descriptor;
+	
+	g_return_val_if_fail(descriptor, FALSE);
+	
+	return pblite_decode_with_plan(pblite_get_plan(descriptor), message, pblite_array, ignore_first_item);
+}
+
+
+/*
+ * Streaming pblite decoder
+ *
+ * Walks the raw pblite text once and writes straight into the message,
+ * without building a JsonArray tree first.  Google's sparse arrays
+ * (eg [,,1]) are understood natively.
+ */
+
+static gboolean pblite_reader_decode_message(PbliteReader *reader, const PbliteMessagePlan *plan, ProtobufCMessage *message, gchar **first_item);
+
+static inline gchar
+pblite_reader_peek(PbliteReader *reader)
+{
+	while (reader->pos < reader->end && g_ascii_isspace(*reader->pos)) {
+		reader->pos++;
+	}
+	
+	if (reader->pos >= reader->end) {
+		return '\0';
+	}
+	return *reader->pos;
+}
+
+static inline gboolean
+pblite_reader_consume(PbliteReader *reader, gchar c)
+{
+	if (pblite_reader_peek(reader) != c) {
+		return FALSE;
+	}
+	reader->pos++;
+	return TRUE;
+}
+
+/* Moves past the closing quote of a string whose opening quote has already been consumed */
+static gboolean
+pblite_reader_skip_string_body(PbliteReader *reader)
+{
+	while (reader->pos < reader->end) {
+		gchar c = *reader->pos++;
+		
+		if (c == '"') {
+			return TRUE;
+		} else if (c == '\\') {
+			reader->pos++;
 		}
+	}
+	
+	return FALSE;
+}
+
+static gunichar
+pblite_reader_read_hex4(PbliteReader *reader)
+{
+	gunichar value = 0;
+	guint i;
+	
+	if (reader->end - reader->pos < 4) {
+		return (gunichar) -1;
+	}
+	
+	for (i = 0; i < 4; i++) {
+		gint digit = g_ascii_xdigit_value(reader->pos[i]);
+		if (digit < 0) {
+			return (gunichar) -1;
+		}
+		value = (value << 4) | digit;
+	}
+	reader->pos += 4;
+	
+	return value;
+}
+
+static gchar *
+pblite_reader_read_string(PbliteReader *reader)
+{
+	const gchar *start;
+	gchar *out, *ret;
+	
+	if (!pblite_reader_consume(reader, '"')) {
+		return NULL;
+	}
+	start = reader->pos;
+	
+	// Fast path, for strings with nothing to unescape
+	while (reader->pos < reader->end && *reader->pos != '"' && *reader->pos != '\\') {
+		reader->pos++;
+	}
+	if (reader->pos >= reader->end) {
+		return NULL;
+	}
+	if (*reader->pos == '"') {
+		ret = g_strndup(start, reader->pos - start);
+		reader->pos++;
+		return ret;
+	}
+	
+	// Every escape sequence is at least as long as what it decodes to
+	reader->pos = start;
+	if (!pblite_reader_skip_string_body(reader)) {
+		return NULL;
+	}
+	ret = out = g_new(gchar, reader->pos - start);
+	reader->pos = start;
+	
+	while (*reader->pos != '"') {
+		gchar c = *reader->pos++;
+		gunichar uc;
 		
-		case PROTOBUF_C_TYPE_SINT64: {
-			int64_t * member = value;
-			node = json_node_new(JSON_NODE_VALUE);
-			json_node_set_int(node, *member);
-			break;
+		if (c != '\\') {
+			*out++ = c;
+			continue;
 		}
 		
-		case PROTOBUF_C_TYPE_BOOL: {
-			protobuf_c_boolean * member = value;
-			node = json_node_new(JSON_NODE_VALUE);
-			json_node_set_boolean(node, *member);
-			break;
+		c = *reader->pos++;
+		switch (c) {
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u':
+				uc = pblite_reader_read_hex4(reader);
+				if (uc == (gunichar) -1) {
+					*out++ = c;
+					break;
+				}
+				if (uc >= 0xD800 && uc <= 0xDBFF && reader->end - reader->pos >= 6 &&
+				    reader->pos[0] == '\\' && reader->pos[1] == 'u') {
+					PbliteReader low_reader = { reader->pos + 2, reader->end };
+					gunichar low = pblite_reader_read_hex4(&low_reader);
+					
+					if (low >= 0xDC00 && low <= 0xDFFF) {
+						uc = 0x10000 + ((uc - 0xD800) << 10) + (low - 0xDC00);
+						reader->pos = low_reader.pos;
+					}
+				}
+				if (uc >= 0xD800 && uc <= 0xDFFF) {
+					// Unpaired surrogate
+					uc = 0xFFFD;
+				}
+				out += g_unichar_to_utf8(uc, out);
+				break;
+			default:
+				// \" \\ \/ and anything unknown
+				*out++ = c;
+				break;
 		}
+	}
+	*out = '\0';
+	reader->pos++;
+	
+	return ret;
+}
+
+static gboolean
+pblite_reader_skip_value(PbliteReader *reader)
+{
+	gchar c = pblite_reader_peek(reader);
+	
+	switch (c) {
+		case '"':
+			reader->pos++;
+			return pblite_reader_skip_string_body(reader);
+		
+		case '[':
+		case '{': {
+			// Skip to the matching bracket, ignoring anything in strings
+			guint depth = 0;
 			
-		case PROTOBUF_C_TYPE_STRING: {
-			char **pstr = value;
-			node = json_node_new(JSON_NODE_VALUE);
-			json_node_set_string(node, *pstr);		
-			break;
+			while (reader->pos < reader->end) {
+				c = *reader->pos++;
+				if (c == '"') {
+					if (!pblite_reader_skip_string_body(reader)) {
+						return FALSE;
+					}
+				} else if (c == '[' || c == '{') {
+					depth++;
+				} else if (c == ']' || c == '}') {
+					if (--depth == 0) {
+						return TRUE;
+					}
+				}
+			}
+			return FALSE;
 		}
 		
-		case PROTOBUF_C_TYPE_BYTES: {
-			ProtobufCBinaryData *bd = value;
-			gchar *b64_data;
+		case ',':
+		case ']':
+		case '}':
+		case '\0':
+			// An empty slot in a sparse array
+			return TRUE;
+		
+		default:
+			// Numbers and literals
+			while (reader->pos < reader->end && !strchr(",]}", *reader->pos) && !g_ascii_isspace(*reader->pos)) {
+				reader->pos++;
+			}
+			return TRUE;
+	}
+}
+
+/* Reads a scalar the same way json_node_get_int()/json_node_get_double() would */
+static gboolean
+pblite_reader_read_number(PbliteReader *reader, gint64 *int_value, gdouble *double_value)
+{
+	gchar c = pblite_reader_peek(reader);
+	const gchar *start = reader->pos;
+	gchar number[G_ASCII_DTOSTR_BUF_SIZE];
+	gsize len;
+	
+	*int_value = 0;
+	*double_value = 0;
+	
+	if (c == '-' || g_ascii_isdigit(c)) {
+		gboolean is_double = FALSE;
+		
+		while (reader->pos < reader->end && (g_ascii_isdigit(*reader->pos) || strchr("+-.eE", *reader->pos))) {
+			if (!g_ascii_isdigit(*reader->pos) && *reader->pos != '-') {
+				is_double = TRUE;
+			}
+			reader->pos++;
+		}
+		
+		len = MIN((gsize) (reader->pos - start), sizeof(number) - 1);
+		memcpy(number, start, len);
+		number[len] = '\0';
+		
+		if (is_double) {
+			*double_value = g_ascii_strtod(number, NULL);
+			*int_value = (gint64) *double_value;
+		} else {
+			*int_value = g_ascii_strtoll(number, NULL, 10);
+			*double_value = (gdouble) *int_value;
+		}
+		return TRUE;
+	}
+	
+	if (c == 't' && reader->end - reader->pos >= 4 && strncmp(reader->pos, "true", 4) == 0) {
+		*int_value = 1;
+		*double_value = 1;
+	}
+	
+	return pblite_reader_skip_value(reader);
+}
+
+static gboolean
+pblite_read_uint32(PbliteReader *reader, PbliteFieldOp *op, gpointer member)
+{
+	gint64 int_value;
+	gdouble double_value;
+	
+	if (!pblite_reader_read_number(reader, &int_value, &double_value)) {
+		return FALSE;
+	}
+	*(uint32_t *) member = int_value;
+	return TRUE;
+}
+
+static gboolean
+pblite_read_int32(PbliteReader *reader, PbliteFieldOp *op, gpointer member)
+{
+	gint64 int_value;
+	gdouble double_value;
+	
+	if (!pblite_reader_read_number(reader, &int_value, &double_value)) {
+		return FALSE;
+	}
+	*(int32_t *) member = int_value;
+	return TRUE;
+}
+
+static gboolean
+pblite_read_uint64(PbliteReader *reader, PbliteFieldOp *op, gpointer member)
+{
+	gint64 int_value;
+	gdouble double_value;
+	
+	if (!pblite_reader_read_number(reader, &int_value, &double_value)) {
+		return FALSE;
+	}
+	*(uint64_t *) member = int_value;
+	return TRUE;
+}
+
+static gboolean
+pblite_read_int64(PbliteReader *reader, PbliteFieldOp *op, gpointer member)
+{
+	gint64 int_value;
+	gdouble double_value;
+	
+	if (!pblite_reader_read_number(reader, &int_value, &double_value)) {
+		return FALSE;
+	}
+	*(int64_t *) member = int_value;
+	return TRUE;
+}
+
+static gboolean
+pblite_read_float(PbliteReader *reader, PbliteFieldOp *op, gpointer member)
+{
+	gint64 int_value;
+	gdouble double_value;
+	
+	if (!pblite_reader_read_number(reader, &int_value, &double_value)) {
+		return FALSE;
+	}
+	*(float *) member = double_value;
+	return TRUE;
+}
+
+static gboolean
+pblite_read_double(PbliteReader *reader, PbliteFieldOp *op, gpointer member)
+{
+	gint64 int_value;
+	gdouble double_value;
+	
+	if (!pblite_reader_read_number(reader, &int_value, &double_value)) {
+		return FALSE;
+	}
+	*(double *) member = double_value;
+	return TRUE;
+}
+
+static gboolean
+pblite_read_bool(PbliteReader *reader, PbliteFieldOp *op, gpointer member)
+{
+	gint64 int_value;
+	gdouble double_value;
+	
+	if (!pblite_reader_read_number(reader, &int_value, &double_value)) {
+		return FALSE;
+	}
+	*(protobuf_c_boolean *) member = int_value;
+	return TRUE;
+}
+
+static gboolean
+pblite_read_string(PbliteReader *reader, PbliteFieldOp *op, gpointer member)
+{
+	char **pstr = member;
+	
+	if (pblite_reader_peek(reader) != '"') {
+		*pstr = NULL;
+		return pblite_reader_skip_value(reader);
+	}
+	*pstr = pblite_reader_read_string(reader);
+	return (*pstr != NULL);
+}
+
+static gboolean
+pblite_read_bytes(PbliteReader *reader, PbliteFieldOp *op, gpointer member)
+{
+	ProtobufCBinaryData *bd = member;
+	gchar *b64_data;
+	
+	bd->data = NULL;
+	bd->len = 0;
+	if (pblite_reader_peek(reader) != '"') {
+		return pblite_reader_skip_value(reader);
+	}
+	b64_data = pblite_reader_read_string(reader);
+	if (b64_data == NULL) {
+		return FALSE;
+	}
+	bd->data = g_base64_decode_inplace(b64_data, &bd->len);
+	return TRUE;
+}
+
+static gboolean
+pblite_read_message(PbliteReader *reader, PbliteFieldOp *op, gpointer member)
+{
+	ProtobufCMessage **pmessage = member;
+	
+	*pmessage = pblite_op_new_message(op);
+	
+	if (pblite_reader_peek(reader) != '[') {
+		return pblite_reader_skip_value(reader);
+	}
+	return pblite_reader_decode_message(reader, pblite_op_get_message_plan(op), *pmessage, NULL);
+}
+
+static gboolean
+pblite_reader_decode_element(PbliteReader *reader, const PbliteMessagePlan *plan, ProtobufCMessage *message, guint64 index)
+{
+	PbliteFieldOp *op;
+	const ProtobufCFieldDescriptor *field;
+	gchar c;
+	
+	op = pblite_plan_get_op(plan, index);
+	c = pblite_reader_peek(reader);
+	if (!op || c == 'n' || c == ',' || c == ']' || c == '}') {
+		// Unknown fields and nulls are skipped
+		return pblite_reader_skip_value(reader);
+	}
+	field = op->field;
+	
+	if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+		size_t siz = op->elt_size;
+		GByteArray *values;
+		size_t array_len = 0;
+		
+		if (c != '[') {
+			return pblite_reader_skip_value(reader);
+		}
+		reader->pos++;
+		
+		values = g_byte_array_new();
+		if (!pblite_reader_consume(reader, ']')) {
+			do {
+				gpointer element;
+				
+				g_byte_array_set_size(values, siz * (array_len + 1));
+				element = values->data + (siz * array_len);
+				memset(element, 0, siz);
+				
+				c = pblite_reader_peek(reader);
+				if (c != ',' && c != ']' && c != 'n') {
+					if (!op->read(reader, op, element)) {
+						g_byte_array_free(values, TRUE);
+						return FALSE;
+					}
+				} else {
+					if (field->type == PROTOBUF_C_TYPE_MESSAGE) {
+						// Null elements still become empty messages
+						*(ProtobufCMessage **) element = pblite_op_new_message(op);
+					}
+					pblite_reader_skip_value(reader);
+				}
+				array_len++;
+			} while (pblite_reader_consume(reader, ','));
 			
-			b64_data = g_base64_encode(bd->data, bd->len);
-			node = json_node_new(JSON_NODE_VALUE);
-			json_node_set_string(node, b64_data);
-			g_free(b64_data);
-			break;
+			if (!pblite_reader_consume(reader, ']')) {
+				g_byte_array_free(values, TRUE);
+				return FALSE;
+			}
+		}
+		
+		STRUCT_MEMBER(size_t, message, field->quantifier_offset) = array_len;
+		STRUCT_MEMBER(void *, message, field->offset) = g_byte_array_free(values, array_len == 0);
+	} else {
+		if (!op->read(reader, op, STRUCT_MEMBER_P(message, field->offset))) {
+			return FALSE;
+		}
+		
+		if (field->label == PROTOBUF_C_LABEL_OPTIONAL && field->quantifier_offset) {
+			STRUCT_MEMBER(protobuf_c_boolean, message, field->quantifier_offset) = TRUE;
+		}
+	}
+	
+	return TRUE;
+}
+
+/* Decodes the trailing {"id": value, ...} object that holds fields too sparse to put in the array */
+static gboolean
+pblite_reader_decode_cheats(PbliteReader *reader, const PbliteMessagePlan *plan, ProtobufCMessage *message, guint offset)
+{
+	if (!pblite_reader_consume(reader, '{')) {
+		return FALSE;
+	}
+	if (pblite_reader_consume(reader, '}')) {
+		return TRUE;
+	}
+	
+	do {
+		gchar *member_name = pblite_reader_read_string(reader);
+		guint64 member;
+		
+		if (member_name == NULL) {
+			return FALSE;
 		}
+		member = g_ascii_strtoull(member_name, NULL, 0);
+		g_free(member_name);
 		
-		case PROTOBUF_C_TYPE_MESSAGE: {
-			ProtobufCMessage **pmessage = value;
-			
-			node = json_node_new(JSON_NODE_ARRAY);
-			if (pmessage != NULL) {
-				json_node_take_array(node, pblite_encode(*pmessage));
-			}
-			break;
+		if (!pblite_reader_consume(reader, ':')) {
+			return FALSE;
 		}
-	}
+		if (!pblite_reader_decode_element(reader, plan, message, member - offset)) {
+			return FALSE;
+		}
+	} while (pblite_reader_consume(reader, ','));
 	
-	return node;
+	return pblite_reader_consume(reader, '}');
 }
 
 static gboolean
-pblite_decode_element(ProtobufCMessage *message, guint index, JsonNode *value)
+pblite_reader_decode_message(PbliteReader *reader, const PbliteMessagePlan *plan, ProtobufCMessage *message, gchar **first_item)
 {
-	const ProtobufCFieldDescriptor *field;
-	gboolean success = TRUE;
+	guint index = 0;
+	guint offset = 0;
 	
-#ifdef DEBUG
-	printf("pblite_decode_element field %d ", index);
-#endif
-	field = protobuf_c_message_descriptor_get_field(message->descriptor, index);
-	if (!field) {
-#ifdef DEBUG
-		gchar *json = json_pretty_encode(value, NULL);
-		printf("skipped unknown %s\n", json);
-		g_free(json);
-#endif
-		return TRUE;
+	if (!pblite_reader_consume(reader, '[')) {
+		return FALSE;
 	}
-#ifdef DEBUG
-	printf("is %s\n", field->name);
-#endif
-	
-	if (JSON_NODE_HOLDS_NULL(value)) {
-#ifdef DEBUG
-		printf("pblite_decode_element field %d skipped null\n", index);
-#endif
-		if (field->default_value != NULL) {
-			*(const void **) STRUCT_MEMBER(void *, message, field->offset) = field->default_value;
-		}
+	if (pblite_reader_consume(reader, ']')) {
 		return TRUE;
 	}
+	
+	do {
+		gchar c = pblite_reader_peek(reader);
+		gboolean success;
 		
-	if (field->label == PROTOBUF_C_LABEL_REPEATED) {
-		JsonArray *value_array = json_node_get_array(value);
-		guint j;
-		size_t siz;
-		size_t array_len;
-		void *tmp;
-		
-		array_len = json_array_get_length(value_array);
-#ifdef DEBUG
-		printf(" which is an array of length %d\n", array_len);
-#endif
-		
-		//see protobuf-c.c:3068
-		siz = sizeof_elt_in_repeated_array(field->type);
-		STRUCT_MEMBER(size_t, message, field->quantifier_offset) = array_len;
-		STRUCT_MEMBER(void *, message, field->offset) = tmp = g_malloc0(siz * array_len);
-		
-		for (j = 0; j < array_len; j++) {
-#ifdef DEBUG
-			if (JSON_NODE_HOLDS_NULL(json_array_get_element(value_array, j))) {
-				printf("array %d contains null\n", j);
-			}
-#endif
-			success = pblite_decode_field(field, json_array_get_element(value_array, j), STRUCT_MEMBER(void *, message, field->offset) + (siz * j));
-			if (!success) {
-				g_free(tmp);
-				g_return_val_if_fail(success, FALSE);
-			}
+		if (index == 0 && first_item != NULL && c == '"') {
+			// Sometimes the first item is a string to identify the type
+			*first_item = pblite_reader_read_string(reader);
+			offset = 1;
+			success = (*first_item != NULL);
+		} else if (c == '{') {
+			success = pblite_reader_decode_cheats(reader, plan, message, offset);
+		} else {
+			success = pblite_reader_decode_element(reader, plan, message, index - offset + 1);
 		}
-	} else {
-		success = pblite_decode_field(field, value, STRUCT_MEMBER_P(message, field->offset));
-		g_return_val_if_fail(success, FALSE);
 		
-		if (field->label == PROTOBUF_C_LABEL_OPTIONAL && field->quantifier_offset) {
-			STRUCT_MEMBER(protobuf_c_boolean, message, field->quantifier_offset) = TRUE;
+		if (!success) {
+			return FALSE;
 		}
-	}
+		index++;
+	} while (pblite_reader_consume(reader, ','));
 	
-#ifdef DEBUG
-	printf("end\n");
-#endif
-	return TRUE;
+	return pblite_reader_consume(reader, ']');
 }
 
 gboolean
-pblite_decode(ProtobufCMessage *message, JsonArray *pblite_array, gboolean ignore_first_item)
+pblite_decode_data(ProtobufCMessage *message, const gchar *data, gsize len, gchar **first_item)
 {
-	const ProtobufCMessageDescriptor *descriptor = message->descriptor;
-	guint i, len;
-	guint offset = (ignore_first_item ? 1 : 0);
-	gboolean last_element_is_object = FALSE;
+	PbliteReader reader;
 	
-	g_return_val_if_fail(descriptor, FALSE);
+	g_return_val_if_fail(message && message->descriptor, FALSE);
+	g_return_val_if_fail(data, FALSE);
 	
-	len = json_array_get_length(pblite_array);
-#ifdef DEBUG
-	printf("pblite_decode of %s with length %d\n", descriptor->name, len);
-#endif
-	if (len == 0) {
-		return TRUE;
+	if (first_item != NULL) {
+		*first_item = NULL;
 	}
 	
-	if (JSON_NODE_HOLDS_OBJECT(json_array_get_element(pblite_array, len - 1))) {
-#ifdef DEBUG
-		printf("ZOMG the last element is an object\n");
-#endif
-		last_element_is_object = TRUE;
-		len = len - 1;
+	reader.pos = data;
+	reader.end = data + len;
+	
+	return pblite_reader_decode_message(&reader, pblite_get_plan(message->descriptor), message, first_item);
+}
+
+
+static GHashTable *pblite_plans = NULL;
+
+static const PbliteMessagePlan *
+pblite_get_plan(const ProtobufCMessageDescriptor *descriptor)
+{
+	PbliteMessagePlan *plan;
+	guint i;
+	
+	if (pblite_plans == NULL) {
+		pblite_plans = g_hash_table_new(g_direct_hash, g_direct_equal);
 	}
 	
-	for (i = offset; i < len; i++) {
-		//stuff
-		JsonNode *value = json_array_get_element(pblite_array, i);
-		gboolean success = pblite_decode_element(message, i - offset + 1, value);
+	plan = g_hash_table_lookup(pblite_plans, descriptor);
+	if (plan != NULL) {
+		return plan;
+	}
+	
+	plan = g_new0(PbliteMessagePlan, 1);
+	plan->descriptor = descriptor;
+	for (i = 0; i < descriptor->n_fields; i++) {
+		plan->n_ops = MAX(plan->n_ops, descriptor->fields[i].id + 1);
+	}
+	plan->ops = g_new0(PbliteFieldOp, plan->n_ops);
+	
+	for (i = 0; i < descriptor->n_fields; i++) {
+		const ProtobufCFieldDescriptor *field = descriptor->fields + i;
+		PbliteFieldOp *op = &plan->ops[field->id];
 		
-		g_return_val_if_fail(success, FALSE);
+		op->field = field;
+		op->elt_size = sizeof_elt_in_repeated_array(field->type);
+		
+		switch (field->type) {
+			case PROTOBUF_C_TYPE_INT32:
+			case PROTOBUF_C_TYPE_UINT32:
+			case PROTOBUF_C_TYPE_SFIXED32:
+			case PROTOBUF_C_TYPE_FIXED32:
+			case PROTOBUF_C_TYPE_ENUM:
+				op->decode = pblite_decode_uint32;
+				op->encode = pblite_encode_uint32;
+				op->read = pblite_read_uint32;
+				op->write = pblite_write_uint32;
+				break;
+			case PROTOBUF_C_TYPE_SINT32:
+				op->decode = pblite_decode_int32;
+				op->encode = pblite_encode_int32;
+				op->read = pblite_read_int32;
+				op->write = pblite_write_int32;
+				break;
+			case PROTOBUF_C_TYPE_INT64:
+			case PROTOBUF_C_TYPE_UINT64:
+			case PROTOBUF_C_TYPE_SFIXED64:
+			case PROTOBUF_C_TYPE_FIXED64:
+				op->decode = pblite_decode_uint64;
+				op->encode = pblite_encode_uint64;
+				op->read = pblite_read_uint64;
+				op->write = pblite_write_uint64;
+				break;
+			case PROTOBUF_C_TYPE_SINT64:
+				op->decode = pblite_decode_int64;
+				op->encode = pblite_encode_int64;
+				op->read = pblite_read_int64;
+				op->write = pblite_write_int64;
+				break;
+			case PROTOBUF_C_TYPE_FLOAT:
+				op->decode = pblite_decode_float;
+				op->encode = pblite_encode_float;
+				op->read = pblite_read_float;
+				op->write = pblite_write_float;
+				break;
+			case PROTOBUF_C_TYPE_DOUBLE:
+				op->decode = pblite_decode_double;
+				op->encode = pblite_encode_double;
+				op->read = pblite_read_double;
+				op->write = pblite_write_double;
+				break;
+			case PROTOBUF_C_TYPE_BOOL:
+				op->decode = pblite_decode_bool;
+				op->encode = pblite_encode_bool;
+				op->read = pblite_read_bool;
+				op->write = pblite_write_bool;
+				break;
+			case PROTOBUF_C_TYPE_STRING:
+				op->decode = pblite_decode_string;
+				op->encode = pblite_encode_string;
+				op->read = pblite_read_string;
+				op->write = pblite_write_string;
+				break;
+			case PROTOBUF_C_TYPE_BYTES:
+				op->decode = pblite_decode_bytes;
+				op->encode = pblite_encode_bytes;
+				op->read = pblite_read_bytes;
+				op->write = pblite_write_bytes;
+				break;
+			case PROTOBUF_C_TYPE_MESSAGE:
+				op->decode = pblite_decode_message;
+				op->encode = pblite_encode_message;
+				op->read = pblite_read_message;
+				op->write = pblite_write_message;
+				break;
+			default:
+				// Not something we know how to handle, treat it as unknown
+				op->field = NULL;
+				break;
+		}
 	}
 	
-	//Continue on the array with the objects
-	if (last_element_is_object) {
-		JsonObject *last_object = json_array_get_object_element(pblite_array, len);
-		GList *members = json_object_get_members(last_object);
-		GList *l;
-		for (l = members; l != NULL; l = l->next) {
-			const gchar *member_name = l->data;
-			guint64 member = g_ascii_strtoull(member_name, NULL, 0);
-			JsonNode *value = json_object_get_member(last_object, member_name);
-			
-			gboolean success = pblite_decode_element(message, member - offset, value);
+	g_hash_table_insert(pblite_plans, (gpointer) descriptor, plan);
+	
+	return plan;
+}
+
+/* Same output as json_encode_array(pblite_encode(message)), without building the tree */
+static void
+pblite_write_message_with_plan(GString *out, const PbliteMessagePlan *plan, ProtobufCMessage *message)
+{
+	const ProtobufCMessageDescriptor *descriptor = message->descriptor;
+	guint n_positional = 0;
+	gboolean in_cheats = FALSE;
+	guint i;
+	
+	g_string_append_c(out, '[');
+	
+	for (i = 0; i < descriptor->n_fields; i++) {
+		const ProtobufCFieldDescriptor *field_descriptor = descriptor->fields + i;
+		PbliteFieldOp *op = pblite_plan_get_op(plan, field_descriptor->id);
+		void *field = STRUCT_MEMBER_P(message, field_descriptor->offset);
+		gboolean is_null = FALSE;
 		
-			g_return_val_if_fail(success, FALSE);
+		if (op == NULL) {
+			continue;
+		}
+		
+		if (field_descriptor->label == PROTOBUF_C_LABEL_OPTIONAL) {
+			if (field_descriptor->type == PROTOBUF_C_TYPE_MESSAGE || 
+			    field_descriptor->type == PROTOBUF_C_TYPE_STRING)
+			{
+				const void *ptr = *(const void * const *) field;
+				is_null = (ptr == NULL || ptr == field_descriptor->default_value);
+			} else {
+				const protobuf_c_boolean *val = STRUCT_MEMBER_P(message, field_descriptor->quantifier_offset);
+				is_null = !*val;
+			}
+		}
+		
+		if (!in_cheats && n_positional + 1 == field_descriptor->id) {
+			// Fields that line up with their position are written in place, nulls included
+			if (n_positional++ > 0) {
+				g_string_append_c(out, ',');
+			}
+		} else if (is_null) {
+			// Everything after the first gap goes in the cheats object, which skips nulls
+			continue;
+		} else {
+			if (!in_cheats) {
+				g_string_append(out, n_positional > 0 ? ",{" : "{");
+				in_cheats = TRUE;
+			} else {
+				g_string_append_c(out, ',');
+			}
+			g_string_append_c(out, '"');
+			pblite_append_uint64(out, field_descriptor->id);
+			g_string_append(out, "\":");
+		}
+		
+		if (is_null) {
+			g_string_append(out, "null");
+		} else if (field_descriptor->label == PROTOBUF_C_LABEL_REPEATED) {
+			size_t array_len = STRUCT_MEMBER(size_t, message, field_descriptor->quantifier_offset);
+			guint8 *elements = STRUCT_MEMBER(void *, message, field_descriptor->offset);
+			size_t j;
+			
+			g_string_append_c(out, '[');
+			for (j = 0; j < array_len; j++) {
+				if (j > 0) {
+					g_string_append_c(out, ',');
+				}
+				op->write(out, op, elements + (op->elt_size * j));
+			}
+			g_string_append_c(out, ']');
+		} else {
+			op->write(out, op, field);
 		}
-		g_list_free(members);
 	}
 	
-	return TRUE;
+	if (in_cheats) {
+		g_string_append_c(out, '}');
+	}
+	g_string_append_c(out, ']');
+}
+
+void
+pblite_encode_to_string(ProtobufCMessage *message, GString *out)
+{
+	g_return_if_fail(message != NULL);
+	g_return_if_fail(out != NULL);
+	
+	pblite_write_message_with_plan(out, pblite_get_plan(message->descriptor), message);
+}
+
+gchar *
+pblite_encode_data(ProtobufCMessage *message, gsize *len)
+{
+	GString *out;
+	
+	g_return_val_if_fail(message != NULL, NULL);
+	
+	out = g_string_sized_new(256);
+	pblite_encode_to_string(message, out);
+	
+	if (len != NULL) {
+		*len = out->len;
+	}
+	return g_string_free(out, FALSE);
 }
 
 JsonArray *
@@ -396,6 +1717,7 @@ pblite_encode(ProtobufCMessage *message)
 	JsonArray *pblite = json_array_new();
 	JsonObject *cheats_object = json_object_new();
 	const ProtobufCMessageDescriptor *descriptor = message->descriptor;
+	const PbliteMessagePlan *plan = pblite_get_plan(descriptor);
 	guint i;
 #ifdef DEBUG
 	printf("pblite_encode of %s with length %d\n", descriptor->name, descriptor->n_fields);
@@ -403,9 +1725,14 @@ pblite_encode(ProtobufCMessage *message)
 	
 	for (i = 0; i < descriptor->n_fields; i++) {
 		const ProtobufCFieldDescriptor *field_descriptor = descriptor->fields + i;
+		PbliteFieldOp *op = pblite_plan_get_op(plan, field_descriptor->id);
 		void *field = STRUCT_MEMBER_P(message, field_descriptor->offset);
 		JsonNode *encoded_value = NULL;
 		
+		if (op == NULL) {
+			continue;
+		}
+		
 #ifdef DEBUG
 		printf("pblite_encode_element field %d (%d) ", i, field_descriptor->id);
 #endif
@@ -419,7 +1746,7 @@ pblite_encode(ProtobufCMessage *message)
 			size_t array_len;
 			JsonArray *value_array;
 			
-			siz = sizeof_elt_in_repeated_array(field_descriptor->type);
+			siz = op->elt_size;
 			array_len = STRUCT_MEMBER(size_t, message, field_descriptor->quantifier_offset);
 			
 #ifdef DEBUG
@@ -429,7 +1756,7 @@ pblite_encode(ProtobufCMessage *message)
 			value_array = json_array_new();
 			for (j = 0; j < array_len; j++) {
 				field = STRUCT_MEMBER(void *, message, field_descriptor->offset) + (siz * j);
-				json_array_add_element(value_array, pblite_encode_field(field_descriptor, field));
+				json_array_add_element(value_array, op->encode(op, field));
 			}
 			encoded_value = json_node_new(JSON_NODE_ARRAY);
 			json_node_take_array(encoded_value, value_array);
@@ -448,7 +1775,7 @@ pblite_encode(ProtobufCMessage *message)
 				}
 			}
 			if (encoded_value == NULL) {
-				encoded_value = pblite_encode_field(field_descriptor, field);
+				encoded_value = op->encode(op, field);
 			}
 		}
 		
@@ -479,169 +1806,229 @@ pblite_encode(ProtobufCMessage *message)
 
 
 
-static JsonObject *pblite_encode_for_json(ProtobufCMessage *message);
+static void pblite_dump_message(GString *out, ProtobufCMessage *message, guint depth, gsize limit);
 
-static JsonNode *
-pblite_encode_field_for_json(const ProtobufCFieldDescriptor *field, gpointer value)
+static void
+pblite_dump_indent(GString *out, guint depth)
+{
+	g_string_append_c(out, '\n');
+	while (depth-- > 0) {
+		g_string_append_c(out, '\t');
+	}
+}
+
+/* How much of a string or bytes value is worth writing before out passes limit.
+ * Going one byte over is enough for pblite_dump_json_truncated() to cut it. */
+static gsize
+pblite_dump_room(GString *out, gsize limit)
+{
+	if (limit == G_MAXSIZE) {
+		return G_MAXSIZE;
+	}
+	return out->len < limit ? limit - out->len + 1 : 1;
+}
+
+static void
+pblite_dump_field(GString *out, const ProtobufCFieldDescriptor *field, gpointer value, guint depth, gsize limit)
 {
-	JsonNode *node = NULL;
-	
 	switch (field->type) {
-		case PROTOBUF_C_TYPE_INT32:
 		case PROTOBUF_C_TYPE_UINT32:
-		case PROTOBUF_C_TYPE_SFIXED32:
 		case PROTOBUF_C_TYPE_FIXED32:
-		case PROTOBUF_C_TYPE_FLOAT: {
-			uint32_t * member = value;
-			node = json_node_new(JSON_NODE_VALUE);
-			json_node_set_int(node, *member);
+			pblite_append_uint64(out, *(uint32_t *) value);
 			break;
-		}
+		
 		case PROTOBUF_C_TYPE_ENUM: {
-			uint32_t * member = value;
+			uint32_t *member = value;
 			const ProtobufCEnumDescriptor *enum_descriptor = field->descriptor;
 			const ProtobufCEnumValue *enum_value = protobuf_c_enum_descriptor_get_value(enum_descriptor, *member);
-			node = json_node_new(JSON_NODE_VALUE);
 			if (enum_value == NULL) {
-				gchar *unknown_text = g_strdup_printf("UNKNOWN ENUM VALUE %u", *member);
-				json_node_set_string(node, unknown_text);
-				g_free(unknown_text);
+				g_string_append(out, "\"UNKNOWN ENUM VALUE ");
+				pblite_append_uint64(out, *member);
+				g_string_append_c(out, '"');
 			} else {
-				json_node_set_string(node, enum_value->name);
+				googlechat_json_append_string(out, enum_value->name, -1);
 			}
 			break;
 		}
-			
-		case PROTOBUF_C_TYPE_SINT32: {
-			int32_t * member = value;
-			node = json_node_new(JSON_NODE_VALUE);
-			json_node_set_int(node, *member);
+		
+		case PROTOBUF_C_TYPE_INT32:
+		case PROTOBUF_C_TYPE_SINT32:
+		case PROTOBUF_C_TYPE_SFIXED32:
+			pblite_append_int64(out, *(int32_t *) value);
 			break;
-		}
-	
-		case PROTOBUF_C_TYPE_INT64:
+		
 		case PROTOBUF_C_TYPE_UINT64:
-		case PROTOBUF_C_TYPE_SFIXED64:
 		case PROTOBUF_C_TYPE_FIXED64:
-		case PROTOBUF_C_TYPE_DOUBLE: {
-			uint64_t * member = value;
-			node = json_node_new(JSON_NODE_VALUE);
-			json_node_set_int(node, *member);
+			pblite_append_uint64(out, *(uint64_t *) value);
+			break;
+		
+		case PROTOBUF_C_TYPE_INT64:
+		case PROTOBUF_C_TYPE_SINT64:
+		case PROTOBUF_C_TYPE_SFIXED64:
+			pblite_append_int64(out, *(int64_t *) value);
 			break;
-		}
 		
-		case PROTOBUF_C_TYPE_SINT64: {
-			int64_t * member = value;
-			node = json_node_new(JSON_NODE_VALUE);
-			json_node_set_int(node, *member);
+		case PROTOBUF_C_TYPE_FLOAT:
+			pblite_append_double(out, *(float *) value);
 			break;
-		}
 		
-		case PROTOBUF_C_TYPE_BOOL: {
-			protobuf_c_boolean * member = value;
-			node = json_node_new(JSON_NODE_VALUE);
-			json_node_set_boolean(node, *member);
+		case PROTOBUF_C_TYPE_DOUBLE:
+			pblite_append_double(out, *(double *) value);
 			break;
-		}
-			
+		
+		case PROTOBUF_C_TYPE_BOOL:
+			g_string_append(out, *(protobuf_c_boolean *) value ? "true" : "false");
+			break;
+		
 		case PROTOBUF_C_TYPE_STRING: {
-			char **pstr = value;
-			node = json_node_new(JSON_NODE_VALUE);
-			json_node_set_string(node, *pstr);		
+			const gchar *str = *(char **) value;
+			gsize room = pblite_dump_room(out, limit);
+			gssize len = -1;
+			
+			// Don't escape all of a huge message body just to throw most of it away
+			if (str != NULL && room != G_MAXSIZE && memchr(str, '\0', room) == NULL) {
+				len = room;
+			}
+			googlechat_json_append_string(out, str, len);
 			break;
 		}
 		
 		case PROTOBUF_C_TYPE_BYTES: {
-			ProtobufCBinaryData *bd = value;
-			gchar *b64_data;
+			ProtobufCBinaryData head = *(ProtobufCBinaryData *) value;
+			gsize room = pblite_dump_room(out, limit);
 			
-			b64_data = g_base64_encode(bd->data, bd->len);
-			node = json_node_new(JSON_NODE_VALUE);
-			json_node_set_string(node, b64_data);
-			g_free(b64_data);
+			// Every 3 bytes become 4 characters of base64
+			if (room != G_MAXSIZE) {
+				head.len = MIN(head.len, room / 4 * 3 + 3);
+			}
+			pblite_write_bytes(out, NULL, &head);
 			break;
 		}
 		
 		case PROTOBUF_C_TYPE_MESSAGE: {
 			ProtobufCMessage **pmessage = value;
 			
-			node = json_node_new(JSON_NODE_OBJECT);
-			if (pmessage != NULL) {
-				json_node_take_object(node, pblite_encode_for_json(*pmessage));
+			if (*pmessage == NULL) {
+				g_string_append(out, "{}");
+			} else {
+				pblite_dump_message(out, *pmessage, depth, limit);
 			}
 			break;
 		}
 	}
-	
-	return node;
 }
 
-static JsonObject *
-pblite_encode_for_json(ProtobufCMessage *message)
+/* Pretty-prints a message with its field names, written straight into out.
+ * Gives up early (leaving the text unbalanced) once out grows past limit. */
+static void
+pblite_dump_message(GString *out, ProtobufCMessage *message, guint depth, gsize limit)
 {
-	JsonObject *pblite = json_object_new();
 	const ProtobufCMessageDescriptor *descriptor = message->descriptor;
 	guint i;
 	
-	g_return_val_if_fail(descriptor != NULL, NULL);
+	g_return_if_fail(descriptor != NULL);
+	
+	if (descriptor->n_fields == 0) {
+		g_string_append(out, "{}");
+		return;
+	}
+	
+	g_string_append_c(out, '{');
 	
 	for (i = 0; i < descriptor->n_fields; i++) {
 		const ProtobufCFieldDescriptor *field_descriptor = descriptor->fields + i;
 		void *field = STRUCT_MEMBER_P(message, field_descriptor->offset);
-		JsonNode *encoded_value = NULL;
+		
+		if (out->len >= limit) {
+			return;
+		}
+		if (i > 0) {
+			g_string_append_c(out, ',');
+		}
+		pblite_dump_indent(out, depth + 1);
+		googlechat_json_append_string(out, field_descriptor->name, -1);
+		g_string_append(out, " : ");
 		
 		if (field_descriptor->label == PROTOBUF_C_LABEL_REPEATED) {
-			guint j;
-			size_t siz;
-			size_t array_len;
-			JsonArray *value_array;
+			size_t siz = sizeof_elt_in_repeated_array(field_descriptor->type);
+			size_t array_len = STRUCT_MEMBER(size_t, message, field_descriptor->quantifier_offset);
+			size_t j;
 			
-			siz = sizeof_elt_in_repeated_array(field_descriptor->type);
-			array_len = STRUCT_MEMBER(size_t, message, field_descriptor->quantifier_offset);
+			if (array_len == 0) {
+				g_string_append(out, "[]");
+				continue;
+			}
 			
-			value_array = json_array_new();
+			g_string_append_c(out, '[');
 			for (j = 0; j < array_len; j++) {
 				field = STRUCT_MEMBER(void *, message, field_descriptor->offset) + (siz * j);
-				json_array_add_element(value_array, pblite_encode_field_for_json(field_descriptor, field));
-			}
-			encoded_value = json_node_new(JSON_NODE_ARRAY);
-			json_node_take_array(encoded_value, value_array);
-		} else {
-			if (field_descriptor->label == PROTOBUF_C_LABEL_OPTIONAL) {
-				if (field_descriptor->type == PROTOBUF_C_TYPE_MESSAGE || 
-				    field_descriptor->type == PROTOBUF_C_TYPE_STRING)
-				{
-					const void *ptr = *(const void * const *) field;
-					if (ptr == NULL || ptr == field_descriptor->default_value)
-						encoded_value = json_node_new(JSON_NODE_NULL);
-				} else {
-					const protobuf_c_boolean *val = STRUCT_MEMBER_P(message, field_descriptor->quantifier_offset);
-					if (!*val)
-						encoded_value = json_node_new(JSON_NODE_NULL);
+				if (out->len >= limit) {
+					return;
+				}
+				if (j > 0) {
+					g_string_append_c(out, ',');
 				}
+				pblite_dump_indent(out, depth + 2);
+				pblite_dump_field(out, field_descriptor, field, depth + 2, limit);
 			}
-			if (encoded_value == NULL) {
-				encoded_value = pblite_encode_field_for_json(field_descriptor, field);
+			pblite_dump_indent(out, depth + 1);
+			g_string_append_c(out, ']');
+			continue;
+		}
+		
+		if (field_descriptor->label == PROTOBUF_C_LABEL_OPTIONAL) {
+			if (field_descriptor->type == PROTOBUF_C_TYPE_MESSAGE || 
+			    field_descriptor->type == PROTOBUF_C_TYPE_STRING)
+			{
+				const void *ptr = *(const void * const *) field;
+				if (ptr == NULL || ptr == field_descriptor->default_value) {
+					g_string_append(out, "null");
+					continue;
+				}
+			} else {
+				const protobuf_c_boolean *val = STRUCT_MEMBER_P(message, field_descriptor->quantifier_offset);
+				if (!*val) {
+					g_string_append(out, "null");
+					continue;
+				}
 			}
 		}
 		
-		json_object_set_member(pblite, field_descriptor->name, encoded_value);
+		pblite_dump_field(out, field_descriptor, field, depth + 1, limit);
 	}
 	
-	return pblite;
+	pblite_dump_indent(out, depth);
+	g_string_append_c(out, '}');
 }
 
 
 gchar *
 pblite_dump_json(ProtobufCMessage *message)
 {
-	JsonObject *pblite = pblite_encode_for_json(message);
-	JsonNode *node = json_node_new(JSON_NODE_OBJECT);
-	gchar *json;
+	return pblite_dump_json_truncated(message, 0);
+}
+
+gchar *
+pblite_dump_json_truncated(ProtobufCMessage *message, gsize max_len)
+{
+	GString *out;
+	gsize limit = max_len ? max_len : G_MAXSIZE;
+	
+	g_return_val_if_fail(message != NULL, NULL);
 	
-	json_node_take_object(node, pblite);
-	json = json_pretty_encode(node, NULL);
+	out = g_string_sized_new(MIN(limit, 1024) + 32);
+	pblite_dump_message(out, message, 0, limit);
+	
+	if (out->len > limit) {
+		gsize len = limit;
+		
+		// Don't leave half a UTF-8 character behind
+		while (len > 0 && (out->str[len] & 0xC0) == 0x80) {
+			len--;
+		}
+		g_string_truncate(out, len);
+		g_string_append_printf(out, "... (truncated, limit %" G_GSIZE_FORMAT " bytes)", max_len);
+	}
 	
-	json_node_free(node);
-	return json;
+	return g_string_free(out, FALSE);
 }
@@ -40,6 +40,24 @@
  */
 gboolean pblite_decode(ProtobufCMessage *message, JsonArray *pblite_array, gboolean ignore_first_item);
 
+/**
+ * Decode pblite text straight into a ProtobufCMessage, without building a JSON tree.
+ * Understands Google's sparse arrays (eg [,,1]) so the text doesn't need tidying first.
+ *
+ * \param message
+ *      The message type to store as.  Is also used as the output.
+ * \param data
+ *      The pblite text to parse.
+ * \param len
+ *      The length of data.
+ * \param first_item (optional, out)
+ *      If given and the first item in the array is a string, it's treated as a type identifier
+ *      and returned here instead of being decoded.  You are required to g_free() this.
+ * \return
+ *      TRUE if successful, FALSE if there was an error.
+ */
+gboolean pblite_decode_data(ProtobufCMessage *message, const gchar *data, gsize len, gchar **first_item);
+
 /**
  * Encodes a ProtobufCMessage into a JsonArray.
  *
@@ -50,7 +68,93 @@ gboolean pblite_decode(ProtobufCMessage *message, JsonArray *pblite_array, gbool
  */
 JsonArray *pblite_encode(ProtobufCMessage *message);
 
+/**
+ * Encodes a ProtobufCMessage as pblite text, written straight into a string.
+ * Gives the same output as json_encode_array(pblite_encode(message)) without building a JSON tree.
+ *
+ * \param message
+ *      The message to encode.
+ * \param out
+ *      The string to append the pblite text to.
+ */
+void pblite_encode_to_string(ProtobufCMessage *message, GString *out);
+
+/**
+ * Encodes a ProtobufCMessage as pblite text.
+ *
+ * \param message
+ *      The message to encode.
+ * \param len (optional, out)
+ *      Returns the length of the encoded text.
+ * \return
+ *      The pblite text.  You are required to g_free() this when you are done.
+ */
+gchar *pblite_encode_data(ProtobufCMessage *message, gsize *len);
+
 
+/**
+ * Pretty-prints a ProtobufCMessage as JSON with field names, for debugging.
+ *
+ * \param message
+ *      The message to dump.
+ * \return
+ *      The JSON text.  You are required to g_free() this when you are done.
+ */
 gchar *pblite_dump_json(ProtobufCMessage *message);
 
+/**
+ * Same as pblite_dump_json() but stops serialising once the output reaches max_len,
+ * so it's cheap to use on arbitrarily large messages.
+ *
+ * \param message
+ *      The message to dump.
+ * \param max_len
+ *      Roughly how many bytes to write before giving up, or 0 for no limit.
+ * \return
+ *      The JSON text, with a marker at the end if it was cut short.  You are required to g_free() this when you are done.
+ */
+gchar *pblite_dump_json_truncated(ProtobufCMessage *message, gsize max_len);
+
+
+typedef struct _GoogleChatArena GoogleChatArena;
+
+/**
+ * Creates a bump-pointer arena for unpacking short-lived protobuf messages.
+ *
+ * \param block_size
+ *      How much memory to grab from the system at a time.
+ */
+GoogleChatArena *googlechat_arena_new(gsize block_size);
+void googlechat_arena_free(GoogleChatArena *arena);
+
+/**
+ * Throws away everything allocated from the arena, keeping one block around for next time.
+ */
+void googlechat_arena_reset(GoogleChatArena *arena);
+
+/**
+ * Returns an allocator to pass to protobuf_c_message_unpack().  Messages unpacked with it
+ * must not be protobuf_c_message_free_unpacked()'d, and stay valid until the matching
+ * googlechat_arena_release().  Calls can be nested; the arena is reset when the last
+ * user releases it.
+ */
+ProtobufCAllocator *googlechat_arena_acquire(GoogleChatArena *arena);
+void googlechat_arena_release(GoogleChatArena *arena);
+
+/**
+ * Decodes base64 into a reusable buffer, using SSSE3/AVX2 when the CPU has them.
+ *
+ * \param buffer
+ *      The buffer to decode into.  Grown as needed, and its len is set to the decoded length.
+ * \param text
+ *      The base64 text to decode.
+ * \param text_len
+ *      The length of text.
+ * \param out_len (optional, out)
+ *      Returns the length of the decoded data.
+ * \return
+ *      The decoded data, which is owned by buffer and only valid until it's next used.
+ */
+guchar *googlechat_base64_decode_into(GByteArray *buffer, const gchar *text, gsize text_len, gsize *out_len);
+
 #endif /* _GOOGLECHAT_PBLITE_H_ */
@@ -31,6 +31,7 @@
 #include "googlechat_events.h"
 #include "googlechat_connection.h"
 #include "googlechat_conversation.h"
+#include "googlechat_cache.h"
 
 
 /*****************************************************************************/
@@ -87,6 +88,15 @@ googlechat_add_account_options(GList *account_options)
 	option = purple_account_option_bool_new(N_("Fetch image history when opening group chats"), "fetch_image_history", TRUE);
 	account_options = g_list_append(account_options, option);
 	
+	option = purple_account_option_string_new(N_("Server URL"), "server_url", GOOGLECHAT_PBLITE_API_URL);
+	account_options = g_list_append(account_options, option);
+	
+	option = purple_account_option_bool_new(N_("Record the event stream for replaying (saves message contents to disk)"), "record_channel", FALSE);
+	account_options = g_list_append(account_options, option);
+	
+	option = purple_account_option_int_new(N_("Release stream buffer memory above (KB)"), "channel_buffer_shrink_kb", GOOGLECHAT_CHANNEL_BUFFER_SHRINK_DEFAULT_KB);
+	account_options = g_list_append(account_options, option);
+	
 	return account_options;
 }
 
@@ -135,6 +145,7 @@ googlechat_blist_node_removed(PurpleBlistNode *node)
 		conv_id = g_hash_table_lookup(ha->one_to_ones_rev, gaia_id);
 		
 		googlechat_archive_conversation(ha, conv_id);
+		g_hash_table_remove(ha->presence_statuses, gaia_id);
 		
 		if (purple_strequal(gaia_id, ha->self_gaia_id)) {
 			purple_account_set_bool(account, "hide_self", TRUE);
@@ -297,6 +308,9 @@ PurpleConnection *pc
 
 	act = purple_protocol_action_new(_("Search for friends..."), googlechat_search_users);
 	m = g_list_append(m, act);
+	
+	act = purple_protocol_action_new(_("Connection statistics..."), googlechat_show_connection_stats);
+	m = g_list_append(m, act);
 
 	// act = purple_protocol_action_new(_("Join a group chat by URL..."), googlechat_join_chat_by_url_action);
 	// m = g_list_append(m, act);
@@ -362,13 +376,30 @@ googlechat_login(PurpleAccount *account)
 	ha->pc = pc;
 	ha->cookie_jar = purple_http_cookie_jar_new();
 	ha->channel_buffer = g_byte_array_sized_new(GOOGLECHAT_BUFFER_DEFAULT_SIZE);
+	ha->channel_buffer_shrink_size = MAX(0, purple_account_get_int(account, "channel_buffer_shrink_kb", GOOGLECHAT_CHANNEL_BUFFER_SHRINK_DEFAULT_KB)) * 1024;
+	if (g_getenv(GOOGLECHAT_SERVER_URL_ENV) != NULL) {
+		googlechat_set_server_url(ha, g_getenv(GOOGLECHAT_SERVER_URL_ENV));
+	} else {
+		googlechat_set_server_url(ha, purple_account_get_string(account, "server_url", GOOGLECHAT_PBLITE_API_URL));
+	}
 	ha->channel_keepalive_pool = purple_http_keepalive_pool_new();
 	ha->api_keepalive_pool = purple_http_keepalive_pool_new();
 	ha->sent_message_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	ha->protobuf_arena = googlechat_arena_new(GOOGLECHAT_ARENA_BLOCK_SIZE);
+	ha->base64_scratch = g_byte_array_sized_new(GOOGLECHAT_BUFFER_DEFAULT_SIZE);
+	googlechat_api_queues_init(ha);
+	googlechat_request_header_init(ha);
+	ha->api_pack_buffer = g_byte_array_sized_new(GOOGLECHAT_BUFFER_DEFAULT_SIZE);
 	
 	ha->one_to_ones = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 	ha->one_to_ones_rev = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 	ha->group_chats = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	ha->pending_presence_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	ha->presence_refreshed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	ha->presence_statuses = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	googlechat_member_lookups_init(ha);
+	googlechat_user_cache_load(ha);
+	googlechat_world_cache_load(ha);
 	
 	self_gaia_id = purple_account_get_string(account, "self_gaia_id", NULL);
 	if (self_gaia_id != NULL) {
@@ -425,8 +456,16 @@ googlechat_close(PurpleConnection *pc)
 	g_source_remove(ha->poll_buddy_status_timeout);
 	g_source_remove(ha->refresh_token_timeout);
 	g_source_remove(ha->dynamite_token_timeout);
+	if (ha->presence_batch_timeout) {
+		g_source_remove(ha->presence_batch_timeout);
+	}
+	googlechat_save_last_event_timestamp(ha);
 	
-	purple_http_conn_cancel_all(pc);
+	googlechat_cancel_requests(ha);
+	
+	if (ha->channel_recording != NULL) {
+		fclose(ha->channel_recording);
+	}
 	
 	purple_http_keepalive_pool_unref(ha->channel_keepalive_pool);
 	purple_http_keepalive_pool_unref(ha->api_keepalive_pool);
@@ -438,8 +477,16 @@ googlechat_close(PurpleConnection *pc)
 	g_free(ha->csessionid_param);
 	g_free(ha->sid_param);
 	g_free(ha->client_id);
+	g_free(ha->server_url);
+	g_free(ha->channel_url_prefix);
 	purple_http_cookie_jar_unref(ha->cookie_jar);
 	g_byte_array_free(ha->channel_buffer, TRUE);
+	googlechat_arena_free(ha->protobuf_arena);
+	g_byte_array_free(ha->base64_scratch, TRUE);
+	g_byte_array_free(ha->api_pack_buffer, TRUE);
+	g_free(ha->request_header_packed);
+	
+	googlechat_world_cache_free(ha);
 	
 	g_hash_table_remove_all(ha->sent_message_ids);
 	g_hash_table_unref(ha->sent_message_ids);
@@ -449,6 +496,11 @@ googlechat_close(PurpleConnection *pc)
 	g_hash_table_unref(ha->one_to_ones_rev);
 	g_hash_table_remove_all(ha->group_chats);
 	g_hash_table_unref(ha->group_chats);
+	g_hash_table_unref(ha->pending_presence_ids);
+	g_hash_table_unref(ha->presence_refreshed);
+	g_hash_table_unref(ha->presence_statuses);
+	googlechat_member_lookups_free(ha);
+	googlechat_user_cache_free(ha);
 	
 	g_free(ha);
 }
@@ -701,20 +753,13 @@ typedef struct _GoogleChatProtocolClass
 static void
 googlechat_protocol_init(PurpleProtocol *prpl_info)
 {
-	PurpleProtocol *plugin = prpl_info, *info = prpl_info;
+	PurpleProtocol *info = prpl_info;
 
 	info->id = GOOGLECHAT_PLUGIN_ID;
 	info->name = "Google Chat";
 
 	prpl_info->options = OPT_PROTO_NO_PASSWORD | OPT_PROTO_CHAT_TOPIC | OPT_PROTO_MAIL_CHECK;
 	prpl_info->account_options = googlechat_add_account_options(prpl_info->account_options);
-	
-	purple_signal_register(plugin, "googlechat-received-event",
-			purple_marshal_VOID__POINTER_POINTER, G_TYPE_NONE, 2,
-			PURPLE_TYPE_CONNECTION,
-			G_TYPE_OBJECT);
-
-	googlechat_register_events(plugin);
 }
 
 static void
@@ -930,13 +975,6 @@ init_plugin(PurplePlugin *plugin)
 	
 	prpl_info->options = OPT_PROTO_NO_PASSWORD | OPT_PROTO_IM_IMAGE | OPT_PROTO_CHAT_TOPIC | OPT_PROTO_MAIL_CHECK;
 	prpl_info->protocol_options = googlechat_add_account_options(prpl_info->protocol_options);
-	
-	purple_signal_register(plugin, "googlechat-received-event",
-			purple_marshal_VOID__POINTER_POINTER, NULL, 2,
-			PURPLE_TYPE_CONNECTION,
-			purple_value_new(PURPLE_TYPE_OBJECT));
-
-	googlechat_register_events(plugin);
 
 	prpl_info->login = googlechat_login;
 	prpl_info->close = googlechat_close;
@@ -22,6 +22,7 @@
 #ifndef _LIBGOOGLECHAT_H_
 #define _LIBGOOGLECHAT_H_
 
+#include <stdio.h>
 #include <purple.h>
 
 #ifndef PURPLE_PLUGINS
@@ -39,6 +40,10 @@
 #define GOOGLECHAT_PLUGIN_VERSION "0.1"
 
 #define GOOGLECHAT_BUFFER_DEFAULT_SIZE 4096
+#define GOOGLECHAT_CHANNEL_BUFFER_SHRINK_DEFAULT_KB 256
+// A webchannel frame announcing more than this is taken to be a corrupt stream
+#define GOOGLECHAT_CHANNEL_MAX_CHUNK_LEN (8 * 1024 * 1024)
+#define GOOGLECHAT_ARENA_BLOCK_SIZE 16384
 
 #ifndef N_
 #	define N_(a) (a)
@@ -66,8 +71,55 @@
 
 #define GOOGLECHAT_ACTIVE_CLIENT_TIMEOUT 120
 
+// The newest event timestamp is saved once events stop arriving for a few seconds, and at least this often while they don't
+#define GOOGLECHAT_EVENT_TIMESTAMP_SAVE_DELAY 5
+#define GOOGLECHAT_EVENT_TIMESTAMP_SAVE_MAX_AGE 30
+
+#define GOOGLECHAT_PRESENCE_BATCH_DELAY_MS 50
+#define GOOGLECHAT_PRESENCE_BATCH_MAX_USERS 100
+// Presence changes are pushed to us, so buddies are only polled once we haven't heard about them for a while
+#define GOOGLECHAT_PRESENCE_POLL_TICK 30
+#define GOOGLECHAT_PRESENCE_ACTIVE_INTERVAL 120  // Buddies with an open conversation
+#define GOOGLECHAT_PRESENCE_IDLE_INTERVAL 900    // Everyone else
+#define GOOGLECHAT_MEMBERS_BATCH_DELAY_MS 50
+#define GOOGLECHAT_MEMBERS_BATCH_MAX_USERS 100
+#define GOOGLECHAT_MEMBERS_LOOKUP_TIMEOUT 60
+#define GOOGLECHAT_MEMBERS_LOOKUP_ATTEMPTS 3
+
+// How many API requests of each priority may be in flight at once
+#define GOOGLECHAT_API_INTERACTIVE_MAX_ACTIVE 4
+#define GOOGLECHAT_API_SYNC_MAX_ACTIVE 3
+#define GOOGLECHAT_API_BACKGROUND_MAX_ACTIVE 2
+// Buckets are <10ms, <50ms, <250ms, <1s, <5s and anything longer
+#define GOOGLECHAT_API_WAIT_BUCKETS 6
+// Buckets are 0, 1, 2-3, 4-15, 16-63 and 64 or more requests already waiting
+#define GOOGLECHAT_API_DEPTH_BUCKETS 6
+// How many unused request contexts to keep around for reuse
+#define GOOGLECHAT_REQUEST_CONTEXT_POOL_MAX 32
+// How many responses (and identical requests in flight) the API response cache holds at most
+#define GOOGLECHAT_API_CACHE_MAX_ENTRIES 128
+
 #define GOOGLECHAT_MAGIC_HALF_EIGHT_SLASH_ME_TYPE 4
 
+typedef struct _GoogleChatRequestContext GoogleChatRequestContext;
+
+typedef enum {
+	GOOGLECHAT_API_PRIORITY_INTERACTIVE = 0, // Something the user is waiting on, eg sending a message
+	GOOGLECHAT_API_PRIORITY_SYNC,            // Catching up on conversations and the directory
+	GOOGLECHAT_API_PRIORITY_BACKGROUND,      // Presence, profiles, member lists
+	GOOGLECHAT_API_PRIORITY_COUNT
+} GoogleChatApiPriority;
+
+typedef struct {
+	GQueue waiting;              // Requests that haven't been sent yet, see googlechat_api_request()
+	guint active;                // Requests sent and not yet answered
+	guint max_active;
+	guint sent;
+	guint peak_depth;
+	guint depth_histogram[GOOGLECHAT_API_DEPTH_BUCKETS]; // How many were already waiting when a request was queued
+	guint wait_histogram[GOOGLECHAT_API_WAIT_BUCKETS];   // How long requests waited before being sent
+} GoogleChatApiQueue;
+
 typedef struct {
 	PurpleAccount *account;
 	PurpleConnection *pc;
@@ -83,13 +135,27 @@ typedef struct {
 	gchar *self_phone;
 	
 	gint64 last_event_timestamp;
+	gint64 last_event_timestamp_received; // Newest event seen, see googlechat_save_last_event_timestamp()
+	time_t last_event_timestamp_changed;  // When last_event_timestamp_received last moved
+	time_t last_event_timestamp_unsaved;  // When last_event_timestamp_received first moved since it was saved, or 0
+	guint last_event_timestamp_save_timeout;
 	PurpleConversation *last_conversation_focused;
 	guint poll_buddy_status_timeout;
 	gint server_time_offset;
 	gint64 last_aid;
 	gint64 last_ofs;
+	gchar *server_url;           // Where chat.google.com requests go, see googlechat_set_server_url()
+	gchar *channel_url_prefix;   // server_url + "/webchannel/"
 	
 	GByteArray *channel_buffer;
+	gsize channel_buffer_pos;    // Read cursor into channel_buffer
+	gsize channel_chunk_len;     // Length of the chunk being read, or the length digits seen so far
+	gboolean channel_chunk_len_done; // Whether channel_chunk_len is complete and we're waiting on the chunk body
+	gsize channel_buffer_high_water; // Largest channel_buffer has been since it was last reallocated
+	gsize channel_buffer_peak;   // Largest channel_buffer has ever been
+	gsize channel_buffer_shrink_size; // Give back channel_buffer's memory once drained, if it grew past this
+	guint channel_events_received; // Number of stream events handed to googlechat_process_received_event()
+	FILE *channel_recording;     // Raw webchannel bytes are copied here when "record_channel" is set
 	guint channel_watchdog;
 	PurpleHttpConnection *channel_connection;
 	PurpleHttpKeepalivePool *channel_keepalive_pool;
@@ -104,6 +170,50 @@ typedef struct {
 	GHashTable *group_chats;     // A store of known conv_id's
 	GHashTable *sent_message_ids;// A store of message id's that we generated from this instance
 	
+	struct _GoogleChatArena *protobuf_arena; // Scratch memory for unpacking stream events and API responses
+	GByteArray *base64_scratch;  // Reused for decoding base64 protobuf payloads
+	
+	GHashTable *pending_presence_ids; // Set of user id's waiting to go out in the next presence request
+	guint presence_batch_timeout;
+	guint presence_lookups;      // Number of user id's presence was asked for, counting repeats
+	guint presence_requests;     // Number of get_user_presence requests actually sent
+	guint presence_pushes;       // Number of presence changes pushed to us
+	GHashTable *presence_refreshed; // user id's -> GoogleChatPresenceRefresh, when we were last told or pushed their presence
+	GHashTable *presence_statuses; // user id's -> packed status last passed on to libpurple, see googlechat_got_user_status()
+	guint presence_changed;      // Statuses passed on to libpurple
+	guint presence_unchanged;    // Statuses dropped because they were the same as last time
+	
+	GHashTable *member_lookups;  // user id's -> lookups that are queued or waiting on get_members
+	guint member_batch_timeout;
+	guint member_retry_timeout;  // Resends get_members requests that never got an answer
+	guint member_batch_serial;   // Identifies which request a user id went out in
+	guint member_lookups_asked;  // Number of user id's asked about
+	guint member_requests;       // Number of get_members requests actually sent
+	
+	GHashTable *user_cache;      // gaia_id's -> cached user profiles, see googlechat_cache.c
+	gboolean user_cache_dirty;
+	guint user_cache_save_timeout;
+	
+	GHashTable *world_cache;     // conv_id's -> cached WorldItemLite's, see googlechat_cache.c
+	gchar *world_consistency_token;
+	gint64 world_synced_at;      // When the cached directory was last fetched in full
+	gboolean world_cache_dirty;
+	
+	RequestHeader request_header;    // Shared by every request, see googlechat_get_request_header()
+	ClientFeatureCapabilities request_header_capabilities;
+	guint8 *request_header_packed;   // request_header without its trace_id, encoded once at login
+	gsize request_header_packed_len;
+	GByteArray *api_pack_buffer;     // Reused for encoding outgoing API requests
+	
+	GoogleChatApiQueue api_queues[GOOGLECHAT_API_PRIORITY_COUNT];
+	GoogleChatRequestContext *request_context_pool; // Unused request contexts, see googlechat_request_context_new()
+	guint request_context_pool_size;
+	GHashTable *api_response_cache;  // endpoint + request body -> recent or in-flight responses, see googlechat_api_request()
+	GQueue api_cache_deliveries;     // Requests answered from the cache, waiting to be handed their response
+	guint api_cache_delivery_timeout;
+	guint api_cache_hits;            // Requests answered from a cached response
+	guint api_cache_joins;           // Requests that waited on an identical one already in flight
+	
 	guint refresh_token_timeout;
 	guint dynamite_token_timeout;
 } GoogleChatAccount;
@@ -166,7 +166,12 @@ purple_chat_conversation_find_user(PurpleChatConversation *chat, const char *nam
 #define purple_notify_warning(handle, title, primary, secondary, cpar)   \
 	purple_notify_message((handle), PURPLE_NOTIFY_MSG_WARNING, (title), \
 						(primary), (secondary), NULL, NULL)
+#undef purple_notify_info
+#define purple_notify_info(handle, title, primary, secondary, cpar)   \
+	purple_notify_message((handle), PURPLE_NOTIFY_MSG_INFO, (title), \
+						(primary), (secondary), NULL, NULL)
 #define purple_notify_user_info_add_pair_html  purple_notify_user_info_add_pair
+#define purple_cache_dir  purple_user_dir
 
 #define PurpleProtocolAction  PurplePluginAction
 #define purple_protocol_action_get_connection(action)  ((PurpleConnection *) (action)->context)
@@ -0,0 +1,627 @@
+/*
+ * GoogleChat Plugin for libpurple/Pidgin
+ * Copyright (c) 2015-2016 Eion Robb, Mike Ruprecht
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The test program is linked against the real libpurple, but not purple2compat's
+ * http.c, so the purple_http_* functions here are the only HTTP it has.  The other
+ * functions defined here replace libpurple's own copies, which would otherwise want
+ * a buddy list, conversations or an image store set up.
+ */
+
+#include "fake_purple.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+FakePurpleCounts fake_purple_counts;
+
+static gboolean fake_debug_enabled = TRUE;
+static PurpleStoredImage *fake_image;
+
+/*** Allocation counting *****************************************************/
+
+// glibc's own allocator, which these wrap
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static gsize fake_allocs;
+static gsize fake_frees;
+
+void *
+malloc(size_t size)
+{
+	void *ptr = __libc_malloc(size);
+
+	if (ptr != NULL) {
+		fake_allocs++;
+	}
+	return ptr;
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	void *ptr = __libc_calloc(nmemb, size);
+
+	if (ptr != NULL) {
+		fake_allocs++;
+	}
+	return ptr;
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	void *new_ptr = __libc_realloc(ptr, size);
+
+	if (ptr == NULL && new_ptr != NULL) {
+		fake_allocs++;
+	} else if (ptr != NULL && size == 0) {
+		fake_frees++;
+	}
+	return new_ptr;
+}
+
+void
+free(void *ptr)
+{
+	if (ptr != NULL) {
+		fake_frees++;
+	}
+	__libc_free(ptr);
+}
+
+gsize
+fake_alloc_count(void)
+{
+	return fake_allocs;
+}
+
+gssize
+fake_alloc_outstanding(void)
+{
+	return (gssize) (fake_allocs - fake_frees);
+}
+
+/*** Debug and GLib logging **************************************************/
+
+static void
+fake_debug_print(PurpleDebugLevel level, const char *category, const char *arg_s)
+{
+	if (!purple_strequal(category, "googlechat")) {
+		return;
+	}
+
+	if (level == PURPLE_DEBUG_ERROR) {
+		fake_purple_counts.debug_errors++;
+	}
+	if (g_str_has_prefix(arg_s, "Received new other event")) {
+		fake_purple_counts.other_events++;
+	}
+
+	if (g_getenv("GOOGLECHAT_TEST_VERBOSE") != NULL) {
+		g_printerr("%s: %s", category, arg_s);
+	}
+}
+
+static gboolean
+fake_debug_is_enabled(PurpleDebugLevel level, const char *category)
+{
+	return fake_debug_enabled;
+}
+
+static PurpleDebugUiOps fake_debug_ui_ops = {
+	fake_debug_print,
+	fake_debug_is_enabled,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
+// The handlers look for conversations the tests never create, which libpurple complains about
+static void
+fake_log_critical(const gchar *log_domain, GLogLevelFlags log_level, const gchar *message, gpointer user_data)
+{
+	if (g_getenv("GOOGLECHAT_TEST_VERBOSE") != NULL) {
+		g_log_default_handler(log_domain, log_level, message, user_data);
+	}
+}
+
+void
+fake_purple_init(void)
+{
+	// Unreferencing an image emits a signal
+	purple_signals_init();
+	purple_imgstore_init();
+	
+	purple_debug_set_ui_ops(&fake_debug_ui_ops);
+	g_log_set_handler(NULL, G_LOG_LEVEL_CRITICAL, fake_log_critical, NULL);
+}
+
+void
+fake_purple_reset(void)
+{
+	memset(&fake_purple_counts, 0, sizeof(fake_purple_counts));
+}
+
+void
+fake_purple_set_debug(gboolean enabled)
+{
+	fake_debug_enabled = enabled;
+}
+
+void
+fake_purple_set_image(PurpleStoredImage *image)
+{
+	fake_image = image;
+}
+
+/*** libpurple replacements **************************************************/
+
+void
+serv_got_im(PurpleConnection *gc, const char *who, const char *msg, PurpleMessageFlags flags, time_t mtime)
+{
+	fake_purple_counts.got_im++;
+}
+
+void
+serv_got_chat_in(PurpleConnection *g, int id, const char *who, PurpleMessageFlags flags, const char *message, time_t mtime)
+{
+	fake_purple_counts.got_chat_in++;
+}
+
+void
+serv_got_typing(PurpleConnection *gc, const char *name, int timeout, PurpleTypingState state)
+{
+	fake_purple_counts.got_typing++;
+}
+
+PurpleBuddy *
+purple_find_buddy(PurpleAccount *account, const char *name)
+{
+	return NULL;
+}
+
+PurpleStoredImage *
+purple_imgstore_find_by_id(int id)
+{
+	return fake_image;
+}
+
+/*** HTTP ********************************************************************/
+
+struct _PurpleHttpRequest {
+	int ref_count;
+	gchar *url;
+	gchar *method;
+	GHashTable *headers;
+	gchar *contents;
+	int contents_length;
+	PurpleHttpCookieJar *cookie_jar;
+	PurpleHttpContentWriter response_writer;
+	gpointer response_writer_data;
+};
+
+struct _PurpleHttpResponse {
+	int code;
+	gchar *error;
+	GString *data;
+	GHashTable *headers;         // Lower-cased names
+};
+
+struct _PurpleHttpConnection {
+	PurpleConnection *gc;
+	PurpleHttpRequest *request;
+	PurpleHttpResponse *response;
+	PurpleHttpCallback callback;
+	gpointer user_data;
+};
+
+struct _PurpleHttpCookieJar {
+	int ref_count;
+	GHashTable *cookies;
+};
+
+struct _PurpleHttpKeepalivePool {
+	int ref_count;
+};
+
+static GQueue fake_http_pending = G_QUEUE_INIT;
+static PurpleConnection *fake_http_cancelling_gc;
+
+// From purple-socket.c, which isn't built in either
+void
+_purple_socket_init(void)
+{
+}
+
+void
+_purple_socket_uninit(void)
+{
+}
+
+void
+purple_http_init(void)
+{
+}
+
+void
+purple_http_uninit(void)
+{
+}
+
+PurpleHttpRequest *
+purple_http_request_new(const gchar *url)
+{
+	PurpleHttpRequest *request = g_new0(PurpleHttpRequest, 1);
+
+	request->ref_count = 1;
+	request->url = g_strdup(url);
+	request->method = g_strdup("GET");
+	request->headers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	return request;
+}
+
+PurpleHttpRequest *
+purple_http_request_unref(PurpleHttpRequest *request)
+{
+	if (request == NULL || --request->ref_count > 0) {
+		return request;
+	}
+
+	g_free(request->url);
+	g_free(request->method);
+	g_hash_table_destroy(request->headers);
+	g_free(request->contents);
+	purple_http_cookie_jar_unref(request->cookie_jar);
+	g_free(request);
+	return NULL;
+}
+
+void
+purple_http_request_set_url(PurpleHttpRequest *request, const gchar *url)
+{
+	g_free(request->url);
+	request->url = g_strdup(url);
+}
+
+void
+purple_http_request_set_url_printf(PurpleHttpRequest *request, const gchar *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	g_free(request->url);
+	request->url = g_strdup_vprintf(format, args);
+	va_end(args);
+}
+
+const gchar *
+purple_http_request_get_url(PurpleHttpRequest *request)
+{
+	return request->url;
+}
+
+void
+purple_http_request_set_method(PurpleHttpRequest *request, const gchar *method)
+{
+	g_free(request->method);
+	request->method = g_strdup(method);
+}
+
+void
+purple_http_request_set_contents(PurpleHttpRequest *request, const gchar *contents, int length)
+{
+	if (length < 0) {
+		length = contents ? strlen(contents) : 0;
+	}
+
+	g_free(request->contents);
+	request->contents = g_memdup(contents, length);
+	request->contents_length = length;
+}
+
+void
+purple_http_request_set_cookie_jar(PurpleHttpRequest *request, PurpleHttpCookieJar *cookie_jar)
+{
+	if (cookie_jar != NULL) {
+		cookie_jar->ref_count++;
+	}
+	purple_http_cookie_jar_unref(request->cookie_jar);
+	request->cookie_jar = cookie_jar;
+}
+
+void
+purple_http_request_set_keepalive_pool(PurpleHttpRequest *request, PurpleHttpKeepalivePool *pool)
+{
+}
+
+void
+purple_http_request_set_timeout(PurpleHttpRequest *request, int timeout)
+{
+}
+
+void
+purple_http_request_set_max_len(PurpleHttpRequest *request, int max_len)
+{
+}
+
+void
+purple_http_request_set_response_writer(PurpleHttpRequest *request, PurpleHttpContentWriter writer, gpointer user_data)
+{
+	request->response_writer = writer;
+	request->response_writer_data = user_data;
+}
+
+void
+purple_http_request_header_set(PurpleHttpRequest *request, const gchar *key, const gchar *value)
+{
+	if (value == NULL) {
+		g_hash_table_remove(request->headers, key);
+	} else {
+		g_hash_table_replace(request->headers, g_strdup(key), g_strdup(value));
+	}
+}
+
+void
+purple_http_request_header_set_printf(PurpleHttpRequest *request, const gchar *key, const gchar *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	g_hash_table_replace(request->headers, g_strdup(key), g_strdup_vprintf(format, args));
+	va_end(args);
+}
+
+PurpleHttpCookieJar *
+purple_http_cookie_jar_new(void)
+{
+	PurpleHttpCookieJar *cookie_jar = g_new0(PurpleHttpCookieJar, 1);
+
+	cookie_jar->ref_count = 1;
+	cookie_jar->cookies = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	return cookie_jar;
+}
+
+PurpleHttpCookieJar *
+purple_http_cookie_jar_unref(PurpleHttpCookieJar *cookie_jar)
+{
+	if (cookie_jar == NULL || --cookie_jar->ref_count > 0) {
+		return cookie_jar;
+	}
+
+	g_hash_table_destroy(cookie_jar->cookies);
+	g_free(cookie_jar);
+	return NULL;
+}
+
+gchar *
+purple_http_cookie_jar_get(PurpleHttpCookieJar *cookie_jar, const gchar *name)
+{
+	return g_strdup(g_hash_table_lookup(cookie_jar->cookies, name));
+}
+
+PurpleHttpKeepalivePool *
+purple_http_keepalive_pool_new(void)
+{
+	PurpleHttpKeepalivePool *pool = g_new0(PurpleHttpKeepalivePool, 1);
+
+	pool->ref_count = 1;
+	return pool;
+}
+
+PurpleHttpKeepalivePool *
+purple_http_keepalive_pool_unref(PurpleHttpKeepalivePool *pool)
+{
+	if (pool == NULL || --pool->ref_count > 0) {
+		return pool;
+	}
+
+	g_free(pool);
+	return NULL;
+}
+
+void
+purple_http_keepalive_pool_set_limit_per_host(PurpleHttpKeepalivePool *pool, guint limit)
+{
+}
+
+PurpleHttpConnection *
+purple_http_request(PurpleConnection *gc, PurpleHttpRequest *request, PurpleHttpCallback callback, gpointer user_data)
+{
+	PurpleHttpConnection *http_conn;
+
+	g_return_val_if_fail(request != NULL, NULL);
+
+	if (gc != NULL && gc == fake_http_cancelling_gc) {
+		// The same as http.c, nothing new can start while a connection's requests are being cancelled
+		return NULL;
+	}
+
+	http_conn = g_new0(PurpleHttpConnection, 1);
+	http_conn->gc = gc;
+	http_conn->request = request;
+	request->ref_count++;
+	http_conn->response = g_new0(PurpleHttpResponse, 1);
+	http_conn->response->data = g_string_new(NULL);
+	http_conn->response->headers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	http_conn->callback = callback;
+	http_conn->user_data = user_data;
+
+	g_queue_push_tail(&fake_http_pending, http_conn);
+	return http_conn;
+}
+
+// Calls back and frees the connection, which has to be pending
+static void
+fake_http_finish(PurpleHttpConnection *http_conn)
+{
+	PurpleHttpResponse *response = http_conn->response;
+
+	g_queue_remove(&fake_http_pending, http_conn);
+
+	if (http_conn->callback != NULL) {
+		http_conn->callback(http_conn, response, http_conn->user_data);
+	}
+
+	purple_http_request_unref(http_conn->request);
+	g_free(response->error);
+	g_string_free(response->data, TRUE);
+	g_hash_table_destroy(response->headers);
+	g_free(response);
+	g_free(http_conn);
+}
+
+void
+purple_http_conn_cancel(PurpleHttpConnection *http_conn)
+{
+	if (http_conn == NULL || g_queue_find(&fake_http_pending, http_conn) == NULL) {
+		return;
+	}
+
+	http_conn->response->code = 0;
+	fake_http_finish(http_conn);
+}
+
+void
+purple_http_conn_cancel_all(PurpleConnection *gc)
+{
+	GList *cur, *next;
+
+	fake_http_cancelling_gc = gc;
+	for (cur = fake_http_pending.head; cur != NULL; cur = next) {
+		PurpleHttpConnection *http_conn = cur->data;
+
+		next = cur->next;
+		if (http_conn->gc == gc) {
+			purple_http_conn_cancel(http_conn);
+			// The callback may have cancelled others too
+			next = fake_http_pending.head;
+		}
+	}
+	fake_http_cancelling_gc = NULL;
+}
+
+gboolean
+purple_http_conn_is_running(PurpleHttpConnection *http_conn)
+{
+	return http_conn != NULL && g_queue_find(&fake_http_pending, http_conn) != NULL;
+}
+
+PurpleHttpRequest *
+purple_http_conn_get_request(PurpleHttpConnection *http_conn)
+{
+	return http_conn->request;
+}
+
+PurpleConnection *
+purple_http_conn_get_purple_connection(PurpleHttpConnection *http_conn)
+{
+	return http_conn->gc;
+}
+
+gboolean
+purple_http_response_is_successful(PurpleHttpResponse *response)
+{
+	return response->code / 100 == 2;
+}
+
+int
+purple_http_response_get_code(PurpleHttpResponse *response)
+{
+	return response->code;
+}
+
+const gchar *
+purple_http_response_get_error(PurpleHttpResponse *response)
+{
+	if (response->error != NULL) {
+		return response->error;
+	}
+	if (!purple_http_response_is_successful(response)) {
+		return response->code <= 0 ? "Unknown HTTP error" : "Invalid HTTP response code";
+	}
+	return NULL;
+}
+
+const gchar *
+purple_http_response_get_data(PurpleHttpResponse *response, size_t *len)
+{
+	if (len != NULL) {
+		*len = response->data->len;
+	}
+	return response->data->str;
+}
+
+const gchar *
+purple_http_response_get_header(PurpleHttpResponse *response, const gchar *name)
+{
+	gchar *lower = g_ascii_strdown(name, -1);
+	const gchar *value = g_hash_table_lookup(response->headers, lower);
+
+	g_free(lower);
+	return value;
+}
+
+guint
+fake_http_pending_count(void)
+{
+	return g_queue_get_length(&fake_http_pending);
+}
+
+PurpleHttpConnection *
+fake_http_find(const gchar *url_part)
+{
+	GList *cur;
+
+	for (cur = fake_http_pending.head; cur != NULL; cur = cur->next) {
+		PurpleHttpConnection *http_conn = cur->data;
+
+		if (http_conn->request->url != NULL && strstr(http_conn->request->url, url_part) != NULL) {
+			return http_conn;
+		}
+	}
+	return NULL;
+}
+
+void
+fake_http_respond(PurpleHttpConnection *http_conn, int code, const gchar *header_name, const gchar *header_value, const gchar *body, gsize body_len)
+{
+	PurpleHttpRequest *request = http_conn->request;
+	PurpleHttpResponse *response = http_conn->response;
+
+	g_return_if_fail(g_queue_find(&fake_http_pending, http_conn) != NULL);
+
+	response->code = code;
+	if (header_name != NULL) {
+		g_hash_table_replace(response->headers, g_ascii_strdown(header_name, -1), g_strdup(header_value));
+	}
+
+	if (request->response_writer != NULL) {
+		if (!request->response_writer(http_conn, response, body, 0, body_len, request->response_writer_data)) {
+			response->error = g_strdup("Error handling retrieved data");
+		}
+	} else {
+		g_string_append_len(response->data, body, body_len);
+	}
+
+	fake_http_finish(http_conn);
+}
@@ -0,0 +1,72 @@
+/*
+ * GoogleChat Plugin for libpurple/Pidgin
+ * Copyright (c) 2015-2016 Eion Robb, Mike Ruprecht
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FAKE_PURPLE_H_
+#define _FAKE_PURPLE_H_
+
+#include <glib.h>
+#include <purple.h>
+
+#include "http.h"
+
+/*
+ * Stand-ins for the parts of libpurple the tests need to drive or watch.  Everything
+ * not listed here is the real libpurple.
+ */
+
+// What the event handlers did, see fake_purple_reset()
+typedef struct {
+	guint got_im;        // serv_got_im()
+	guint got_chat_in;   // serv_got_chat_in()
+	guint got_typing;    // serv_got_typing()
+	guint other_events;  // googlechat_received_other_notification() logging an event
+	guint debug_errors;  // purple_debug_error() lines from the plugin
+} FakePurpleCounts;
+
+extern FakePurpleCounts fake_purple_counts;
+
+void fake_purple_init(void);
+void fake_purple_reset(void);
+
+/**
+ * Whether debug lines are formatted and counted.  Switched off while timing, as
+ * formatting them would cost more than the code being timed.
+ */
+void fake_purple_set_debug(gboolean enabled);
+
+/**
+ * The image purple_imgstore_find_by_id() hands back, whatever the id.
+ */
+void fake_purple_set_image(PurpleStoredImage *image);
+
+/**
+ * HTTP requests are held until the test answers them, or they are cancelled.
+ */
+guint fake_http_pending_count(void);
+// The oldest pending request whose URL contains url_part
+PurpleHttpConnection *fake_http_find(const gchar *url_part);
+// Completes a request, calling its callback.  header_name may be NULL
+void fake_http_respond(PurpleHttpConnection *http_conn, int code, const gchar *header_name, const gchar *header_value, const gchar *body, gsize body_len);
+
+/**
+ * Counts of blocks handed out and given back by malloc() and friends, process wide.
+ */
+gsize fake_alloc_count(void);
+gssize fake_alloc_outstanding(void);
+
+#endif /*_FAKE_PURPLE_H_*/
@@ -0,0 +1,490 @@
+/*
+ * GoogleChat Plugin for libpurple/Pidgin
+ * Copyright (c) 2015-2016 Eion Robb, Mike Ruprecht
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: googlechat_test sample.stream [recording.stream...]
+ *
+ * Feeds the webchannel stream in sample.stream (see streams/make-sample.sh) through
+ * googlechat_process_channel_buffer() whole and in pieces, checking which handlers
+ * it reaches each time, then times it and counts its allocations.  Streams saved
+ * with the "record_channel" account option can be given too; they're only checked
+ * for framing, and timed.  Closing the account with requests in flight is checked for
+ * leaks as well.
+ *
+ * Set GOOGLECHAT_TEST_VERBOSE to see the plugin's debug output.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fake_purple.h"
+
+#include "libgooglechat.h"
+#include "googlechat_connection.h"
+#include "googlechat_conversation.h"
+
+#define TEST_SAMPLE_RUNS 2000
+#define TEST_RECORDING_MIN_USEC (G_USEC_PER_SEC / 2)
+#define TEST_RECORDING_PIECE 4096
+
+static guint test_failures;
+
+static void
+test_check_uint(const gchar *what, guint64 got, guint64 expected, int line)
+{
+	if (got != expected) {
+		g_printerr("%s:%d: %s was %" G_GUINT64_FORMAT ", expected %" G_GUINT64_FORMAT "\n", __FILE__, line, what, got, expected);
+		test_failures++;
+	}
+}
+
+#define TEST_CHECK_UINT(got, expected) test_check_uint(#got, (got), (expected), __LINE__)
+#define TEST_CHECK(expr) test_check_uint(#expr, !!(expr), TRUE, __LINE__)
+
+/* The fields googlechat_login() sets up that the stream handlers use, and no more */
+static GoogleChatAccount *
+test_account_new(void)
+{
+	GoogleChatAccount *ha = g_new0(GoogleChatAccount, 1);
+	PurpleConnection *pc = g_new0(PurpleConnection, 1);
+
+	ha->pc = pc;
+	purple_connection_set_protocol_data(pc, ha);
+
+	ha->cookie_jar = purple_http_cookie_jar_new();
+	ha->channel_buffer = g_byte_array_sized_new(GOOGLECHAT_BUFFER_DEFAULT_SIZE);
+	ha->channel_buffer_shrink_size = GOOGLECHAT_CHANNEL_BUFFER_SHRINK_DEFAULT_KB * 1024;
+	googlechat_set_server_url(ha, NULL);
+	ha->channel_keepalive_pool = purple_http_keepalive_pool_new();
+	ha->api_keepalive_pool = purple_http_keepalive_pool_new();
+	ha->sent_message_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	ha->protobuf_arena = googlechat_arena_new(GOOGLECHAT_ARENA_BLOCK_SIZE);
+	ha->base64_scratch = g_byte_array_sized_new(GOOGLECHAT_BUFFER_DEFAULT_SIZE);
+	googlechat_api_queues_init(ha);
+	googlechat_request_header_init(ha);
+	ha->api_pack_buffer = g_byte_array_sized_new(GOOGLECHAT_BUFFER_DEFAULT_SIZE);
+
+	ha->one_to_ones = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	ha->one_to_ones_rev = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	ha->group_chats = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	ha->pending_presence_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	ha->presence_refreshed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	ha->presence_statuses = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	googlechat_member_lookups_init(ha);
+
+	ha->self_gaia_id = g_strdup("999");
+	ha->access_token = g_strdup("test-token");
+
+	return ha;
+}
+
+static void
+test_account_free(GoogleChatAccount *ha)
+{
+	if (ha->last_event_timestamp_save_timeout) {
+		g_source_remove(ha->last_event_timestamp_save_timeout);
+	}
+
+	googlechat_cancel_requests(ha);
+	TEST_CHECK_UINT(fake_http_pending_count(), 0);
+
+	purple_http_keepalive_pool_unref(ha->channel_keepalive_pool);
+	purple_http_keepalive_pool_unref(ha->api_keepalive_pool);
+	g_free(ha->self_gaia_id);
+	g_free(ha->access_token);
+	g_free(ha->server_url);
+	g_free(ha->channel_url_prefix);
+	purple_http_cookie_jar_unref(ha->cookie_jar);
+	g_byte_array_free(ha->channel_buffer, TRUE);
+	googlechat_arena_free(ha->protobuf_arena);
+	g_byte_array_free(ha->base64_scratch, TRUE);
+	g_byte_array_free(ha->api_pack_buffer, TRUE);
+	g_free(ha->request_header_packed);
+
+	g_hash_table_unref(ha->sent_message_ids);
+	g_hash_table_unref(ha->one_to_ones);
+	g_hash_table_unref(ha->one_to_ones_rev);
+	g_hash_table_unref(ha->group_chats);
+	g_hash_table_unref(ha->pending_presence_ids);
+	g_hash_table_unref(ha->presence_refreshed);
+	g_hash_table_unref(ha->presence_statuses);
+	googlechat_member_lookups_free(ha);
+
+	g_free(ha->pc);
+	g_free(ha);
+}
+
+/* Back to the start of a stream, as after googlechat_longpoll_request_closed() */
+static void
+test_account_reset(GoogleChatAccount *ha)
+{
+	g_byte_array_set_size(ha->channel_buffer, 0);
+	ha->channel_buffer_pos = 0;
+	ha->channel_chunk_len = 0;
+	ha->channel_chunk_len_done = FALSE;
+	ha->channel_events_received = 0;
+	ha->presence_pushes = 0;
+	ha->last_aid = 0;
+	fake_purple_reset();
+}
+
+/*
+ * Hands the stream over in pieces of at most max_piece bytes (or of random sizes if
+ * rand is given), the way googlechat_longpoll_request_content() gets it off the network.
+ */
+static gboolean
+test_feed(GoogleChatAccount *ha, const gchar *data, gsize len, gsize max_piece, GRand *rand)
+{
+	gsize offset = 0;
+
+	while (offset < len) {
+		gsize piece = MIN(max_piece, len - offset);
+
+		if (rand != NULL) {
+			piece = g_rand_int_range(rand, 1, piece + 1);
+		}
+
+		g_byte_array_append(ha->channel_buffer, (const guint8 *) data + offset, piece);
+		offset += piece;
+
+		if (!googlechat_process_channel_buffer(ha)) {
+			return FALSE;
+		}
+
+		// What googlechat_compact_channel_buffer() does between reads
+		g_byte_array_remove_range(ha->channel_buffer, 0, ha->channel_buffer_pos);
+		ha->channel_buffer_pos = 0;
+	}
+
+	return TRUE;
+}
+
+/* Everything sample.stream should have set off */
+static void
+test_check_sample_results(GoogleChatAccount *ha, const gchar *how)
+{
+	g_print("  %s\n", how);
+
+	TEST_CHECK_UINT(ha->channel_events_received, 5);
+	TEST_CHECK_UINT(ha->last_aid, 7);
+	TEST_CHECK_UINT(fake_purple_counts.got_typing, 3);
+	TEST_CHECK_UINT(fake_purple_counts.got_im, 1);
+	TEST_CHECK_UINT(fake_purple_counts.got_chat_in, 0);
+	TEST_CHECK_UINT(ha->presence_pushes, 1);
+	TEST_CHECK_UINT(fake_purple_counts.other_events, 1);
+	TEST_CHECK_UINT(fake_purple_counts.debug_errors, 0);
+	TEST_CHECK(!ha->channel_chunk_len_done);
+	TEST_CHECK_UINT(ha->channel_buffer->len, 0);
+}
+
+static void
+test_sample(GoogleChatAccount *ha, const gchar *data, gsize len)
+{
+	GRand *rand = g_rand_new_with_seed(19);
+	guint i;
+
+	g_print("Sample stream\n");
+
+	test_account_reset(ha);
+	TEST_CHECK(test_feed(ha, data, len, len, NULL));
+	test_check_sample_results(ha, "in one piece");
+
+	test_account_reset(ha);
+	TEST_CHECK(test_feed(ha, data, len, 1, NULL));
+	test_check_sample_results(ha, "a byte at a time");
+
+	for (i = 0; i < 5; i++) {
+		test_account_reset(ha);
+		TEST_CHECK(test_feed(ha, data, len, 64, rand));
+		test_check_sample_results(ha, "in random pieces");
+	}
+
+	g_rand_free(rand);
+}
+
+/* A frame length that can't be right has to stop the stream rather than be guessed around */
+static void
+test_bad_length(GoogleChatAccount *ha, const gchar *stream, gint64 last_aid, const gchar *how)
+{
+	g_print("  %s\n", how);
+
+	test_account_reset(ha);
+	TEST_CHECK(!test_feed(ha, stream, strlen(stream), strlen(stream), NULL));
+	TEST_CHECK_UINT(fake_purple_counts.debug_errors, 1);
+	TEST_CHECK_UINT(ha->last_aid, last_aid);
+}
+
+static void
+test_bad_lengths(GoogleChatAccount *ha)
+{
+	g_print("Malformed frame lengths\n");
+
+	test_bad_length(ha, "12x\n[[1,[\"noop\"]]]\n", 0, "a non-digit");
+	test_bad_length(ha, "0\n[[1,[\"noop\"]]]\n", 0, "zero");
+	test_bad_length(ha, "99999999\n[[1,[\"noop\"]]]\n", 0, "too long");
+	test_bad_length(ha, "15\n[[1,[\"noop\"]]]\n-1\n", 1, "a non-digit after a good frame");
+}
+
+/* The usual keepalive, which shouldn't cost an allocation once everything is warmed up */
+static void
+test_noop_allocations(GoogleChatAccount *ha)
+{
+	const gchar *frame = "15\n[[1,[\"noop\"]]]\n";
+	gsize allocs;
+	guint i;
+
+	g_print("Allocations for noop frames\n");
+
+	fake_purple_set_debug(FALSE);
+	test_account_reset(ha);
+	test_feed(ha, frame, strlen(frame), strlen(frame), NULL);
+
+	allocs = fake_alloc_count();
+	for (i = 0; i < 1000; i++) {
+		test_feed(ha, frame, strlen(frame), strlen(frame), NULL);
+	}
+	TEST_CHECK_UINT(fake_alloc_count() - allocs, 0);
+	TEST_CHECK_UINT(ha->last_aid, 1);
+	fake_purple_set_debug(TRUE);
+}
+
+/* Replays a stream repeatedly with debug output off, which is how most people run */
+static void
+test_time_stream(GoogleChatAccount *ha, const gchar *name, const gchar *data, gsize len, guint min_runs, gboolean check_leaks)
+{
+	gint64 start, elapsed = 0;
+	gsize allocs;
+	gssize outstanding;
+	guint64 events = 0;
+	guint runs = 0;
+
+	fake_purple_set_debug(FALSE);
+
+	// The first run fills the arena and any caches
+	test_account_reset(ha);
+	test_feed(ha, data, len, TEST_RECORDING_PIECE, NULL);
+	purple_http_conn_cancel_all(ha->pc);
+
+	allocs = fake_alloc_count();
+	outstanding = fake_alloc_outstanding();
+	start = g_get_monotonic_time();
+
+	do {
+		test_account_reset(ha);
+		if (!test_feed(ha, data, len, TEST_RECORDING_PIECE, NULL)) {
+			break;
+		}
+		// Lookups the events started; there's nobody to answer them
+		purple_http_conn_cancel_all(ha->pc);
+
+		events += ha->channel_events_received;
+		runs++;
+		elapsed = g_get_monotonic_time() - start;
+	} while (runs < min_runs || elapsed < TEST_RECORDING_MIN_USEC);
+
+	allocs = fake_alloc_count() - allocs;
+	if (check_leaks) {
+		TEST_CHECK_UINT(fake_alloc_outstanding() - outstanding, 0);
+	}
+
+	fake_purple_set_debug(TRUE);
+
+	if (events == 0) {
+		g_print("  %s: no events\n", name);
+		return;
+	}
+	g_print("  %s: %" G_GUINT64_FORMAT " events in %u runs, %.0f events/s, %.1f allocations/event\n", name,
+	        events, runs, events * (gdouble) G_USEC_PER_SEC / MAX(elapsed, 1), allocs / (gdouble) events);
+}
+
+static void
+test_recording(GoogleChatAccount *ha, const gchar *filename)
+{
+	gchar *data;
+	gsize len;
+	GError *error = NULL;
+
+	if (!g_file_get_contents(filename, &data, &len, &error)) {
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+		test_failures++;
+		return;
+	}
+
+	test_account_reset(ha);
+	TEST_CHECK(test_feed(ha, data, len, TEST_RECORDING_PIECE, NULL));
+	purple_http_conn_cancel_all(ha->pc);
+	test_time_stream(ha, filename, data, len, 1, FALSE);
+
+	g_free(data);
+}
+
+/* Enough of a PNG for purple_imgstore_get_extension() */
+static const guint8 test_png[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n', 0, 0, 0, 0 };
+
+static void
+test_close_with_upload(void)
+{
+	GoogleChatAccount *ha;
+	PurpleStoredImage *image;
+	PurpleHttpConnection *http_conn;
+	gssize outstanding;
+	guint round;
+
+	g_print("Closing with an image upload in flight\n");
+
+	// The first round is a warm-up, for anything GLib or libpurple sets up once and keeps
+	for (round = 0; round < 2; round++) {
+		outstanding = fake_alloc_outstanding();
+
+		ha = test_account_new();
+		g_hash_table_insert(ha->one_to_ones, g_strdup("dm1"), g_strdup("111"));
+		g_hash_table_insert(ha->one_to_ones_rev, g_strdup("111"), g_strdup("dm1"));
+		image = purple_imgstore_add(g_memdup(test_png, sizeof(test_png)), sizeof(test_png), "test.png");
+		fake_purple_set_image(image);
+
+		googlechat_send_im(ha->pc, "111", "look <img id=\"1\">", PURPLE_MESSAGE_SEND);
+		TEST_CHECK(fake_http_find("/api/create_topic") != NULL);
+
+		// Get as far as uploading the image itself
+		http_conn = fake_http_find("/uploads?");
+		TEST_CHECK(http_conn != NULL);
+		if (http_conn != NULL) {
+			fake_http_respond(http_conn, 200, "X-Goog-Upload-URL", "https://chat.google.com/uploads/test-upload", "", 0);
+		}
+		TEST_CHECK(fake_http_find("/uploads/test-upload") != NULL);
+		TEST_CHECK_UINT(fake_http_pending_count(), 2);
+
+		test_account_free(ha);
+		fake_purple_set_image(NULL);
+		purple_imgstore_unref(image);
+
+		if (round > 0) {
+			TEST_CHECK_UINT(fake_alloc_outstanding() - outstanding, 0);
+		}
+	}
+}
+
+typedef struct {
+	GetGroupRequest *request;
+	guint answers;
+	gboolean ask_again;
+} TestGetGroup;
+
+static void
+test_get_group_cb(GoogleChatAccount *ha, GetGroupResponse *response, gpointer user_data)
+{
+	TestGetGroup *test = user_data;
+
+	TEST_CHECK(response == NULL);
+	test->answers++;
+
+	// What a caller that retries on failure would do, while the account is closing
+	if (test->ask_again) {
+		test->ask_again = FALSE;
+		googlechat_api_get_group(ha, test->request, test_get_group_cb, test);
+	}
+}
+
+static void
+test_close_with_reads(void)
+{
+	GoogleChatAccount *ha;
+	GetGroupRequest request;
+	GroupId group_id;
+	SpaceId space_id;
+	TestGetGroup test;
+	gssize outstanding;
+	guint round;
+
+	g_print("Closing with cached reads in flight\n");
+
+	for (round = 0; round < 2; round++) {
+		outstanding = fake_alloc_outstanding();
+
+		ha = test_account_new();
+		get_group_request__init(&request);
+		group_id__init(&group_id);
+		space_id__init(&space_id);
+		space_id.space_id = (gchar *) "space1";
+		group_id.space_id = &space_id;
+		request.group_id = &group_id;
+		request.request_header = googlechat_get_request_header(ha);
+
+		memset(&test, 0, sizeof(test));
+		test.request = &request;
+		test.ask_again = TRUE;
+
+		// The second one waits on the first, rather than going to the server too
+		googlechat_api_get_group(ha, &request, test_get_group_cb, &test);
+		googlechat_api_get_group(ha, &request, test_get_group_cb, &test);
+		TEST_CHECK_UINT(fake_http_pending_count(), 1);
+
+		test_account_free(ha);
+		TEST_CHECK_UINT(test.answers, 3);
+
+		if (round > 0) {
+			TEST_CHECK_UINT(fake_alloc_outstanding() - outstanding, 0);
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	GoogleChatAccount *ha;
+	gchar *sample;
+	gsize sample_len;
+	GError *error = NULL;
+	int i;
+
+	if (argc < 2) {
+		g_printerr("Usage: %s sample.stream [recording.stream...]\n", argv[0]);
+		return 2;
+	}
+	if (!g_file_get_contents(argv[1], &sample, &sample_len, &error)) {
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+		return 2;
+	}
+
+	fake_purple_init();
+	ha = test_account_new();
+
+	test_sample(ha, sample, sample_len);
+	test_bad_lengths(ha);
+	test_noop_allocations(ha);
+	test_close_with_upload();
+	test_close_with_reads();
+
+	g_print("Timing\n");
+	test_time_stream(ha, argv[1], sample, sample_len, TEST_SAMPLE_RUNS, TRUE);
+	for (i = 2; i < argc; i++) {
+		test_recording(ha, argv[i]);
+	}
+
+	test_account_free(ha);
+	g_free(sample);
+
+	if (test_failures > 0) {
+		g_printerr("%u checks failed\n", test_failures);
+		return 1;
+	}
+	g_print("All checks passed\n");
+	return 0;
+}
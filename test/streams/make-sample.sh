@@ -0,0 +1,105 @@
+#!/bin/sh
+# Regenerates sample.stream, a short webchannel stream in the format the
+# "record_channel" option saves, from the text-format events below.
+# Needs protoc.  Run from anywhere: sh test/streams/make-sample.sh
+set -e
+
+cd "$(dirname "$0")"
+PROTO_DIR=../..
+
+encode() {
+	protoc --encode=StreamEventsResponse -I "$PROTO_DIR" "$PROTO_DIR/googlechat.proto" | base64 | tr -d '\n'
+}
+
+typing=$(encode <<'PB'
+event {
+  type: TYPING_STATE_CHANGED
+  user_id { id: "111" }
+  body {
+    event_type: TYPING_STATE_CHANGED
+    typing_state_changed_event {
+      state: TYPING
+      user_id { id: "111" }
+      context { group_id { dm_id { dm_id: "dm1" } } }
+    }
+  }
+}
+PB
+)
+
+message=$(encode <<'PB'
+event {
+  type: MESSAGE_POSTED
+  body {
+    event_type: MESSAGE_POSTED
+    message_posted {
+      message {
+        id {
+          parent_id { topic_id { group_id { dm_id { dm_id: "dm1" } } topic_id: "t1" } }
+          message_id: "m1"
+        }
+        creator { user_id { id: "111" } }
+        create_time: 1700000000000000
+        text_body: "hello <world>"
+      }
+    }
+  }
+}
+PB
+)
+
+presence=$(encode <<'PB'
+event {
+  type: USER_STATUS_UPDATED_EVENT
+  body {
+    event_type: USER_STATUS_UPDATED_EVENT
+    user_status_updated_event { user_status { user_id { id: "111" } } }
+  }
+}
+PB
+)
+
+other=$(encode <<'PB'
+event {
+  type: GROUP_STARRED
+  body { event_type: GROUP_STARRED }
+}
+PB
+)
+
+# A bare body plus one more in bodies, which get dispatched one after the other
+multi=$(encode <<'PB'
+event {
+  type: TYPING_STATE_CHANGED
+  body {
+    event_type: TYPING_STATE_CHANGED
+    typing_state_changed_event {
+      state: TYPING
+      user_id { id: "222" }
+      context { group_id { dm_id { dm_id: "dm2" } } }
+    }
+  }
+  bodies {
+    event_type: TYPING_STATE_CHANGED
+    typing_state_changed_event {
+      state: STOPPED
+      user_id { id: "222" }
+      context { group_id { dm_id { dm_id: "dm2" } } }
+    }
+  }
+}
+PB
+)
+
+frame() {
+	printf '%d\n%s\n' $((${#1} + 1)) "$1"
+}
+
+{
+	frame '[[1,["noop"]]]'
+	frame "[[2,[{\"data\":\"$typing\"}]],[3,[{\"data\":\"$message\"}]]]"
+	frame "[[4,[{\"data\":\"$presence\"}]],[5,[{\"data\":\"$other\"}]]]"
+	frame "[[6,[{\"data\":\"$multi\"}]]]"
+	# An escaped string, which the fast scanner leaves to json-glib
+	frame '[[7,["no\u006fp"]]]'
+} > sample.stream